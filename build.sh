@@ -5,8 +5,16 @@ set -xe
 CFLAGS="-Wall -Wextra -Werror `pkg-config --cflags sdl2`"
 LIBS=`pkg-config --libs sdl2`
 
-cc $CFLAGS -o chip8.test $LIBS chip8_test.c
+cc $CFLAGS -o chip8.test $LIBS chip8_test.c -lpthread
+cc $CFLAGS -DCHIP8_PROFILING -o chip8.test.prof chip8_test.c -lpthread
+cc $CFLAGS -g -fsanitize=thread -o chip8.test.tsan chip8_test.c -lpthread
 cc $CFLAGS -o chip8.sdl $LIBS chip8_sdl.c
 cc $CFLAGS -o chip8.term $LIBS chip8_term.c
+cc $CFLAGS -O2 -o chip8.bench chip8_bench.c -lpthread
+cc $CFLAGS -O2 -DCHIP8_PROFILING -o chip8.bench.prof chip8_bench.c -lpthread
+cc $CFLAGS -o chip8.aot chip8_aot.c
+cc $CFLAGS -o chip8.trace chip8_tracedump.c
+cc $CFLAGS -O2 -o chip8.conform chip8_conform.c
+./chip8.conform
 
-clang -O3 --target=wasm32 --no-standard-libraries -Wl,--no-entry,--allow-undefined,--export-all -o chip8.wasm chip8_wasm.c
+clang -O3 --target=wasm32 -mbulk-memory --no-standard-libraries -Wl,--no-entry,--allow-undefined,--export-all -o chip8.wasm chip8_wasm.c
@@ -11,38 +11,316 @@
 #include <stdint.h>
 #endif
 
-#define MAX_SUBROUTINES 32
-#define CLOCK_RATE 300 // Cycles per second (Hz)
-#define MS_PER_CYCLE (1000.0f / CLOCK_RATE)
+#define CHIP8_FUSED_MAX 3 // Most instructions a superinstruction stands for
+#define MAX_SUBROUTINES 16 // Power of two, the call stack is a ring of that many return addresses
+#define CLOCK_RATE 300     // Default cycles per second (Hz), see Chip8.clock_rate
+#define TIMER_RATE 60      // Delay and sound timers count down at 60 Hz
+#define MAX_BACKLOG_MS 100 // chip8_run_for drops time beyond this instead of catching up
+#define MAX_IDLE_SKIP (1u << 24) // Cycles chip8_skip_idle fast-forwards at once, keeps timer_phase in 32 bits
+#define RNG_SEED 0x2545f491 // CXNN state used until Chip8.rng_state is set
+#define MAX_ROM_SIZE (0x1000 - 0x200) // ROMs load at 0x200 and must end with memory
+#define CHIP8_PAGE_SIZE 256 // Granularity of Chip8.written_pages
+#define CHIP8_PAGES (0x1000/CHIP8_PAGE_SIZE)
+
+// Reasons for chip8_run_cycles to return before the budget is spent, see Chip8.stop_on
+typedef enum {
+    CHIP8_EVENT_FRAME    = 1 << 0, // Timers ticked (60 Hz frame boundary)
+    CHIP8_EVENT_WAIT_KEY = 1 << 1, // Fx0A is blocked waiting for a key
+    CHIP8_EVENT_DISPLAY  = 1 << 2, // 00E0 or DXYN changed the display
+    CHIP8_EVENT_IDLE     = 1 << 3, // Idle loop or blocked Fx0A skipped, nothing happens before the next timer tick or key
+} Chip8_Event;
+
+// Behaviours CHIP-8 variants disagree on, off means what the core did before profiles existed
+typedef enum {
+    CHIP8_QUIRK_SHIFT_VY     = 1 << 0, // 8XY6/8XYE shift Vy into Vx (COSMAC VIP) instead of shifting Vx
+    CHIP8_QUIRK_LOAD_STORE_I = 1 << 1, // FX55/FX65 leave I at I + X + 1 (COSMAC VIP)
+    CHIP8_QUIRK_JUMP_VX      = 1 << 2, // BXNN jumps to XNN + VX (CHIP-48, SCHIP) instead of NNN + V0
+    CHIP8_QUIRK_CLIP         = 1 << 3, // DXYN clips sprites at the screen edges instead of wrapping them
+    CHIP8_QUIRK_VF_RESET     = 1 << 4, // 8XY1/8XY2/8XY3 clear VF (COSMAC VIP)
+} Chip8_Quirk;
+
+// Quirk profiles: X(NAME, name, quirks). Each one is instantiated as its own handler table and
+// run loop, so the quirks are compile-time constants in the handlers and cost nothing at run time.
+#define CHIP8_PROFILES(X) \
+    X(DEFAULT, default, 0) \
+    X(COSMAC,  cosmac,  CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I | CHIP8_QUIRK_CLIP | CHIP8_QUIRK_VF_RESET) \
+    X(SCHIP,   schip,   CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP) \
+    X(XOCHIP,  xochip,  CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I)
+
+typedef enum {
+#define X(NAME, name, quirks) CHIP8_PROFILE_##NAME,
+    CHIP8_PROFILES(X)
+#undef X
+    CHIP8_PROFILE_COUNT,
+} Chip8_Profile;
+
+static const uint32_t chip8_profile_quirks[CHIP8_PROFILE_COUNT] = {
+#define X(NAME, name, quirks) [CHIP8_PROFILE_##NAME] = quirks,
+    CHIP8_PROFILES(X)
+#undef X
+};
+
+static const char *const chip8_profile_names[CHIP8_PROFILE_COUNT] = {
+#define X(NAME, name, quirks) [CHIP8_PROFILE_##NAME] = #name,
+    CHIP8_PROFILES(X)
+#undef X
+};
+
+// Handlers for pre-decoded instructions, see chip8_handlers
+typedef enum {
+    CHIP8_OP_UNDECODED = 0, // Cache entry is stale, decode on next use
+    CHIP8_OP_CLS,
+    CHIP8_OP_RET,
+    CHIP8_OP_SYS,
+    CHIP8_OP_JP,
+    CHIP8_OP_CALL,
+    CHIP8_OP_SE_IMM,
+    CHIP8_OP_SNE_IMM,
+    CHIP8_OP_SE_REG,
+    CHIP8_OP_LD_IMM,
+    CHIP8_OP_ADD_IMM,
+    CHIP8_OP_LD_REG,
+    CHIP8_OP_OR,
+    CHIP8_OP_AND,
+    CHIP8_OP_XOR,
+    CHIP8_OP_ADD_REG,
+    CHIP8_OP_SUB,
+    CHIP8_OP_SHR,
+    CHIP8_OP_SUBN,
+    CHIP8_OP_SHL,
+    CHIP8_OP_SNE_REG,
+    CHIP8_OP_LD_I,
+    CHIP8_OP_JP_V0,
+    CHIP8_OP_RND,
+    CHIP8_OP_DRW,
+    CHIP8_OP_SKP,
+    CHIP8_OP_SKNP,
+    CHIP8_OP_LD_VX_DT,
+    CHIP8_OP_LD_VX_K,
+    CHIP8_OP_LD_DT_VX,
+    CHIP8_OP_LD_ST_VX,
+    CHIP8_OP_ADD_I_VX,
+    CHIP8_OP_LD_F_VX,
+    CHIP8_OP_LD_B_VX,
+    CHIP8_OP_LD_MEM_VX,
+    CHIP8_OP_LD_VX_MEM,
+    CHIP8_OP_INVALID,
+    // Superinstructions: common sequences run by one handler, only ever in Chip8.decoded, see chip8_fuse
+    CHIP8_OP_LD_I_DRW,  // ANNN; DXYN: load a sprite address and draw it
+    CHIP8_OP_ADD_SE_JP, // 7XKK; 3XNN; 1MMM: counted loop
+    CHIP8_OP_DT_SE_JP,  // FX07; 3XNN; 1MMM: delay timer poll
+    CHIP8_OP_LD_IMM2,   // 6XNN; 6YMM
+    CHIP8_OP_SKIP_JP,   // 3XNN, 4XNN, 5XY0, 9XY0, EX9E or EXA1; 1NNN: conditional branch, n is the skip's Chip8_Op
+    CHIP8_OP_COUNT,
+} Chip8_Op;
+
+#ifdef CHIP8_PROFILING
+// Counters for where a program spends its cycles, kept while Chip8.profiling points at them.
+// Only compiled in with -DCHIP8_PROFILING, see chip8_profiling.c to write them out.
+typedef struct Chip8_Profiling {
+    uint64_t ops[CHIP8_OP_COUNT]; // Interpreted instructions per Chip8_Op
+    uint64_t pcs[0x1000];         // Interpreted instructions per address
+    uint16_t routines[0x1000];    // Subroutine each address last ran in (the CALL target), 0 for the top level
+    uint64_t draws;               // DXYN executed
+    uint64_t pixels;              // Sprite pixels DXYN flipped
+    uint64_t collisions;          // DXYN that set VF
+    uint64_t idle_cycles;         // Cycles chip8_skip_idle fast-forwarded
+    uint64_t wait_key_cycles;     // Cycles Fx0A spent blocked, executed or fast-forwarded
+} Chip8_Profiling;
+
+#define CHIP8_COUNT(cpu, field, n) do { if ((cpu)->profiling) (cpu)->profiling->field += (n); } while (0)
+#else
+#define CHIP8_COUNT(cpu, field, n) ((void)0)
+#endif
+
+#define CHIP8_EXEC_NO_REG 0xff
+
+// One instruction executed while tracing, with what it left behind
+typedef struct Chip8_Exec_Record {
+    uint64_t cycle; // Chip8.cycles before the instruction
+    uint16_t pc;
+    uint16_t inst;
+    uint16_t I;     // I after the instruction
+    uint8_t reg;    // Lowest V register the instruction changed, CHIP8_EXEC_NO_REG if none
+    uint8_t value;  // Its new value
+} Chip8_Exec_Record;
+
+// Ring of the last mask + 1 instructions chip8_run_cycles executed, filled while Chip8.exec_trace
+// points at it. chip8_exec_trace.c keeps one in a file mapping.
+typedef struct Chip8_Exec_Trace {
+    uint32_t mask;  // Capacity - 1, the capacity is a power of two
+    uint32_t reserved;
+    uint64_t count; // Records written so far, the newest is records[(count - 1) & mask]
+    Chip8_Exec_Record records[];
+} Chip8_Exec_Trace;
+
+// An instruction word with its operands already extracted
+typedef struct Chip8_Decoded {
+    uint8_t op;  // Chip8_Op
+    uint8_t odd; // Decoded from the odd address of its pair, see Chip8.decoded
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t nn;
+    uint16_t nnn;
+} Chip8_Decoded;
 
 typedef struct Chip8 {
+    // Hot: what the run loop touches on every instruction, the first cache line of the instance
     uint8_t V[16];
     uint16_t I;
     uint16_t PC;
-    uint8_t delay_timer; // TODO: Implement timers
+    uint8_t delay_timer;
     uint8_t sound_timer;
-    uint8_t keyboard[16];
+    uint16_t keyboard;     // Bit k is set while key k is down
+    uint8_t stack_pointer; // Calls made and not returned from, see call_stack
+    uint8_t profile;       // Chip8_Profile, chip8_load_rom picks the one known for the ROM
+    bool idle;             // Set by an instruction that leaves the program idling, see chip8_skip_idle
+    uint32_t timer_phase;  // Grows by TIMER_RATE per cycle, the timers tick each time it passes clock_rate
+    uint32_t events;       // Chip8_Event bits raised during the last run
+    uint32_t stop_on;      // Chip8_Event bits that end a run early
+    uint32_t clock_rate;   // Cycles per second (Hz), 0 means CLOCK_RATE
+    uint64_t cycles;       // Instructions executed since reset
+    uint64_t run_end;      // `cycles` the current chip8_run_cycles stops at, fused handlers mustn't run past it
+
+    // Return addresses of the calls made. ROMs like INVADERS leak a frame now and then, so
+    // stack_pointer keeps counting past MAX_SUBROUTINES and call_stack is indexed modulo it.
+    uint16_t call_stack[MAX_SUBROUTINES];
+    uint32_t rng_state;        // xorshift32 state for CXNN, 0 means RNG_SEED
+    uint16_t written_pages;    // Bit p is set by every write to memory page p, see chip8_snapshot.c
+    uint16_t key_presses;      // Keys that went down since Fx0A started waiting, see chip8_set_keys
+    bool key_wait;             // Fx0A is waiting for a key
+    uint32_t dirty_rows;       // Bit y is set when row y changed, see chip8_take_dirty_rows
+    uint32_t frame_generation; // Bumped by every instruction that changes the display
+    uint64_t cycle_credit;     // Time owed by chip8_run_for, in thousandths of a cycle
+    uint64_t dispatches;       // Handlers chip8_run_cycles called, or blocks and single instructions chip8_jit.c ran
+    uint64_t skipped_cycles;   // Cycles idle loops were fast-forwarded through, see chip8_skip_idle
+
+    uint64_t display[32]; // One row per word, bit 63 is the leftmost pixel, see chip8_pixel
 
     // 0x000-0x1FF - font data (modern implementations), interpreter itself (old)
     // 0x200-0x??? - program instructions
     // 0xEA0-0xEFF - call stack
     // 0xF00-0xFFF - display refresh
     uint8_t memory[0x1000];
-    uint8_t display[64*32];
 
-    uint8_t stack_pointer;
-    uint16_t call_stack[MAX_SUBROUTINES];
+    // One entry per pair of addresses of `memory`, filled lazily by chip8_run_cycles.
+    // Some ROMs keep all their code at odd addresses, so an entry holds whichever of
+    // the two addresses was executed last. Anything that writes to `memory` must go
+    // through chip8_invalidate.
+    Chip8_Decoded decoded[0x1000/2];
 
-    uint32_t ms_elapsed;
+    Chip8_Exec_Trace *exec_trace; // NULL runs untraced
+
+#ifdef CHIP8_PROFILING
+    Chip8_Profiling *profiling; // NULL leaves this instance uncounted
+#endif
 } Chip8;
 
-void chip8_load_rom(Chip8 *cpu, char *rom_bytes, size_t rom_size)
+_Static_assert(offsetof(Chip8, run_end) + sizeof(uint64_t) <= 64, "the hot registers must fit in a cache line");
+
+// Everything before `display` is plain state, see chip8_arena.c
+#define CHIP8_STATE_SIZE offsetof(Chip8, display)
+
+// Drops the cached decoding of every instruction overlapping memory[addr..addr+len) and marks
+// the pages it covers as written
+void chip8_invalidate(Chip8 *cpu, uint16_t addr, size_t len)
+{
+    // An instruction starting one byte earlier also covers `addr`, and a fused one starting up to
+    // CHIP8_FUSED_MAX*2 - 1 bytes earlier
+    for (size_t i = 0; i < len + CHIP8_FUSED_MAX*2 - 1; i++) {
+        cpu->decoded[((addr - (CHIP8_FUSED_MAX*2 - 1) + i) & 0xfff) >> 1].op = CHIP8_OP_UNDECODED;
+    }
+
+    size_t pages = ((addr % CHIP8_PAGE_SIZE) + len + CHIP8_PAGE_SIZE - 1) / CHIP8_PAGE_SIZE;
+    for (size_t p = 0; p < pages && p < CHIP8_PAGES; p++) {
+        cpu->written_pages |= 1u << ((addr / CHIP8_PAGE_SIZE + p) % CHIP8_PAGES);
+    }
+}
+
+static inline bool chip8_pixel(const Chip8 *cpu, int x, int y)
+{
+    return (cpu->display[y] >> (63 - x)) & 1;
+}
+
+// Returns the rows changed since the previous call (bit y for row y) and starts tracking anew
+uint32_t chip8_take_dirty_rows(Chip8 *cpu)
+{
+    uint32_t dirty = cpu->dirty_rows;
+    cpu->dirty_rows = 0;
+    return dirty;
+}
+
+// Expands a display row (cpu->display[y]) into 64 pixels, `on` for lit ones and `off` for the rest
+static inline void chip8_unpack_row(uint64_t row, uint32_t *pixels, uint32_t on, uint32_t off)
+{
+    for (int x = 0; x < 64; x++) {
+        pixels[x] = (row >> 63) ? on : off;
+        row <<= 1;
+    }
+}
+
+static uint64_t chip8_hash_bytes(uint64_t hash, const void *bytes, size_t size)
+{
+    const uint8_t *p = bytes;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i])*0x100000001b3ull; // FNV-1a
+    }
+    return hash;
+}
+
+static uint64_t chip8_rom_hash(const char *rom_bytes, size_t rom_size)
+{
+    return chip8_hash_bytes(0xcbf29ce484222325ull, rom_bytes, rom_size);
+}
+
+// ROMs known to need a profile other than CHIP8_PROFILE_DEFAULT, by chip8_rom_hash
+static const struct {
+    uint64_t hash;
+    uint8_t profile;
+} chip8_known_roms[] = {
+    {0x29bcab9b664d212bull, CHIP8_PROFILE_COSMAC}, // BLITZ: buildings run off the bottom edge and must be clipped
+};
+
+Chip8_Profile chip8_rom_profile(const char *rom_bytes, size_t rom_size)
+{
+    uint64_t hash = chip8_rom_hash(rom_bytes, rom_size);
+    for (size_t i = 0; i < sizeof(chip8_known_roms)/sizeof(chip8_known_roms[0]); i++) {
+        if (chip8_known_roms[i].hash == hash) return chip8_known_roms[i].profile;
+    }
+    return CHIP8_PROFILE_DEFAULT;
+}
+
+// Returns the profile called `name` (see CHIP8_PROFILES), or -1
+int chip8_profile_by_name(const char *name)
 {
+    for (int p = 0; p < CHIP8_PROFILE_COUNT; p++) {
+        const char *a = chip8_profile_names[p], *b = name;
+        while (*a != 0 && *a == *b) a++, b++;
+        if (*a == *b) return p;
+    }
+    return -1;
+}
+
+// chip8_load_rom with the quirk profile already known, e.g. from a ROM cache
+bool chip8_load_rom_as(Chip8 *cpu, const char *rom_bytes, size_t rom_size, Chip8_Profile profile)
+{
+    if (rom_size > MAX_ROM_SIZE) return false;
     for (size_t i = 0; i < rom_size; i++) {
         cpu->memory[0x200 + i] = (uint8_t)rom_bytes[i];
     }
+    chip8_invalidate(cpu, 0x200, rom_size);
 
     cpu->PC = 0x200;
+    cpu->profile = profile;
+    return true;
+}
+
+// Copies a ROM to 0x200 and starts it there with the profile known for it. Returns false, and
+// loads nothing, if it is larger than MAX_ROM_SIZE.
+bool chip8_load_rom(Chip8 *cpu, const char *rom_bytes, size_t rom_size)
+{
+    return chip8_load_rom_as(cpu, rom_bytes, rom_size, chip8_rom_profile(rom_bytes, rom_size));
 }
 
 void chip8_load_sprites(Chip8 *cpu)
@@ -68,346 +346,1077 @@ void chip8_load_sprites(Chip8 *cpu)
     for (size_t i = 0; i < sizeof(hex_digit_sprites); i++) {
         cpu->memory[i] = hex_digit_sprites[i];
     }
+    chip8_invalidate(cpu, 0, sizeof(hex_digit_sprites));
 }
 
-bool chip8_is_key_pressed(Chip8 *cpu, uint8_t key)
+// Restarts the CXNN sequence, equal seeds give equal sequences. 0 picks RNG_SEED.
+void chip8_seed(Chip8 *cpu, uint32_t seed)
 {
-    bool is_pressed = cpu->keyboard[key] != 0;
-    if (is_pressed) {
-        cpu->keyboard[key] = 0;
-    }
-    return is_pressed;
+    cpu->rng_state = seed != 0 ? seed : RNG_SEED;
+}
+
+// Holds down exactly the keys in `keys` (bit k for key k) until the next call. Keys stay down
+// however often Ex9E/ExA1 read them, Fx0A waits for one to go down.
+static inline void chip8_set_keys(Chip8 *cpu, uint16_t keys)
+{
+    cpu->key_presses |= keys & ~cpu->keyboard;
+    cpu->keyboard = keys;
 }
 
+// Presses or releases key 0x0-0xF
+static inline void chip8_set_key(Chip8 *cpu, uint8_t key, bool pressed)
+{
+    chip8_set_keys(cpu, (uint16_t)((cpu->keyboard & ~(1u << key)) | ((uint32_t)pressed << key)));
+}
+
+bool chip8_is_key_pressed(const Chip8 *cpu, uint8_t key)
+{
+    return (cpu->keyboard >> key) & 1;
+}
+
+// Fx0A: returns the lowest key that went down since the program started waiting, -1 while none
+// has. Keys held from before don't count, or a key would answer every Fx0A while it's held.
 int chip8_get_key_pressed(Chip8 *cpu)
 {
-    int key = -1; // No key pressed
-    for (int i = 0; i < 16; i++) {
-        if (cpu->keyboard[i] != 0) {
-            cpu->keyboard[i] = 0;
-            return i;
-        }
+    if (!cpu->key_wait) {
+        cpu->key_wait = true;
+        cpu->key_presses = 0;
     }
+    if (cpu->key_presses == 0) return -1;
+    int key = __builtin_ctz(cpu->key_presses);
+    cpu->key_presses = 0;
+    cpu->key_wait = false;
     return key;
 }
 
-const char* chip8_decode(Chip8 *cpu, uint16_t inst)
+Chip8_Decoded chip8_decode_inst(uint16_t inst)
 {
-    (void)cpu;
-    (void)inst;
-#if 0
-    static char buf[128];
     uint8_t high = inst >> 8;   // 0x6034 >> 8   = 0x60
     uint8_t low  = inst & 0xff; // 0x6034 & 0xff = 0x34
 
+    Chip8_Decoded d = {
+        .op  = CHIP8_OP_INVALID,
+        .x   = high & 0xf,
+        .y   = low >> 4,
+        .n   = low & 0xf,
+        .nn  = low,
+        .nnn = inst & 0xfff,
+    };
+
     uint8_t opcode = high >> 4; // 0x60 >> 4 = 6
-    if (opcode == 0) {
-        if (low == 0xe0) {
-            return "CLS";
-        } else if (low == 0xee) {
-            return "RET";
+    switch (opcode) {
+    case 0x0:
+        if (inst == 0x00e0) {
+            d.op = CHIP8_OP_CLS;
+        } else if (inst == 0x00ee) {
+            d.op = CHIP8_OP_RET;
         } else {
-            sprintf(buf, "SYS 0x%03x", inst & 0xfff);
-            return buf;
-            //fprintf(stderr, "Call COSMAC VIP routine at 0x%03x\n", inst & 0xfff);
+            d.op = CHIP8_OP_SYS;
         }
-    } else if (opcode == 1) {
-        sprintf(buf, "JP 0x%03x", inst & 0xfff);
-        return buf;
-    } else if (opcode == 2) {
-        sprintf(buf, "CALL 0x%03x", inst & 0xfff);
-        return buf;
-    } else if (opcode == 3) {
-        sprintf(buf, "SE V%X, 0x%02x (skip if equal)", high & 0xf, low);
-        return buf;
-    } else if (opcode == 4) {
-        sprintf(buf, "SNE V%X, 0x%02x (skip if not equal)", high & 0xf, low);
-        return buf;
-    } else if (opcode == 5) {
-        sprintf(buf, "SE V%X, V%X (skip if equal)", high & 0xf, low >> 4);
-        return buf;
-    } else if (opcode == 6) {
-        sprintf(buf, "LD V%X, 0x%02x", high & 0xf, low);
-        return buf;
-    } else if (opcode == 7) {
-        sprintf(buf, "ADD V%X, 0x%02x", high & 0xf, low);
-        return buf;
-    } else if (opcode == 8) {
-        uint8_t mod = low & 0xf;
-        uint8_t x = high & 0xf;
-        uint8_t y = low >> 4;
-        if (mod == 0) {
-            sprintf(buf, "LD V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 1) {
-            sprintf(buf, "OR V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 2) {
-            sprintf(buf, "AND V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 3) {
-            sprintf(buf, "XOR V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 4) {
-            sprintf(buf, "ADD V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 5) {
-            sprintf(buf, "SUB V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 6) {
-            sprintf(buf, "SHR V%X", x);
-            return buf;
-        } else if (mod == 7) {
-            sprintf(buf, "SUBN V%X, V%X", x, y);
-            return buf;
-        } else if (mod == 0xe) {
-            sprintf(buf, "SHL V%X", x);
-            return buf;
-        } else {
-            //assert(0 && "Invalid instruction 0x8XY?");
+        break;
+    case 0x1: d.op = CHIP8_OP_JP;      break;
+    case 0x2: d.op = CHIP8_OP_CALL;    break;
+    case 0x3: d.op = CHIP8_OP_SE_IMM;  break;
+    case 0x4: d.op = CHIP8_OP_SNE_IMM; break;
+    case 0x5: d.op = CHIP8_OP_SE_REG;  break;
+    case 0x6: d.op = CHIP8_OP_LD_IMM;  break;
+    case 0x7: d.op = CHIP8_OP_ADD_IMM; break;
+    case 0x8:
+        switch (d.n) {
+        case 0x0: d.op = CHIP8_OP_LD_REG;  break;
+        case 0x1: d.op = CHIP8_OP_OR;      break;
+        case 0x2: d.op = CHIP8_OP_AND;     break;
+        case 0x3: d.op = CHIP8_OP_XOR;     break;
+        case 0x4: d.op = CHIP8_OP_ADD_REG; break;
+        case 0x5: d.op = CHIP8_OP_SUB;     break;
+        case 0x6: d.op = CHIP8_OP_SHR;     break;
+        case 0x7: d.op = CHIP8_OP_SUBN;    break;
+        case 0xe: d.op = CHIP8_OP_SHL;     break;
         }
-    } else if (opcode == 9) {
-        sprintf(buf, "SNE V%X, V%X (skip if not equal)", high & 0xf, low >> 4);
-        return buf;
-    } else if (opcode == 0xa) {
-        sprintf(buf, "LD I, 0x%03x", inst & 0xfff);
-        return buf;
-    } else if (opcode == 0xb) {
-        sprintf(buf, "JP V0, 0x%03x", inst & 0xfff);
-        return buf;
-    } else if (opcode == 0xc) {
-        uint8_t x = high & 0xf;
-        sprintf(buf, "RND V%X, 0x%02x", x, low);
-        return buf;
-    } else if (opcode == 0xd) {
-        uint8_t x = high & 0xf;
-        uint8_t y = low >> 4;
-        uint8_t n = low & 0xf; // height (bytes read)
-        sprintf(buf, "DRW V%X, V%X, %d", x, y, n);
-        return buf;
-    } else if (opcode == 0xe) {
-        uint8_t x = high & 0xf;
+        break;
+    case 0x9: d.op = CHIP8_OP_SNE_REG; break;
+    case 0xa: d.op = CHIP8_OP_LD_I;    break;
+    case 0xb: d.op = CHIP8_OP_JP_V0;   break;
+    case 0xc: d.op = CHIP8_OP_RND;     break;
+    case 0xd: d.op = CHIP8_OP_DRW;     break;
+    case 0xe:
         if (low == 0x9e) {
-            sprintf(buf, "SKP V%X (skip if key Vx pressed)", x);
-            return buf;
+            d.op = CHIP8_OP_SKP;
         } else if (low == 0xa1) {
-            sprintf(buf, "SKNP V%X (skip if key Vx not pressed)", x);
-            return buf;
+            d.op = CHIP8_OP_SKNP;
         }
-    } else if (opcode == 0xf) {
-        uint8_t x = high & 0xf;
-        if (low == 0x07) {
-            sprintf(buf, "LD V%X, DT (Set Vx = delay timer value)", x);
-            return buf;
-        } else if (low == 0x0a) {
-            sprintf(buf, "LD V%X, K (store the value of the key in Vx)", x);
-            return buf;
-        } else if (low == 0x15) {
-            sprintf(buf, "LD DT, V%X (Set delay timer = Vx)", x);
-            return buf;
-        } else if (low == 0x18) {
-            sprintf(buf, "LD ST, V%X (Set sound timer = Vx)", x);
-            return buf;
-        } else if (low == 0x1e) {
-            sprintf(buf, "ADD I, V%X", x);
-            return buf;
-        } else if (low == 0x29) {
-            sprintf(buf, "LD F, V%X (Set I = location of sprite for digit Vx)", x);
-            return buf;
-        } else if (low == 0x33) {
-            sprintf(buf, "LD B, V%X (Store BCD representation of Vx in I, I+1 and I+2)", x);
-            return buf;
-        } else if (low == 0x55) {
-            sprintf(buf, "LD [I], V%X (Store registers V0 through Vx in memory starting at location I)", x);
-            return buf;
-        } else if (low == 0x65) {
-            sprintf(buf, "LD V%X, [I] (Read registers V0 through Vx from memory starting at location I)", x);
-            return buf;
-        } else {
-            //assert(0 && "Instruction FX?? is not implemented");
+        break;
+    case 0xf:
+        switch (low) {
+        case 0x07: d.op = CHIP8_OP_LD_VX_DT;  break;
+        case 0x0a: d.op = CHIP8_OP_LD_VX_K;   break;
+        case 0x15: d.op = CHIP8_OP_LD_DT_VX;  break;
+        case 0x18: d.op = CHIP8_OP_LD_ST_VX;  break;
+        case 0x1e: d.op = CHIP8_OP_ADD_I_VX;  break;
+        case 0x29: d.op = CHIP8_OP_LD_F_VX;   break;
+        case 0x33: d.op = CHIP8_OP_LD_B_VX;   break;
+        case 0x55: d.op = CHIP8_OP_LD_MEM_VX; break;
+        case 0x65: d.op = CHIP8_OP_LD_VX_MEM; break;
         }
-    } else {
-        //assert(0 && "Instruction not implemented");
+        break;
     }
-#endif
-    return "Unknown";
+
+    return d;
 }
 
-void chip8_exec(Chip8 *cpu, uint16_t inst)
+// Disassembly templates: %X/%Y are the register digits, %N the sprite height,
+// %B the byte operand (0x%02x) and %A the address operand (0x%03x)
+static const char *const chip8_mnemonics[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_CLS]       = "CLS",
+    [CHIP8_OP_RET]       = "RET",
+    [CHIP8_OP_SYS]       = "SYS %A",
+    [CHIP8_OP_JP]        = "JP %A",
+    [CHIP8_OP_CALL]      = "CALL %A",
+    [CHIP8_OP_SE_IMM]    = "SE V%X, %B (skip if equal)",
+    [CHIP8_OP_SNE_IMM]   = "SNE V%X, %B (skip if not equal)",
+    [CHIP8_OP_SE_REG]    = "SE V%X, V%Y (skip if equal)",
+    [CHIP8_OP_LD_IMM]    = "LD V%X, %B",
+    [CHIP8_OP_ADD_IMM]   = "ADD V%X, %B",
+    [CHIP8_OP_LD_REG]    = "LD V%X, V%Y",
+    [CHIP8_OP_OR]        = "OR V%X, V%Y",
+    [CHIP8_OP_AND]       = "AND V%X, V%Y",
+    [CHIP8_OP_XOR]       = "XOR V%X, V%Y",
+    [CHIP8_OP_ADD_REG]   = "ADD V%X, V%Y",
+    [CHIP8_OP_SUB]       = "SUB V%X, V%Y",
+    [CHIP8_OP_SHR]       = "SHR V%X",
+    [CHIP8_OP_SUBN]      = "SUBN V%X, V%Y",
+    [CHIP8_OP_SHL]       = "SHL V%X",
+    [CHIP8_OP_SNE_REG]   = "SNE V%X, V%Y (skip if not equal)",
+    [CHIP8_OP_LD_I]      = "LD I, %A",
+    [CHIP8_OP_JP_V0]     = "JP V0, %A",
+    [CHIP8_OP_RND]       = "RND V%X, %B",
+    [CHIP8_OP_DRW]       = "DRW V%X, V%Y, %N",
+    [CHIP8_OP_SKP]       = "SKP V%X (skip if key Vx pressed)",
+    [CHIP8_OP_SKNP]      = "SKNP V%X (skip if key Vx not pressed)",
+    [CHIP8_OP_LD_VX_DT]  = "LD V%X, DT (Set Vx = delay timer value)",
+    [CHIP8_OP_LD_VX_K]   = "LD V%X, K (store the value of the key in Vx)",
+    [CHIP8_OP_LD_DT_VX]  = "LD DT, V%X (Set delay timer = Vx)",
+    [CHIP8_OP_LD_ST_VX]  = "LD ST, V%X (Set sound timer = Vx)",
+    [CHIP8_OP_ADD_I_VX]  = "ADD I, V%X",
+    [CHIP8_OP_LD_F_VX]   = "LD F, V%X (Set I = location of sprite for digit Vx)",
+    [CHIP8_OP_LD_B_VX]   = "LD B, V%X (Store BCD representation of Vx in I, I+1 and I+2)",
+    [CHIP8_OP_LD_MEM_VX] = "LD [I], V%X (Store registers V0 through Vx in memory starting at location I)",
+    [CHIP8_OP_LD_VX_MEM] = "LD V%X, [I] (Read registers V0 through Vx from memory starting at location I)",
+    [CHIP8_OP_INVALID]   = "Unknown",
+};
+
+static char *chip8_format_hex(char *out, unsigned value, int digits)
 {
-    uint8_t high = inst >> 8;   // 0x6034 >> 8   = 0x60
-    uint8_t low  = inst & 0xff; // 0x6034 & 0xff = 0x34
+    static const char hex[] = "0123456789abcdef";
+    *out++ = '0';
+    *out++ = 'x';
+    for (int i = digits - 1; i >= 0; i--) {
+        *out++ = hex[(value >> (4*i)) & 0xf];
+    }
+    return out;
+}
 
-    uint8_t opcode = high >> 4; // 0x60 >> 4 = 6
-    //printf("0x%04x:  %s\n", cpu->PC, chip8_decode(cpu, inst));
-    if (opcode == 0) {
-        if (low == 0xe0) {
-            for (int i = 0; i < 64*32; i++) {
-                cpu->display[i] = 0;
-            }
-        } else if (low == 0xee) {
-            //assert(cpu->stack_pointer > 0);
-            cpu->PC = cpu->call_stack[cpu->stack_pointer - 1];
-            cpu->stack_pointer -= 1;
-        } else {
-            //fprintf(stderr, "Call COSMAC VIP routine at 0x%03x\n", inst & 0xfff);
-        }
-    } else if (opcode == 1) {
-        cpu->PC = inst & 0xfff;
-        return;
-    } else if (opcode == 2) {
-        //assert(cpu->stack_pointer < MAX_SUBROUTINES-1);
-        cpu->stack_pointer += 1;
-        cpu->call_stack[cpu->stack_pointer - 1] = cpu->PC; // Store return address
-        cpu->PC = inst & 0xfff;
-        return;
-    } else if (opcode == 3) {
-        if (cpu->V[high & 0xf] == low) {
-            cpu->PC += 2;
-        }
-    } else if (opcode == 4) {
-        if (cpu->V[high & 0xf] != low) {
-            cpu->PC += 2;
-        }
-    } else if (opcode == 5) {
-        //assert((low & 0xf) == 0);
-        if (cpu->V[high & 0xf] == cpu->V[low >> 4]) {
-            cpu->PC += 2;
-        }
-    } else if (opcode == 6) {
-        cpu->V[high & 0xf] = low;
-    } else if (opcode == 7) {
-        cpu->V[high & 0xf] += low;
-    } else if (opcode == 8) {
-        uint8_t mod = low & 0xf;
-        uint8_t x = high & 0xf;
-        uint8_t y = low >> 4;
-        if (mod == 0) {
-            cpu->V[x] = cpu->V[y];
-        } else if (mod == 1) {
-            cpu->V[x] |= cpu->V[y];
-        } else if (mod == 2) {
-            cpu->V[x] &= cpu->V[y];
-        } else if (mod == 3) {
-            cpu->V[x] ^= cpu->V[y];
-        } else if (mod == 4) {
-            uint8_t carry = ((cpu->V[x] + cpu->V[y]) > 0xff) ? 1 : 0;
-            cpu->V[x] += cpu->V[y];
-            cpu->V[0xf] = carry;
-        } else if (mod == 5) {
-            uint8_t borrow = (cpu->V[x] > cpu->V[y]) ? 1 : 0;
-            cpu->V[x] -= cpu->V[y];
-            cpu->V[0xf] = borrow;
-        } else if (mod == 6) {
-            cpu->V[0xf] = cpu->V[x] & 1;
-            cpu->V[x] >>= 1;
-        } else if (mod == 7) {
-            uint8_t borrow = (cpu->V[y] > cpu->V[x]) ? 1 : 0;
-            cpu->V[x] = cpu->V[y] - cpu->V[x];
-            cpu->V[0xf] = borrow;
-        } else if (mod == 0xe) {
-            cpu->V[0xf] = cpu->V[x] >> 7;
-            cpu->V[x] <<= 1;
-        } else {
-            //assert(0 && "Invalid instruction 0x8XY?");
-        }
-    } else if (opcode == 9) {
-        //assert((low & 0xf) == 0);
-        if (cpu->V[high & 0xf] != cpu->V[low >> 4]) {
-            cpu->PC += 2;
-        }
-    } else if (opcode == 0xa) {
-        cpu->I = inst & 0xfff;
-    } else if (opcode == 0xb) {
-        cpu->PC = cpu->V[0] + (inst & 0xfff);
-    } else if (opcode == 0xc) {
-        uint8_t x = high & 0xf;
-        uint8_t r = rand() % 256; // 0 - RAND_MAX => 0-255
-        //uint8_t r = 0;
-        cpu->V[x] = r & low;
-    } else if (opcode == 0xd) {
-        uint8_t x = high & 0xf;
-        uint8_t y = low >> 4;
-        uint8_t n = low & 0xf; // height (bytes read)
-        uint8_t start_x = cpu->V[x];
-        uint8_t start_y = cpu->V[y];
-        for (int i = 0; i < n; i++) {
-            // TODO: wrapping???
-            uint8_t pixel_row = cpu->memory[cpu->I + i];
-            uint8_t carry = 0;
-            for (int col = 0; col < 8; col++) {
-                int pixel_idx = (start_y + i)*64 + start_x + col;
-                uint8_t prev = cpu->display[pixel_idx];
-                cpu->display[pixel_idx] ^= pixel_row & 0x80;
-                if (prev == 1 && cpu->display[pixel_idx] == 0) {
-                    carry = 1;
-                }
-                pixel_row <<= 1;
-            }
-            cpu->V[0xf] = carry;
-        }
-    } else if (opcode == 0xe) {
-        uint8_t x = high & 0xf;
-        if (low == 0x9e) {
-            if(chip8_is_key_pressed(cpu, cpu->V[x])) {
-                cpu->PC += 2;
-            }
-        } else if (low == 0xa1) {
-            if(!chip8_is_key_pressed(cpu, cpu->V[x])) {
-                cpu->PC += 2;
-            }
-        } else {
-            //fprintf(stderr, "Invalid instruction\n");
+// Returns the disassembly of `inst`, valid until the next call
+const char* chip8_decode(Chip8 *cpu, uint16_t inst)
+{
+    (void)cpu;
+    static char buf[128];
+    Chip8_Decoded d = chip8_decode_inst(inst);
+
+    char *out = buf;
+    for (const char *f = chip8_mnemonics[d.op]; *f != 0; f++) {
+        if (*f != '%') {
+            *out++ = *f;
+            continue;
         }
-    } else if (opcode == 0xf) {
-        uint8_t x = high & 0xf;
-        if (low == 0x07) {
-            cpu->V[x] = cpu->delay_timer;
-        } else if (low == 0x0a) {
-            int key = chip8_get_key_pressed(cpu);
-            if (key == -1) return;
-            cpu->V[x] = (uint8_t)key;
-        } else if (low == 0x15) {
-            cpu->delay_timer = cpu->V[x];
-        } else if (low == 0x18) {
-            cpu->sound_timer = cpu->V[x];
-        } else if (low == 0x1e) {
-            cpu->I += cpu->V[x];
-        } else if (low == 0x29) {
-            cpu->I = cpu->V[x] * 5; // 5 bytes per digit, starting at 0x000
-        } else if (low == 0x33) {
-            cpu->memory[cpu->I + 0] = (cpu->V[x] / 100) % 10; // 123 => 1
-            cpu->memory[cpu->I + 1] = (cpu->V[x] /  10) % 10; // 123 => 2
-            cpu->memory[cpu->I + 2] = (cpu->V[x] /   1) % 10; // 123 => 3
-        } else if (low == 0x55) {
-            for (int i = 0; i <= x; i++) {
-                cpu->memory[cpu->I + i] = cpu->V[i];
-            }
-        } else if (low == 0x65) {
-            for (int i = 0; i <= x; i++) {
-                cpu->V[i] = cpu->memory[cpu->I + i];
-            }
-        } else {
-            //assert(0 && "Instruction FX?? is not implemented");
+        f += 1;
+        switch (*f) {
+        case 'X': *out++ = "0123456789ABCDEF"[d.x]; break;
+        case 'Y': *out++ = "0123456789ABCDEF"[d.y]; break;
+        case 'N':
+            if (d.n >= 10) *out++ = '0' + d.n / 10;
+            *out++ = '0' + d.n % 10;
+            break;
+        case 'B': out = chip8_format_hex(out, d.nn, 2);  break;
+        case 'A': out = chip8_format_hex(out, d.nnn, 3); break;
         }
-    } else {
-        //assert(0 && "Instruction not implemented");
     }
+    *out = 0;
+
+    return buf;
+}
+
+static inline uint16_t chip8_fetch(Chip8 *cpu, uint16_t addr)
+{
+    uint8_t high = cpu->memory[(addr + 0) & 0xfff];
+    uint8_t low  = cpu->memory[(addr + 1) & 0xfff];
+    return (high << 8) | low;
+}
+
+uint32_t chip8_clock_rate(const Chip8 *cpu)
+{
+    return cpu->clock_rate != 0 ? cpu->clock_rate : CLOCK_RATE;
+}
+
+// Accounts for one executed cycle: counts it and ticks the timers on every 60 Hz boundary
+static inline void chip8_tick(Chip8 *cpu, uint32_t rate)
+{
+    cpu->cycles += 1;
+    cpu->timer_phase += TIMER_RATE;
+    while (cpu->timer_phase >= rate) {
+        cpu->timer_phase -= rate;
+        if (cpu->delay_timer > 0) cpu->delay_timer -= 1;
+        if (cpu->sound_timer > 0) cpu->sound_timer -= 1;
+        cpu->events |= CHIP8_EVENT_FRAME;
+    }
+}
+
+// Same as `n` calls to chip8_tick, for backends that retire several instructions per dispatch
+static inline void chip8_tick_many(Chip8 *cpu, uint32_t n, uint32_t rate)
+{
+    cpu->cycles += n;
+    cpu->timer_phase += n*TIMER_RATE;
+    if (cpu->timer_phase >= rate) {
+        uint32_t ticks = cpu->timer_phase / rate;
+        cpu->timer_phase -= ticks*rate;
+        cpu->delay_timer = ticks < cpu->delay_timer ? cpu->delay_timer - ticks : 0;
+        cpu->sound_timer = ticks < cpu->sound_timer ? cpu->sound_timer - ticks : 0;
+        cpu->events |= CHIP8_EVENT_FRAME;
+    }
+}
+
+typedef void (*Chip8_Handler)(Chip8 *cpu, const Chip8_Decoded *d);
+
+// Turns `d`, decoded at `pc`, into a superinstruction if it starts one of the sequences below.
+// Counted loops and delay polls jump anywhere, checking for a jump back to `pc` is chip8_skip_idle's
+// business. Builds with -DCHIP8_NO_FUSION never fuse, and neither does an instance being profiled,
+// whose counters are per instruction as it is in the ROM (set Chip8.profiling before running).
+static Chip8_Decoded chip8_fuse(Chip8 *cpu, uint16_t pc, Chip8_Decoded d)
+{
+#ifdef CHIP8_NO_FUSION
+    (void)cpu;
+    (void)pc;
+#else
+#ifdef CHIP8_PROFILING
+    if (cpu->profiling) return d;
+#endif
+    Chip8_Decoded next = chip8_decode_inst(chip8_fetch(cpu, pc + 2));
+    Chip8_Decoded last = chip8_decode_inst(chip8_fetch(cpu, pc + 4));
+    bool test_x = next.op == CHIP8_OP_SE_IMM && next.x == d.x && last.op == CHIP8_OP_JP;
+    if (d.op == CHIP8_OP_LD_I && next.op == CHIP8_OP_DRW) {
+        next.op = CHIP8_OP_LD_I_DRW;
+        next.nnn = d.nnn;
+        return next;
+    } else if (d.op == CHIP8_OP_ADD_IMM && test_x) {
+        return (Chip8_Decoded){.op = CHIP8_OP_ADD_SE_JP, .x = d.x, .y = d.nn, .nn = next.nn, .nnn = last.nnn};
+    } else if (d.op == CHIP8_OP_LD_VX_DT && test_x) {
+        return (Chip8_Decoded){.op = CHIP8_OP_DT_SE_JP, .x = d.x, .nn = next.nn, .nnn = last.nnn};
+    } else if (d.op == CHIP8_OP_LD_IMM && next.op == CHIP8_OP_LD_IMM) {
+        return (Chip8_Decoded){.op = CHIP8_OP_LD_IMM2, .x = d.x, .nn = d.nn, .y = next.x, .n = next.nn};
+    } else if (next.op == CHIP8_OP_JP && (d.op == CHIP8_OP_SE_IMM || d.op == CHIP8_OP_SNE_IMM ||
+               d.op == CHIP8_OP_SE_REG || d.op == CHIP8_OP_SNE_REG || d.op == CHIP8_OP_SKP || d.op == CHIP8_OP_SKNP)) {
+        d.n = d.op;
+        d.op = CHIP8_OP_SKIP_JP;
+        d.nnn = next.nnn;
+    }
+#endif
+    return d;
+}
+
+// The decode cache entry for the instruction at `pc`, as executing it would fill it in
+static inline Chip8_Decoded chip8_decode_at(Chip8 *cpu, uint16_t pc)
+{
+    pc &= 0xfff;
+    Chip8_Decoded decoded = chip8_fuse(cpu, pc, chip8_decode_inst(chip8_fetch(cpu, pc)));
+    decoded.odd = pc & 1;
+    return decoded;
+}
+
+// Handlers taking `handlers` or `quirks` are instantiated per profile by CHIP8_DEFINE_PROFILE,
+// which passes them as constants
 
+static inline void chip8_op_undecoded(Chip8 *cpu, const Chip8_Decoded *d, const Chip8_Handler *handlers)
+{
+    (void)d;
+    uint16_t pc = cpu->PC & 0xfff;
+    Chip8_Decoded decoded = chip8_decode_at(cpu, pc);
+    cpu->decoded[pc >> 1] = decoded;
+    handlers[decoded.op](cpu, &decoded);
+}
+
+static void chip8_op_cls(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    (void)d;
+    uint32_t dirty = 0;
+    for (int row = 0; row < 32; row++) {
+        if (cpu->display[row] != 0) dirty |= 1u << row;
+        cpu->display[row] = 0;
+    }
+    if (dirty) {
+        cpu->dirty_rows |= dirty;
+        cpu->frame_generation += 1;
+        cpu->events |= CHIP8_EVENT_DISPLAY;
+    }
+    cpu->PC += 2;
+}
+
+static void chip8_op_ret(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    (void)d;
+    cpu->stack_pointer -= 1;
+    cpu->PC = cpu->call_stack[cpu->stack_pointer & (MAX_SUBROUTINES - 1)];
     cpu->PC += 2;
 }
 
-void chip8_step(Chip8 *cpu, uint32_t delta_ms)
+// 0NNN (call COSMAC VIP routine) and malformed instructions are ignored
+static void chip8_op_nop(Chip8 *cpu, const Chip8_Decoded *d)
 {
-    cpu->ms_elapsed += delta_ms;
-    if (cpu->ms_elapsed < MS_PER_CYCLE) return;
-    cpu->ms_elapsed -= MS_PER_CYCLE;
+    (void)d;
+    cpu->PC += 2;
+}
 
-    uint8_t high = cpu->memory[cpu->PC + 0];
-    uint8_t low  = cpu->memory[cpu->PC + 1];
-    uint16_t inst = (high << 8) | low;
+static void chip8_op_jp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    // Closes a loop of up to 3 instructions, maybe one of the idle loops chip8_skip_idle knows
+    if ((uint16_t)(cpu->PC - d->nnn) <= 4) cpu->idle = true;
+    cpu->PC = d->nnn;
+}
+
+static void chip8_op_call(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->call_stack[cpu->stack_pointer & (MAX_SUBROUTINES - 1)] = cpu->PC; // Store return address
+    cpu->stack_pointer += 1;
+    cpu->PC = d->nnn;
+}
+
+static void chip8_op_se_imm(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->PC += cpu->V[d->x] == d->nn ? 4 : 2;
+}
+
+static void chip8_op_sne_imm(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->PC += cpu->V[d->x] != d->nn ? 4 : 2;
+}
+
+static void chip8_op_se_reg(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    //assert(d->n == 0);
+    cpu->PC += cpu->V[d->x] == cpu->V[d->y] ? 4 : 2;
+}
+
+static void chip8_op_ld_imm(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->V[d->x] = d->nn;
+    cpu->PC += 2;
+}
+
+static void chip8_op_add_imm(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->V[d->x] += d->nn;
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_reg(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->V[d->x] = cpu->V[d->y];
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_or(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    cpu->V[d->x] |= cpu->V[d->y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) cpu->V[0xf] = 0;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_and(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    cpu->V[d->x] &= cpu->V[d->y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) cpu->V[0xf] = 0;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_xor(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    cpu->V[d->x] ^= cpu->V[d->y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) cpu->V[0xf] = 0;
+    cpu->PC += 2;
+}
+
+static void chip8_op_add_reg(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t carry = ((cpu->V[d->x] + cpu->V[d->y]) > 0xff) ? 1 : 0;
+    cpu->V[d->x] += cpu->V[d->y];
+    cpu->V[0xf] = carry;
+    cpu->PC += 2;
+}
+
+static void chip8_op_sub(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t borrow = (cpu->V[d->x] >= cpu->V[d->y]) ? 1 : 0; // VF is 1 when there's no borrow
+    cpu->V[d->x] -= cpu->V[d->y];
+    cpu->V[0xf] = borrow;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_shr(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    uint8_t src = (quirks & CHIP8_QUIRK_SHIFT_VY) ? d->y : d->x;
+    cpu->V[0xf] = cpu->V[src] & 1;
+    cpu->V[d->x] = cpu->V[src] >> 1;
+    cpu->PC += 2;
+}
 
-    chip8_exec(cpu, inst);
+static void chip8_op_subn(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t borrow = (cpu->V[d->y] >= cpu->V[d->x]) ? 1 : 0;
+    cpu->V[d->x] = cpu->V[d->y] - cpu->V[d->x];
+    cpu->V[0xf] = borrow;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_shl(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    uint8_t src = (quirks & CHIP8_QUIRK_SHIFT_VY) ? d->y : d->x;
+    cpu->V[0xf] = cpu->V[src] >> 7;
+    cpu->V[d->x] = cpu->V[src] << 1;
+    cpu->PC += 2;
+}
+
+static void chip8_op_sne_reg(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    //assert(d->n == 0);
+    cpu->PC += cpu->V[d->x] != cpu->V[d->y] ? 4 : 2;
+}
+
+static void chip8_op_ld_i(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->I = d->nnn;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_jp_v0(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    cpu->PC = cpu->V[(quirks & CHIP8_QUIRK_JUMP_VX) ? d->x : 0] + d->nnn;
+}
+
+// Every instance carries its own generator so instances never share state across threads
+static inline uint8_t chip8_rand(Chip8 *cpu)
+{
+    uint32_t x = cpu->rng_state != 0 ? cpu->rng_state : RNG_SEED;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cpu->rng_state = x;
+    return x >> 24;
+}
+
+static void chip8_op_rnd(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t r = chip8_rand(cpu);
+    //uint8_t r = 0;
+    cpu->V[d->x] = r & d->nn;
+    cpu->PC += 2;
+}
+
+// Sprites start at (Vx mod 64, Vy mod 32) and wrap around both edges of the screen, or are cut
+// off at them with CHIP8_QUIRK_CLIP
+static inline void chip8_op_drw(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    uint8_t start_x = cpu->V[d->x] % 64;
+    uint8_t start_y = cpu->V[d->y] % 32;
+    int rows = d->n;
+    if ((quirks & CHIP8_QUIRK_CLIP) && start_y + rows > 32) rows = 32 - start_y;
+    uint64_t collision = 0;
+    uint32_t dirty = 0;
+    for (int i = 0; i < rows; i++) {
+        uint64_t sprite_row = (uint64_t)cpu->memory[(cpu->I + i) & 0xfff] << 56;
+        uint64_t pixels = sprite_row >> start_x;
+        if (!(quirks & CHIP8_QUIRK_CLIP)) pixels |= sprite_row << ((64 - start_x) % 64); // Rotate right
+        int y = (start_y + i) % 32;
+        collision |= cpu->display[y] & pixels;
+        cpu->display[y] ^= pixels;
+        if (pixels) dirty |= 1u << y;
+        CHIP8_COUNT(cpu, pixels, __builtin_popcountll(pixels));
+    }
+    cpu->V[0xf] = collision != 0;
+    CHIP8_COUNT(cpu, draws, 1);
+    CHIP8_COUNT(cpu, collisions, collision != 0);
+    if (dirty) {
+        cpu->dirty_rows |= dirty;
+        cpu->frame_generation += 1;
+        cpu->events |= CHIP8_EVENT_DISPLAY;
+    }
+    cpu->PC += 2;
+}
+
+static void chip8_op_skp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->PC += chip8_is_key_pressed(cpu, cpu->V[d->x] & 0xf) ? 4 : 2;
+}
+
+static void chip8_op_sknp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->PC += !chip8_is_key_pressed(cpu, cpu->V[d->x] & 0xf) ? 4 : 2;
+}
+
+static void chip8_op_ld_vx_dt(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->V[d->x] = cpu->delay_timer;
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_vx_k(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    int key = chip8_get_key_pressed(cpu);
+    if (key == -1) {
+        CHIP8_COUNT(cpu, wait_key_cycles, 1);
+        cpu->events |= CHIP8_EVENT_WAIT_KEY;
+        cpu->idle = true;
+        return;
+    }
+    cpu->V[d->x] = (uint8_t)key;
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_dt_vx(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->delay_timer = cpu->V[d->x];
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_st_vx(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->sound_timer = cpu->V[d->x];
+    cpu->PC += 2;
+}
+
+static void chip8_op_add_i_vx(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->I += cpu->V[d->x];
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_f_vx(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    cpu->I = cpu->V[d->x] * 5; // 5 bytes per digit, starting at 0x000
+    cpu->PC += 2;
+}
+
+static void chip8_op_ld_b_vx(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t value = cpu->V[d->x];
+    cpu->memory[(cpu->I + 0) & 0xfff] = (value / 100) % 10; // 123 => 1
+    cpu->memory[(cpu->I + 1) & 0xfff] = (value /  10) % 10; // 123 => 2
+    cpu->memory[(cpu->I + 2) & 0xfff] = (value /   1) % 10; // 123 => 3
+    chip8_invalidate(cpu, cpu->I, 3);
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_ld_mem_vx(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    uint8_t x = d->x;
+    for (int i = 0; i <= x; i++) {
+        cpu->memory[(cpu->I + i) & 0xfff] = cpu->V[i];
+    }
+    chip8_invalidate(cpu, cpu->I, x + 1);
+    if (quirks & CHIP8_QUIRK_LOAD_STORE_I) cpu->I += x + 1;
+    cpu->PC += 2;
+}
+
+static inline void chip8_op_ld_vx_mem(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    for (int i = 0; i <= d->x; i++) {
+        cpu->V[i] = cpu->memory[(cpu->I + i) & 0xfff];
+    }
+    if (quirks & CHIP8_QUIRK_LOAD_STORE_I) cpu->I += d->x + 1;
+    cpu->PC += 2;
+}
+
+// Whether a superinstruction standing for `k` instructions may run all of them: they have to fit
+// in what is left of the run, and the timer ticks between them must not raise an event it stops
+// on. Otherwise it runs its first instruction only, the next dispatch goes on from there.
+static inline bool chip8_fused_room(Chip8 *cpu, uint32_t k, uint32_t rate)
+{
+    if (cpu->cycles + k > cpu->run_end) return false;
+    return !(cpu->stop_on & CHIP8_EVENT_FRAME) || cpu->timer_phase + (k - 1)*TIMER_RATE < rate;
+}
+
+// Superinstructions tick the cycles of all but their last instruction, the run loop ticks that one
+
+static inline void chip8_op_ld_i_drw(Chip8 *cpu, const Chip8_Decoded *d, uint32_t quirks)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    chip8_op_ld_i(cpu, d);
+    if (!chip8_fused_room(cpu, 2, rate)) return;
+    chip8_tick(cpu, rate);
+    chip8_op_drw(cpu, d, quirks);
+}
+
+static void chip8_op_add_se_jp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    Chip8_Decoded add = {.x = d->x, .nn = d->y};
+    chip8_op_add_imm(cpu, &add);
+    if (!chip8_fused_room(cpu, 3, rate)) return;
+    chip8_tick(cpu, rate);
+    bool skip = cpu->V[d->x] == d->nn;
+    chip8_op_se_imm(cpu, d);
+    if (skip) return;
+    chip8_tick(cpu, rate);
+    chip8_op_jp(cpu, d);
+}
+
+static void chip8_op_dt_se_jp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    chip8_op_ld_vx_dt(cpu, d);
+    if (!chip8_fused_room(cpu, 3, rate)) return;
+    chip8_tick(cpu, rate);
+    bool skip = cpu->V[d->x] == d->nn;
+    chip8_op_se_imm(cpu, d);
+    if (skip) return;
+    chip8_tick(cpu, rate);
+    chip8_op_jp(cpu, d);
+}
+
+static void chip8_op_ld_imm2(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    chip8_op_ld_imm(cpu, d);
+    if (!chip8_fused_room(cpu, 2, rate)) return;
+    chip8_tick(cpu, rate);
+    Chip8_Decoded second = {.x = d->y, .nn = d->n};
+    chip8_op_ld_imm(cpu, &second);
+}
+
+static void chip8_op_skip_jp(Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint16_t next = cpu->PC + 2;
+    switch (d->n) {
+    case CHIP8_OP_SE_IMM:  chip8_op_se_imm(cpu, d); break;
+    case CHIP8_OP_SNE_IMM: chip8_op_sne_imm(cpu, d); break;
+    case CHIP8_OP_SE_REG:  chip8_op_se_reg(cpu, d); break;
+    case CHIP8_OP_SNE_REG: chip8_op_sne_reg(cpu, d); break;
+    case CHIP8_OP_SKP:     chip8_op_skp(cpu, d); break;
+    default:               chip8_op_sknp(cpu, d); break;
+    }
+    if (cpu->PC != next) return;
+    uint32_t rate = chip8_clock_rate(cpu);
+    if (!chip8_fused_room(cpu, 2, rate)) return;
+    chip8_tick(cpu, rate);
+    chip8_op_jp(cpu, d);
+}
+
+// One handler table per profile, the same except for the instantiated handlers
+#define CHIP8_DEFINE_PROFILE(NAME, name, quirks) \
+    static const Chip8_Handler chip8_handlers_##name[CHIP8_OP_COUNT]; \
+    static void chip8_op_undecoded_##name(Chip8 *cpu, const Chip8_Decoded *d) { chip8_op_undecoded(cpu, d, chip8_handlers_##name); } \
+    static void chip8_op_or_##name(Chip8 *cpu, const Chip8_Decoded *d)        { chip8_op_or(cpu, d, quirks); } \
+    static void chip8_op_and_##name(Chip8 *cpu, const Chip8_Decoded *d)       { chip8_op_and(cpu, d, quirks); } \
+    static void chip8_op_xor_##name(Chip8 *cpu, const Chip8_Decoded *d)       { chip8_op_xor(cpu, d, quirks); } \
+    static void chip8_op_shr_##name(Chip8 *cpu, const Chip8_Decoded *d)       { chip8_op_shr(cpu, d, quirks); } \
+    static void chip8_op_shl_##name(Chip8 *cpu, const Chip8_Decoded *d)       { chip8_op_shl(cpu, d, quirks); } \
+    static void chip8_op_jp_v0_##name(Chip8 *cpu, const Chip8_Decoded *d)     { chip8_op_jp_v0(cpu, d, quirks); } \
+    static void chip8_op_drw_##name(Chip8 *cpu, const Chip8_Decoded *d)       { chip8_op_drw(cpu, d, quirks); } \
+    static void chip8_op_ld_mem_vx_##name(Chip8 *cpu, const Chip8_Decoded *d) { chip8_op_ld_mem_vx(cpu, d, quirks); } \
+    static void chip8_op_ld_vx_mem_##name(Chip8 *cpu, const Chip8_Decoded *d) { chip8_op_ld_vx_mem(cpu, d, quirks); } \
+    static void chip8_op_ld_i_drw_##name(Chip8 *cpu, const Chip8_Decoded *d)  { chip8_op_ld_i_drw(cpu, d, quirks); } \
+    static const Chip8_Handler chip8_handlers_##name[CHIP8_OP_COUNT] = { \
+        [CHIP8_OP_UNDECODED] = chip8_op_undecoded_##name, \
+        [CHIP8_OP_CLS]       = chip8_op_cls, \
+        [CHIP8_OP_RET]       = chip8_op_ret, \
+        [CHIP8_OP_SYS]       = chip8_op_nop, \
+        [CHIP8_OP_JP]        = chip8_op_jp, \
+        [CHIP8_OP_CALL]      = chip8_op_call, \
+        [CHIP8_OP_SE_IMM]    = chip8_op_se_imm, \
+        [CHIP8_OP_SNE_IMM]   = chip8_op_sne_imm, \
+        [CHIP8_OP_SE_REG]    = chip8_op_se_reg, \
+        [CHIP8_OP_LD_IMM]    = chip8_op_ld_imm, \
+        [CHIP8_OP_ADD_IMM]   = chip8_op_add_imm, \
+        [CHIP8_OP_LD_REG]    = chip8_op_ld_reg, \
+        [CHIP8_OP_OR]        = chip8_op_or_##name, \
+        [CHIP8_OP_AND]       = chip8_op_and_##name, \
+        [CHIP8_OP_XOR]       = chip8_op_xor_##name, \
+        [CHIP8_OP_ADD_REG]   = chip8_op_add_reg, \
+        [CHIP8_OP_SUB]       = chip8_op_sub, \
+        [CHIP8_OP_SHR]       = chip8_op_shr_##name, \
+        [CHIP8_OP_SUBN]      = chip8_op_subn, \
+        [CHIP8_OP_SHL]       = chip8_op_shl_##name, \
+        [CHIP8_OP_SNE_REG]   = chip8_op_sne_reg, \
+        [CHIP8_OP_LD_I]      = chip8_op_ld_i, \
+        [CHIP8_OP_JP_V0]     = chip8_op_jp_v0_##name, \
+        [CHIP8_OP_RND]       = chip8_op_rnd, \
+        [CHIP8_OP_DRW]       = chip8_op_drw_##name, \
+        [CHIP8_OP_SKP]       = chip8_op_skp, \
+        [CHIP8_OP_SKNP]      = chip8_op_sknp, \
+        [CHIP8_OP_LD_VX_DT]  = chip8_op_ld_vx_dt, \
+        [CHIP8_OP_LD_VX_K]   = chip8_op_ld_vx_k, \
+        [CHIP8_OP_LD_DT_VX]  = chip8_op_ld_dt_vx, \
+        [CHIP8_OP_LD_ST_VX]  = chip8_op_ld_st_vx, \
+        [CHIP8_OP_ADD_I_VX]  = chip8_op_add_i_vx, \
+        [CHIP8_OP_LD_F_VX]   = chip8_op_ld_f_vx, \
+        [CHIP8_OP_LD_B_VX]   = chip8_op_ld_b_vx, \
+        [CHIP8_OP_LD_MEM_VX] = chip8_op_ld_mem_vx_##name, \
+        [CHIP8_OP_LD_VX_MEM] = chip8_op_ld_vx_mem_##name, \
+        [CHIP8_OP_INVALID]   = chip8_op_nop, \
+        [CHIP8_OP_LD_I_DRW]  = chip8_op_ld_i_drw_##name, \
+        [CHIP8_OP_ADD_SE_JP] = chip8_op_add_se_jp, \
+        [CHIP8_OP_DT_SE_JP]  = chip8_op_dt_se_jp, \
+        [CHIP8_OP_LD_IMM2]   = chip8_op_ld_imm2, \
+        [CHIP8_OP_SKIP_JP]   = chip8_op_skip_jp, \
+    };
+CHIP8_PROFILES(CHIP8_DEFINE_PROFILE)
+
+static const Chip8_Handler *const chip8_profile_handlers[CHIP8_PROFILE_COUNT] = {
+#define X(NAME, name, quirks) [CHIP8_PROFILE_##NAME] = chip8_handlers_##name,
+    CHIP8_PROFILES(X)
+#undef X
+};
+
+static inline const Chip8_Handler *chip8_handlers(const Chip8 *cpu)
+{
+    return chip8_profile_handlers[cpu->profile < CHIP8_PROFILE_COUNT ? cpu->profile : CHIP8_PROFILE_DEFAULT];
+}
+
+static inline uint32_t chip8_quirks(const Chip8 *cpu)
+{
+    return cpu->profile < CHIP8_PROFILE_COUNT ? chip8_profile_quirks[cpu->profile] : 0;
+}
+
+// Whether `quirks` make `op` behave differently from CHIP8_PROFILE_DEFAULT. Backends that
+// translate instructions themselves hand those back to the interpreter.
+static inline bool chip8_quirks_change(uint32_t quirks, uint8_t op)
+{
+    switch (op) {
+    case CHIP8_OP_OR:
+    case CHIP8_OP_AND:
+    case CHIP8_OP_XOR:       return (quirks & CHIP8_QUIRK_VF_RESET) != 0;
+    case CHIP8_OP_SHR:
+    case CHIP8_OP_SHL:       return (quirks & CHIP8_QUIRK_SHIFT_VY) != 0;
+    case CHIP8_OP_JP_V0:     return (quirks & CHIP8_QUIRK_JUMP_VX) != 0;
+    case CHIP8_OP_DRW:
+    case CHIP8_OP_LD_I_DRW:  return (quirks & CHIP8_QUIRK_CLIP) != 0;
+    case CHIP8_OP_LD_MEM_VX:
+    case CHIP8_OP_LD_VX_MEM: return (quirks & CHIP8_QUIRK_LOAD_STORE_I) != 0;
+    default:                 return false;
+    }
+}
+
+// Executes a single instruction word, bypassing the decode cache
+void chip8_exec(Chip8 *cpu, uint16_t inst)
+{
+    Chip8_Decoded d = chip8_decode_inst(inst);
+    chip8_handlers(cpu)[d.op](cpu, &d);
+}
+
+static const Chip8_Decoded chip8_undecoded = {.op = CHIP8_OP_UNDECODED};
+
+#ifdef CHIP8_PROFILING
+static void chip8_profiling_count(Chip8 *cpu, uint16_t pc, uint8_t op)
+{
+    Chip8_Profiling *prof = cpu->profiling;
+    if (op == CHIP8_OP_UNDECODED) op = chip8_decode_inst(chip8_fetch(cpu, pc)).op;
+    prof->ops[op] += 1;
+    prof->pcs[pc] += 1;
+    uint16_t routine = 0;
+    if (cpu->stack_pointer > 0) {
+        routine = chip8_fetch(cpu, cpu->call_stack[(cpu->stack_pointer - 1) & (MAX_SUBROUTINES - 1)]) & 0xfff;
+    }
+    prof->routines[pc] = routine;
+}
+#endif
+
+// Executes the instruction at PC through the decode cache, with the handlers of a profile
+static inline void chip8_dispatch_with(Chip8 *cpu, const Chip8_Handler *handlers)
+{
+    uint16_t pc = cpu->PC & 0xfff;
+    const Chip8_Decoded *d = &cpu->decoded[pc >> 1];
+    if (d->odd != (pc & 1)) {
+        d = &chip8_undecoded;
+    }
+#ifdef CHIP8_PROFILING
+    if (cpu->profiling) chip8_profiling_count(cpu, pc, d->op);
+#endif
+    handlers[d->op](cpu, d);
+}
+
+// Same with the handlers of cpu->profile, for backends that hand single instructions back
+static inline void chip8_dispatch(Chip8 *cpu)
+{
+    cpu->run_end = 0; // One instruction, never a superinstruction
+    chip8_dispatch_with(cpu, chip8_handlers(cpu));
+}
+
+// Number of cycles after which the timers tick next
+static inline uint32_t chip8_cycles_until_tick(Chip8 *cpu, uint32_t rate)
+{
+    return (rate - cpu->timer_phase + TIMER_RATE - 1) / TIMER_RATE;
+}
+
+// First iteration of a delay timer poll, reading DT every 3 cycles, that reads a DT <= `value`
+static inline uint64_t chip8_poll_reaches(Chip8 *cpu, uint32_t rate, uint8_t value)
+{
+    if (cpu->delay_timer <= value) return 0;
+    // The timers tick T(m) = (timer_phase + m*TIMER_RATE) / rate times in m cycles
+    uint64_t phase = (uint64_t)(cpu->delay_timer - value)*rate - cpu->timer_phase;
+    return (phase + 3*TIMER_RATE - 1) / (3*TIMER_RATE);
+}
+
+// Whether the skip `d` skips the next instruction, -1 if `d` is not a skip
+static int chip8_skips(const Chip8 *cpu, const Chip8_Decoded *d)
+{
+    uint8_t vx = cpu->V[d->x], vy = cpu->V[d->y];
+    switch (d->op) {
+    case CHIP8_OP_SE_IMM:  return vx == d->nn;
+    case CHIP8_OP_SNE_IMM: return vx != d->nn;
+    case CHIP8_OP_SE_REG:  return vx == vy;
+    case CHIP8_OP_SNE_REG: return vx != vy;
+    case CHIP8_OP_SKP:     return chip8_is_key_pressed(cpu, vx & 0xf);
+    case CHIP8_OP_SKNP:    return !chip8_is_key_pressed(cpu, vx & 0xf);
+    default:               return -1;
+    }
+}
+
+// Cycles the idle loop at PC can be fast-forwarded through within `budget`, 0 if PC isn't on one.
+// Always a whole number of iterations, and so is any smaller multiple of 6. The patterns known:
+//   Fx0A waiting for a key: keys only change between runs, so it waits out the whole budget.
+//   1NNN jumping to itself: the program halted, only the timers move, same as Fx0A.
+//   A skip (3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1), 1NNN jumping back to it: nothing in the loop
+//   changes what the skip reads, so if it doesn't skip now it never does before the run ends.
+//   Fx07, 3x00 (or any 3xkk, 4xkk), 1NNN jumping back to the Fx07: the poll can only end when
+//   the delay timer reaches kk, so whole iterations before that are skipped.
+// A run stopping on CHIP8_EVENT_FRAME is only fast-forwarded to the next tick.
+static uint32_t chip8_idle_cycles(Chip8 *cpu, uint32_t budget, uint32_t rate)
+{
+    if (cpu->events & cpu->stop_on) return 0;
+    if (budget > MAX_IDLE_SKIP) budget = MAX_IDLE_SKIP;
+    uint32_t until_tick = chip8_cycles_until_tick(cpu, rate);
+
+    uint16_t inst = chip8_fetch(cpu, cpu->PC);
+    uint16_t back = 0x1000 | (cpu->PC & 0xfff);
+    if ((inst & 0xf0ff) == 0xf00a) {
+        // A key that went down since the wait started is taken by the next Fx0A
+        if (cpu->key_wait && cpu->key_presses) return 0;
+        return (cpu->stop_on & CHIP8_EVENT_FRAME) && until_tick < budget ? until_tick : budget;
+    }
+    if (inst == back) {
+        return (cpu->stop_on & CHIP8_EVENT_FRAME) && until_tick < budget ? until_tick : budget;
+    }
+
+    uint32_t limit = budget;
+    if ((cpu->stop_on & CHIP8_EVENT_FRAME) && until_tick - 1 < limit) limit = until_tick - 1;
+
+    uint16_t test = chip8_fetch(cpu, cpu->PC + 2);
+    uint16_t jump = chip8_fetch(cpu, cpu->PC + 4);
+    Chip8_Decoded d = chip8_decode_inst(inst);
+    if (test == back && chip8_skips(cpu, &d) == 0) return limit/2*2;
+
+    bool skip_if_equal = (test >> 12) == 0x3;
+    bool poll = (inst & 0xf0ff) == 0xf007 && (skip_if_equal || (test >> 12) == 0x4) &&
+                ((test >> 8) & 0xf) == d.x && jump == back;
+    if (!poll) return 0;
+
+    // Iteration i reads DT_i = max(0, DT - T(3i)), which only ever decreases. 3xkk keeps polling
+    // while DT_i != kk and 4xkk while DT_i == kk.
+    uint8_t kk = test & 0xff;
+    uint64_t exit;
+    if (skip_if_equal) {
+        exit = chip8_poll_reaches(cpu, rate, kk);
+        // DT can jump over kk when the timers tick more than once per iteration
+        uint64_t ticks = (cpu->timer_phase + 3*exit*TIMER_RATE) / rate;
+        uint8_t reads = ticks < cpu->delay_timer ? cpu->delay_timer - ticks : 0;
+        if (reads != kk) exit = UINT64_MAX;
+    } else {
+        exit = cpu->delay_timer != kk ? 0 : kk > 0 ? chip8_poll_reaches(cpu, rate, kk - 1) : UINT64_MAX;
+    }
+
+    uint64_t iterations = limit / 3;
+    if (exit < iterations) iterations = exit;
+    return (uint32_t)(3*iterations);
+}
+
+// Leaves the idle loop at PC exactly as executing `skip` cycles of it would, `skip` being at
+// most what chip8_idle_cycles allowed and a whole number of iterations
+static void chip8_idle_forward(Chip8 *cpu, uint32_t skip, uint32_t rate)
+{
+    uint16_t inst = chip8_fetch(cpu, cpu->PC);
+    if ((inst & 0xf0ff) == 0xf007) {
+        // V[x] holds what the last skipped iteration read
+        uint64_t ticks = (cpu->timer_phase + (uint64_t)(skip - 3)*TIMER_RATE) / rate;
+        cpu->V[(inst >> 8) & 0xf] = ticks < cpu->delay_timer ? cpu->delay_timer - ticks : 0;
+    }
+    chip8_tick_many(cpu, skip, rate);
+    cpu->events |= CHIP8_EVENT_IDLE;
+    cpu->skipped_cycles += skip;
+    CHIP8_COUNT(cpu, idle_cycles, skip);
+    if ((inst & 0xf0ff) == 0xf00a) CHIP8_COUNT(cpu, wait_key_cycles, skip);
+}
+
+// Called with PC on an instruction that flagged the program idle. Fast-forwards through what it
+// would do over at most `budget` cycles without executing it, and returns the cycles skipped.
+static uint32_t chip8_skip_idle(Chip8 *cpu, uint32_t budget, uint32_t rate)
+{
+    uint32_t skip = chip8_idle_cycles(cpu, budget, rate);
+    if (skip > 0) chip8_idle_forward(cpu, skip, rate);
+    return skip;
+}
+
+// The run loop behind chip8_run_cycles, inlined into each profile's copy so every call through
+// `handlers` goes to a known table
+static inline __attribute__((always_inline)) uint32_t chip8_run_loop(Chip8 *cpu, uint32_t n, const Chip8_Handler *handlers)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    uint64_t start = cpu->cycles;
+    uint64_t end = start + n;
+    uint64_t dispatches = 0;
+
+    cpu->events = 0;
+    cpu->idle = false;
+    cpu->run_end = end;
+    // Superinstructions retire several cycles per dispatch, so the loop counts cycles
+    while (cpu->cycles < end) {
+        chip8_dispatch_with(cpu, handlers);
+        chip8_tick(cpu, rate);
+        dispatches += 1;
+        if (cpu->idle) {
+            cpu->idle = false;
+            chip8_skip_idle(cpu, (uint32_t)(end - cpu->cycles), rate);
+        }
+
+        if (cpu->events & cpu->stop_on) break;
+    }
+
+    cpu->dispatches += dispatches;
+    return (uint32_t)(cpu->cycles - start);
+}
+
+#define X(NAME, name, quirks) \
+    static uint32_t chip8_run_cycles_##name(Chip8 *cpu, uint32_t n) { return chip8_run_loop(cpu, n, chip8_handlers_##name); }
+CHIP8_PROFILES(X)
+#undef X
+
+// chip8_run_cycles with a Chip8_Exec_Record per instruction. Idle loops run instruction by
+// instruction so every one of them is in the trace, which ends in the same state as skipping them.
+static __attribute__((noinline)) uint32_t chip8_run_traced(Chip8 *cpu, uint32_t n)
+{
+    const Chip8_Handler *handlers = chip8_handlers(cpu);
+    Chip8_Exec_Trace *trace = cpu->exec_trace;
+    uint32_t rate = chip8_clock_rate(cpu);
+    uint32_t executed = 0;
+
+    cpu->events = 0;
+    cpu->run_end = 0; // Superinstructions would leave out records
+    while (executed < n) {
+        Chip8_Exec_Record *record = &trace->records[trace->count & trace->mask];
+        uint64_t before[2];
+        __builtin_memcpy(before, cpu->V, sizeof(before));
+        record->cycle = cpu->cycles;
+        record->pc = cpu->PC;
+        record->inst = chip8_fetch(cpu, cpu->PC);
+
+        chip8_dispatch_with(cpu, handlers);
+        chip8_tick(cpu, rate);
+        executed += 1;
+        cpu->idle = false;
+
+        uint64_t after[2];
+        __builtin_memcpy(after, cpu->V, sizeof(after));
+        uint64_t lo = before[0] ^ after[0], hi = before[1] ^ after[1];
+        uint8_t reg = lo ? __builtin_ctzll(lo)/8 : hi ? 8 + __builtin_ctzll(hi)/8 : CHIP8_EXEC_NO_REG;
+        record->I = cpu->I;
+        record->reg = reg;
+        record->value = reg == CHIP8_EXEC_NO_REG ? 0 : cpu->V[reg];
+        trace->count += 1;
+
+        if (cpu->events & cpu->stop_on) break;
+    }
+
+    return executed;
+}
+
+// Executes up to `n` cycles, stopping after the first one that raises an event in `stop_on`.
+// Returns the number of cycles executed, the events raised are left in `cpu->events`.
+uint32_t chip8_run_cycles(Chip8 *cpu, uint32_t n)
+{
+    if (cpu->exec_trace) return chip8_run_traced(cpu, n);
+    switch (cpu->profile) {
+#define X(NAME, name, quirks) case CHIP8_PROFILE_##NAME: return chip8_run_cycles_##name(cpu, n);
+    CHIP8_PROFILES(X)
+#undef X
+    default: return chip8_run_cycles_default(cpu, n);
+    }
+}
+
+// Cycle credit owed after `delta_ms` more, capped at MAX_BACKLOG_MS. 64 bits, MAX_BACKLOG_MS of
+// credit overflows 32 above 42.9 MHz.
+static inline uint64_t chip8_credit_after(const Chip8 *cpu, uint32_t delta_ms)
+{
+    uint64_t rate = chip8_clock_rate(cpu);
+    uint64_t credit = cpu->cycle_credit + delta_ms*rate;
+    return credit < MAX_BACKLOG_MS*rate ? credit : MAX_BACKLOG_MS*rate;
+}
+
+// The cycle chip8_run_for(cpu, delta_ms) would run up to if nothing stopped it. Frontends stamp
+// input with it so it applies at the cycle matching when it happened.
+uint64_t chip8_cycle_in(const Chip8 *cpu, uint32_t delta_ms)
+{
+    return cpu->cycles + chip8_credit_after(cpu, delta_ms)/1000;
+}
+
+// chip8_run_for that stops at cycle `until` if it gets there first, the time left stays owed
+// to the next call. Returns the events raised.
+uint32_t chip8_run_for_until(Chip8 *cpu, uint32_t delta_ms, uint64_t until)
+{
+    cpu->cycle_credit = chip8_credit_after(cpu, delta_ms);
+
+    uint32_t budget = (uint32_t)(cpu->cycle_credit / 1000);
+    if (until < cpu->cycles + budget) budget = until > cpu->cycles ? (uint32_t)(until - cpu->cycles) : 0;
+    uint32_t executed = chip8_run_cycles(cpu, budget);
+    cpu->cycle_credit -= executed*1000ull;
+
+    return cpu->events;
+}
+
+// Runs every cycle that fits in `delta_ms` plus whatever an earlier call left over.
+// Returns the events raised.
+uint32_t chip8_run_for(Chip8 *cpu, uint32_t delta_ms)
+{
+    return chip8_run_for_until(cpu, delta_ms, UINT64_MAX);
+}
+
+// Hash of everything a program can observe, equal for two instances that ran the same program
+// with the same seed and the same input. Caches and per-run bookkeeping are left out.
+uint64_t chip8_state_hash(const Chip8 *cpu)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = chip8_hash_bytes(hash, cpu->V, sizeof(cpu->V));
+    hash = chip8_hash_bytes(hash, &cpu->I, sizeof(cpu->I));
+    hash = chip8_hash_bytes(hash, &cpu->PC, sizeof(cpu->PC));
+    hash = chip8_hash_bytes(hash, &cpu->delay_timer, sizeof(cpu->delay_timer));
+    hash = chip8_hash_bytes(hash, &cpu->sound_timer, sizeof(cpu->sound_timer));
+    hash = chip8_hash_bytes(hash, &cpu->keyboard, sizeof(cpu->keyboard));
+    hash = chip8_hash_bytes(hash, &cpu->key_presses, sizeof(cpu->key_presses));
+    hash = chip8_hash_bytes(hash, &cpu->key_wait, sizeof(cpu->key_wait));
+    hash = chip8_hash_bytes(hash, cpu->memory, sizeof(cpu->memory));
+    hash = chip8_hash_bytes(hash, cpu->display, sizeof(cpu->display));
+    hash = chip8_hash_bytes(hash, &cpu->stack_pointer, sizeof(cpu->stack_pointer));
+    hash = chip8_hash_bytes(hash, cpu->call_stack, sizeof(cpu->call_stack));
+    hash = chip8_hash_bytes(hash, &cpu->timer_phase, sizeof(cpu->timer_phase));
+    hash = chip8_hash_bytes(hash, &cpu->cycles, sizeof(cpu->cycles));
+    hash = chip8_hash_bytes(hash, &cpu->rng_state, sizeof(cpu->rng_state));
+    return hash;
+}
+
+// Milliseconds of chip8_run_for until the timers tick next. A frontend whose last run raised
+// CHIP8_EVENT_IDLE can sleep that long, or until a key changes, without the program noticing.
+uint32_t chip8_ms_until_tick(Chip8 *cpu)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    uint64_t owed = chip8_cycles_until_tick(cpu, rate)*1000ull;
+    owed = owed > cpu->cycle_credit ? owed - cpu->cycle_credit : 0;
+    return (uint32_t)((owed + rate - 1) / rate);
 }
 
 void chip8_dump(Chip8 *cpu)
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./chip8.c"
+#include "./chip8_rom.c"
+
+// Ahead-of-time recompiler: ROM -> C translation unit.
+//
+// Control flow is recovered from 0x200 by following every statically known successor.
+// Each reachable instruction becomes a label with straight-line C operating on a `Chip8*`,
+// and known successors are reached with a direct `goto`. Targets only known at run time
+// (RET, BNNN, key skips, Fx0A) go through a `switch` on PC, and anything outside the
+// recovered graph runs on the interpreter. Every label first checks that memory still
+// holds the instruction it was compiled from, so self-modified code also falls back to
+// the interpreter.
+
+// Marks every address reachable from 0x200 through statically known control flow
+static void recover_cfg(Chip8 *cpu, bool reachable[0x1000])
+{
+    uint16_t worklist[0x1000];
+    size_t count = 0;
+
+    worklist[count++] = 0x200;
+    reachable[0x200] = true;
+    while (count > 0) {
+        uint16_t pc = worklist[--count];
+        Chip8_Decoded d = chip8_decode_inst(chip8_fetch(cpu, pc));
+
+        uint16_t successors[2];
+        size_t n = 0;
+        switch (d.op) {
+        case CHIP8_OP_JP:
+            successors[n++] = d.nnn;
+            break;
+        case CHIP8_OP_CALL:
+            successors[n++] = d.nnn;
+            successors[n++] = pc + 2; // Return site
+            break;
+        case CHIP8_OP_RET:
+        case CHIP8_OP_JP_V0:
+            break;
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+            successors[n++] = pc + 2;
+            successors[n++] = pc + 4;
+            break;
+        default:
+            successors[n++] = pc + 2;
+            break;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            uint16_t next = successors[i];
+            if (next >= 0x1000 - 1 || reachable[next]) continue;
+            reachable[next] = true;
+            worklist[count++] = next;
+        }
+    }
+}
+
+// Indented by `indent` spaces
+static void emit_goto(FILE *out, const bool reachable[0x1000], uint16_t target, int indent)
+{
+    if (target < 0x1000 && reachable[target]) {
+        fprintf(out, "%*sgoto L_%03x;\n", indent, "", target);
+    } else {
+        fprintf(out, "%*sgoto dispatch;\n", indent, "");
+    }
+}
+
+// Continues at `target` after retiring the current instruction
+static void emit_next(FILE *out, const bool reachable[0x1000], uint16_t target)
+{
+    fprintf(out, "    cpu->PC = 0x%03x;\n", target);
+    fprintf(out, "    AOT_RETIRE();\n");
+    emit_goto(out, reachable, target, 4);
+}
+
+static void emit_skip(FILE *out, const bool reachable[0x1000], uint16_t pc, const char *condition)
+{
+    fprintf(out, "    if (%s) {\n", condition);
+    fprintf(out, "        cpu->PC = 0x%03x;\n", pc + 4);
+    fprintf(out, "        AOT_RETIRE();\n");
+    emit_goto(out, reachable, pc + 4, 8);
+    fprintf(out, "    }\n");
+    emit_next(out, reachable, pc + 2);
+}
+
+static void emit_inst(FILE *out, Chip8 *cpu, const bool reachable[0x1000], uint16_t pc)
+{
+    uint16_t inst = chip8_fetch(cpu, pc);
+    Chip8_Decoded d = chip8_decode_inst(inst);
+
+    fprintf(out, "L_%03x: // %04x  %s\n", pc, inst, chip8_decode(cpu, inst));
+    fprintf(out, "    if (chip8_fetch(cpu, 0x%03x) != 0x%04x) goto fallback;\n", pc, inst);
+
+    if (d.op != CHIP8_OP_JP_V0 && chip8_quirks_change(chip8_quirks(cpu), d.op)) {
+        // Inlined below the way CHIP8_PROFILE_DEFAULT does it, the profile's handler runs instead
+        fprintf(out, "    chip8_exec(cpu, 0x%04x);\n", inst);
+        fprintf(out, "    AOT_RETIRE();\n");
+        emit_goto(out, reachable, pc + 2, 4);
+        return;
+    }
+
+    char condition[64];
+    switch (d.op) {
+    case CHIP8_OP_SYS:
+    case CHIP8_OP_INVALID:
+        break;
+    case CHIP8_OP_JP:
+        emit_next(out, reachable, d.nnn);
+        return;
+    case CHIP8_OP_CALL:
+        fprintf(out, "    cpu->call_stack[cpu->stack_pointer & (MAX_SUBROUTINES - 1)] = 0x%03x;\n", pc);
+        fprintf(out, "    cpu->stack_pointer += 1;\n");
+        emit_next(out, reachable, d.nnn);
+        return;
+    case CHIP8_OP_SE_IMM:
+    case CHIP8_OP_SNE_IMM:
+        snprintf(condition, sizeof(condition), "cpu->V[0x%x] %s 0x%02x", d.x, d.op == CHIP8_OP_SE_IMM ? "==" : "!=", d.nn);
+        emit_skip(out, reachable, pc, condition);
+        return;
+    case CHIP8_OP_SE_REG:
+    case CHIP8_OP_SNE_REG:
+        snprintf(condition, sizeof(condition), "cpu->V[0x%x] %s cpu->V[0x%x]", d.x, d.op == CHIP8_OP_SE_REG ? "==" : "!=", d.y);
+        emit_skip(out, reachable, pc, condition);
+        return;
+    case CHIP8_OP_LD_IMM:
+        fprintf(out, "    cpu->V[0x%x] = 0x%02x;\n", d.x, d.nn);
+        break;
+    case CHIP8_OP_ADD_IMM:
+        fprintf(out, "    cpu->V[0x%x] += 0x%02x;\n", d.x, d.nn);
+        break;
+    case CHIP8_OP_LD_REG:
+        fprintf(out, "    cpu->V[0x%x] = cpu->V[0x%x];\n", d.x, d.y);
+        break;
+    case CHIP8_OP_OR:
+        fprintf(out, "    cpu->V[0x%x] |= cpu->V[0x%x];\n", d.x, d.y);
+        break;
+    case CHIP8_OP_AND:
+        fprintf(out, "    cpu->V[0x%x] &= cpu->V[0x%x];\n", d.x, d.y);
+        break;
+    case CHIP8_OP_XOR:
+        fprintf(out, "    cpu->V[0x%x] ^= cpu->V[0x%x];\n", d.x, d.y);
+        break;
+    case CHIP8_OP_ADD_REG:
+        fprintf(out, "    {\n");
+        fprintf(out, "        uint8_t carry = (cpu->V[0x%x] + cpu->V[0x%x]) > 0xff;\n", d.x, d.y);
+        fprintf(out, "        cpu->V[0x%x] += cpu->V[0x%x];\n", d.x, d.y);
+        fprintf(out, "        cpu->V[0xf] = carry;\n");
+        fprintf(out, "    }\n");
+        break;
+    case CHIP8_OP_SUB:
+        fprintf(out, "    {\n");
+        fprintf(out, "        uint8_t borrow = cpu->V[0x%x] >= cpu->V[0x%x];\n", d.x, d.y);
+        fprintf(out, "        cpu->V[0x%x] -= cpu->V[0x%x];\n", d.x, d.y);
+        fprintf(out, "        cpu->V[0xf] = borrow;\n");
+        fprintf(out, "    }\n");
+        break;
+    case CHIP8_OP_SUBN:
+        fprintf(out, "    {\n");
+        fprintf(out, "        uint8_t borrow = cpu->V[0x%x] >= cpu->V[0x%x];\n", d.y, d.x);
+        fprintf(out, "        cpu->V[0x%x] = cpu->V[0x%x] - cpu->V[0x%x];\n", d.x, d.y, d.x);
+        fprintf(out, "        cpu->V[0xf] = borrow;\n");
+        fprintf(out, "    }\n");
+        break;
+    case CHIP8_OP_SHR:
+        fprintf(out, "    cpu->V[0xf] = cpu->V[0x%x] & 1;\n", d.x);
+        fprintf(out, "    cpu->V[0x%x] >>= 1;\n", d.x);
+        break;
+    case CHIP8_OP_SHL:
+        fprintf(out, "    cpu->V[0xf] = cpu->V[0x%x] >> 7;\n", d.x);
+        fprintf(out, "    cpu->V[0x%x] <<= 1;\n", d.x);
+        break;
+    case CHIP8_OP_LD_I:
+        fprintf(out, "    cpu->I = 0x%03x;\n", d.nnn);
+        break;
+    case CHIP8_OP_LD_VX_DT:
+        fprintf(out, "    cpu->V[0x%x] = cpu->delay_timer;\n", d.x);
+        break;
+    case CHIP8_OP_LD_DT_VX:
+        fprintf(out, "    cpu->delay_timer = cpu->V[0x%x];\n", d.x);
+        break;
+    case CHIP8_OP_LD_ST_VX:
+        fprintf(out, "    cpu->sound_timer = cpu->V[0x%x];\n", d.x);
+        break;
+    case CHIP8_OP_ADD_I_VX:
+        fprintf(out, "    cpu->I += cpu->V[0x%x];\n", d.x);
+        break;
+    case CHIP8_OP_LD_F_VX:
+        fprintf(out, "    cpu->I = cpu->V[0x%x] * 5;\n", d.x);
+        break;
+    case CHIP8_OP_CLS:
+    case CHIP8_OP_DRW:
+    case CHIP8_OP_RND:
+    case CHIP8_OP_LD_B_VX:
+    case CHIP8_OP_LD_MEM_VX:
+    case CHIP8_OP_LD_VX_MEM:
+        // Always continue at the next instruction, so the successor is still known
+        fprintf(out, "    chip8_exec(cpu, 0x%04x);\n", inst);
+        fprintf(out, "    AOT_RETIRE();\n");
+        emit_goto(out, reachable, pc + 2, 4);
+        return;
+    default:
+        // RET, BNNN, key skips and Fx0A: the successor depends on run time state
+        fprintf(out, "    chip8_exec(cpu, 0x%04x);\n", inst);
+        fprintf(out, "    AOT_RETIRE();\n");
+        fprintf(out, "    goto dispatch;\n");
+        return;
+    }
+
+    emit_next(out, reachable, pc + 2);
+}
+
+static void emit_translation_unit(FILE *out, const char *rom_path, const uint8_t *rom_bytes, size_t rom_size)
+{
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    if (!chip8_load_rom(&cpu, (char*)rom_bytes, rom_size)) {
+        fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", rom_path, MAX_ROM_SIZE);
+        exit(1);
+    }
+
+    static bool reachable[0x1000];
+    recover_cfg(&cpu, reachable);
+
+    fprintf(out, "// Generated by chip8.aot from %s, do not edit.\n", rom_path);
+    fprintf(out, "//\n");
+    fprintf(out, "//   cc -O3 -I<chip8 source dir> -o rom.aot this_file.c\n");
+    fprintf(out, "//\n");
+    fprintf(out, "// Define CHIP8_AOT_NO_MAIN to link chip8_aot_run_cycles into another program.\n");
+    fprintf(out, "#include <stdio.h>\n");
+    fprintf(out, "#include <stdlib.h>\n");
+    fprintf(out, "#include <time.h>\n");
+    fprintf(out, "\n");
+    fprintf(out, "#include \"chip8.c\"\n");
+    fprintf(out, "\n");
+
+    fprintf(out, "static const uint8_t chip8_aot_rom[%zu] = {", rom_size);
+    for (size_t i = 0; i < rom_size; i++) {
+        fprintf(out, "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", rom_bytes[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "#define AOT_RETIRE() do { \\\n");
+    fprintf(out, "        chip8_tick(cpu, rate); \\\n");
+    fprintf(out, "        executed += 1; \\\n");
+    fprintf(out, "        if (executed >= n || (cpu->events & cpu->stop_on)) return executed; \\\n");
+    fprintf(out, "    } while (0)\n\n");
+
+    fprintf(out, "// Same contract as chip8_run_cycles, for the ROM above loaded with chip8_load_rom\n");
+    fprintf(out, "uint32_t chip8_aot_run_cycles(Chip8 *cpu, uint32_t n)\n");
+    fprintf(out, "{\n");
+    fprintf(out, "    if (cpu->profile != %d || cpu->exec_trace) return chip8_run_cycles(cpu, n); // Translated for the %s profile, untraced\n", cpu.profile, chip8_profile_names[cpu.profile]);
+    fprintf(out, "    uint32_t rate = chip8_clock_rate(cpu);\n");
+    fprintf(out, "    uint32_t executed = 0;\n");
+    fprintf(out, "    cpu->events = 0;\n");
+    fprintf(out, "    if (n == 0) return 0;\n");
+    fprintf(out, "\n");
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    switch (cpu->PC) {\n");
+    for (uint16_t pc = 0; pc < 0x1000; pc++) {
+        if (reachable[pc]) fprintf(out, "    case 0x%03x: goto L_%03x;\n", pc, pc);
+    }
+    fprintf(out, "    default: goto fallback;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "\n");
+    fprintf(out, "fallback:\n");
+    fprintf(out, "    chip8_dispatch(cpu);\n");
+    fprintf(out, "    AOT_RETIRE();\n");
+    fprintf(out, "    goto dispatch;\n");
+    fprintf(out, "\n");
+    for (uint16_t pc = 0; pc < 0x1000; pc++) {
+        if (reachable[pc]) emit_inst(out, &cpu, reachable, pc);
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "#ifndef CHIP8_AOT_NO_MAIN\n");
+    fprintf(out, "int main(int argc, char **argv)\n");
+    fprintf(out, "{\n");
+    fprintf(out, "    uint64_t budget = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;\n");
+    fprintf(out, "\n");
+    fprintf(out, "    static Chip8 cpu;\n");
+    fprintf(out, "    chip8_load_sprites(&cpu);\n");
+    fprintf(out, "    chip8_load_rom(&cpu, (char*)chip8_aot_rom, sizeof(chip8_aot_rom));\n");
+    fprintf(out, "\n");
+    fprintf(out, "    struct timespec start, end;\n");
+    fprintf(out, "    clock_gettime(CLOCK_MONOTONIC, &start);\n");
+    fprintf(out, "    for (uint64_t executed = 0; executed < budget; ) {\n");
+    fprintf(out, "        // Same scripted input as chip8.bench\n");
+    fprintf(out, "        uint64_t chunk = executed / 1000;\n");
+    fprintf(out, "        chip8_set_keys(&cpu, chunk %% 2 == 0 ? 1u << (chunk/2*7 %% 16) : 0);\n");
+    fprintf(out, "        uint64_t left = budget - executed;\n");
+    fprintf(out, "        executed += chip8_aot_run_cycles(&cpu, left < 1000 ? (uint32_t)left : 1000);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    clock_gettime(CLOCK_MONOTONIC, &end);\n");
+    fprintf(out, "\n");
+    fprintf(out, "    double wall_ns = (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);\n");
+    fprintf(out, "    printf(\"instructions,wall_ms,ns_per_inst,inst_per_sec\\n\");\n");
+    fprintf(out, "    printf(\"%%llu,%%.3f,%%.3f,%%.0f\\n\", (unsigned long long)budget, wall_ns/1e6, wall_ns/budget, budget/(wall_ns/1e9));\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+    fprintf(out, "#endif // CHIP8_AOT_NO_MAIN\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <ROM path> [output.c]\n", argv[0]);
+        exit(1);
+    }
+
+    size_t rom_size;
+    char *rom_bytes = read_entire_file(argv[1], &rom_size);
+
+    FILE *out = stdout;
+    if (argc >= 3) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            fprintf(stderr, "Failed to open file %s because of %s\n", argv[2], strerror(errno));
+            exit(1);
+        }
+    }
+
+    emit_translation_unit(out, argv[1], (uint8_t*)rom_bytes, rom_size);
+
+    if (out != stdout) fclose(out);
+    free(rom_bytes);
+    return 0;
+}
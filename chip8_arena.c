@@ -0,0 +1,307 @@
+// Instance arena: compact storage for a great many instances, include after chip8.c and link with
+// -lpthread.
+//
+// A Chip8 is over 11 KB, nearly all of it `memory` and the `decoded` cache, and instances running
+// the same ROM have nearly all of their memory in common. The arena keeps an instance as a
+// Chip8_Arena_Slot instead: the plain state before `display` (CHIP8_STATE_SIZE bytes), the display
+// and a reference per memory page. Pages registered with chip8_arena_share are read-only and
+// referenced by every instance holding the same bytes there. An instance that writes one gets a
+// private copy when it is stored, unless the write left the page as it was.
+//
+// Slots come from one array sized by chip8_arena_init and private pages from chunks of
+// ARENA_CHUNK_PAGES, both recycled through free lists, so instances are created and freed without
+// going to malloc. Instances don't run in place: chip8_arena_load copies one into a worker (a full
+// Chip8, one per thread) and chip8_arena_store writes it back. A shared page the worker already
+// holds isn't copied again, so switching between instances of one ROM keeps the decoded
+// instruction cache warm.
+//
+// chip8_arena_share, chip8_arena_new and chip8_arena_free must have the arena to themselves,
+// chip8_arena_load and chip8_arena_store of different instances may run on different threads.
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_PAGES 4096   // Private pages allocated at once (1 MB)
+#define ARENA_MAX_CHUNKS 16384   // 16 GB of private pages
+#define ARENA_PRIVATE (1u << 31) // Set in a page reference to a private page, clear for a shared one
+#define ARENA_NONE UINT32_MAX
+
+typedef struct Chip8_Arena_Page {
+    uint8_t bytes[CHIP8_PAGE_SIZE];
+} Chip8_Arena_Page;
+
+typedef struct Chip8_Arena_Slot {
+    uint8_t state[CHIP8_STATE_SIZE]; // Chip8 up to `display`, the next free slot while unused
+    uint64_t display[32];
+    uint32_t pages[CHIP8_PAGES];
+} Chip8_Arena_Slot;
+
+// A Chip8 to run arena instances on, see chip8_arena_worker_init
+typedef struct Chip8_Arena_Worker {
+    _Alignas(64) Chip8 cpu;
+    uint32_t pages[CHIP8_PAGES]; // Shared page each page of cpu.memory was loaded from, ARENA_NONE if not one
+    uint32_t slot;               // Instance chip8_arena_load put on it, ARENA_NONE once stored
+} Chip8_Arena_Worker;
+
+typedef struct Chip8_Arena {
+    Chip8_Arena_Slot *slots;
+    uint32_t capacity;
+    uint32_t used;      // Slots handed out at least once, the rest were never touched
+    uint32_t free_slot; // First of the freed slots, ARENA_NONE if there are none
+    size_t count;       // Instances alive
+
+    Chip8_Arena_Page *shared;
+    uint64_t *shared_hashes;
+    uint32_t shared_count;
+    uint32_t shared_capacity;
+
+    pthread_mutex_t lock; // Guards everything below
+    Chip8_Arena_Page *chunks[ARENA_MAX_CHUNKS];
+    uint32_t chunk_count;
+    uint32_t private_used;  // Private pages handed out at least once
+    uint32_t free_page;     // First of the freed private pages, ARENA_NONE if there are none
+    size_t private_count;   // Private pages in use
+    size_t budget;          // Most bytes chip8_arena_bytes may reach, 0 for no limit
+} Chip8_Arena;
+
+static inline Chip8_Arena_Page *chip8_arena_page(Chip8_Arena *arena, uint32_t ref)
+{
+    if (!(ref & ARENA_PRIVATE)) return &arena->shared[ref];
+    uint32_t n = ref & ~ARENA_PRIVATE;
+    return &arena->chunks[n / ARENA_CHUNK_PAGES][n % ARENA_CHUNK_PAGES];
+}
+
+// Bytes the arena holds: slots, shared pages and private page chunks
+size_t chip8_arena_bytes(const Chip8_Arena *arena)
+{
+    return sizeof(*arena) + (size_t)arena->capacity*sizeof(Chip8_Arena_Slot)
+        + (size_t)arena->shared_capacity*(sizeof(Chip8_Arena_Page) + sizeof(uint64_t))
+        + (size_t)arena->chunk_count*ARENA_CHUNK_PAGES*sizeof(Chip8_Arena_Page);
+}
+
+// Makes room for `capacity` instances within `budget` bytes of chip8_arena_bytes (0 for no
+// limit). Returns false if the slots don't fit or can't be allocated.
+bool chip8_arena_init(Chip8_Arena *arena, uint32_t capacity, size_t budget)
+{
+    memset(arena, 0, sizeof(*arena));
+    if (capacity == 0 || capacity >= ARENA_NONE) return false;
+    arena->capacity = capacity;
+    if (budget != 0 && chip8_arena_bytes(arena) > budget) return false;
+    // Left to calloc so slots never used cost no memory
+    arena->slots = calloc(capacity, sizeof(Chip8_Arena_Slot));
+    if (!arena->slots) return false;
+    arena->free_slot = ARENA_NONE;
+    arena->free_page = ARENA_NONE;
+    arena->budget = budget;
+    pthread_mutex_init(&arena->lock, NULL);
+    return true;
+}
+
+void chip8_arena_free_all(Chip8_Arena *arena)
+{
+    for (uint32_t c = 0; c < arena->chunk_count; c++) {
+        free(arena->chunks[c]);
+    }
+    free(arena->slots);
+    free(arena->shared);
+    free(arena->shared_hashes);
+    pthread_mutex_destroy(&arena->lock);
+    memset(arena, 0, sizeof(*arena));
+}
+
+void chip8_arena_worker_init(Chip8_Arena_Worker *worker)
+{
+    memset(worker, 0, sizeof(*worker));
+    memset(worker->pages, 0xff, sizeof(worker->pages));
+    worker->slot = ARENA_NONE;
+}
+
+static uint64_t chip8_arena_page_hash(const uint8_t *bytes)
+{
+    uint64_t hash = 0;
+    for (int i = 0; i < CHIP8_PAGE_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word)*0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Registers every page of the worker's memory as shared, reusing an equal shared page if there is
+// one. Instances stored from the worker until it writes to memory reference them all. Returns
+// false if they don't fit in the budget or can't be allocated.
+bool chip8_arena_share(Chip8_Arena *arena, Chip8_Arena_Worker *worker)
+{
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        const uint8_t *bytes = &worker->cpu.memory[p*CHIP8_PAGE_SIZE];
+        uint64_t hash = chip8_arena_page_hash(bytes);
+        uint32_t found = ARENA_NONE;
+        for (uint32_t s = 0; s < arena->shared_count && found == ARENA_NONE; s++) {
+            if (arena->shared_hashes[s] == hash && memcmp(arena->shared[s].bytes, bytes, CHIP8_PAGE_SIZE) == 0) found = s;
+        }
+        if (found == ARENA_NONE) {
+            if (arena->shared_count == arena->shared_capacity) {
+                uint32_t capacity = arena->shared_capacity ? arena->shared_capacity*2 : 64;
+                size_t extra = (size_t)(capacity - arena->shared_capacity)*(sizeof(Chip8_Arena_Page) + sizeof(uint64_t));
+                if (arena->budget != 0 && chip8_arena_bytes(arena) + extra > arena->budget) return false;
+                Chip8_Arena_Page *shared = realloc(arena->shared, capacity*sizeof(*shared));
+                if (shared) arena->shared = shared;
+                uint64_t *hashes = realloc(arena->shared_hashes, capacity*sizeof(*hashes));
+                if (hashes) arena->shared_hashes = hashes;
+                if (!shared || !hashes) return false;
+                arena->shared_capacity = capacity;
+            }
+            found = arena->shared_count++;
+            memcpy(arena->shared[found].bytes, bytes, CHIP8_PAGE_SIZE);
+            arena->shared_hashes[found] = hash;
+        }
+        worker->pages[p] = found;
+    }
+    worker->cpu.written_pages = 0;
+    return true;
+}
+
+// Takes `n` private pages into `refs`. Returns false, taking none, if they don't fit in the budget
+// or can't be allocated.
+static bool chip8_arena_take_pages(Chip8_Arena *arena, uint32_t *refs, int n)
+{
+    pthread_mutex_lock(&arena->lock);
+    int taken = 0;
+    for (; taken < n; taken++) {
+        uint32_t page = arena->free_page;
+        if (page != ARENA_NONE) {
+            memcpy(&arena->free_page, chip8_arena_page(arena, page)->bytes, sizeof(uint32_t));
+        } else {
+            if (arena->private_used == arena->chunk_count*ARENA_CHUNK_PAGES) {
+                bool room = arena->chunk_count < ARENA_MAX_CHUNKS && (arena->budget == 0
+                    || chip8_arena_bytes(arena) + ARENA_CHUNK_PAGES*sizeof(Chip8_Arena_Page) <= arena->budget);
+                Chip8_Arena_Page *chunk = room ? malloc(ARENA_CHUNK_PAGES*sizeof(Chip8_Arena_Page)) : NULL;
+                if (!chunk) break;
+                arena->chunks[arena->chunk_count++] = chunk;
+            }
+            page = ARENA_PRIVATE | arena->private_used++;
+        }
+        refs[taken] = page;
+    }
+    if (taken < n) {
+        while (taken > 0) {
+            taken -= 1;
+            memcpy(chip8_arena_page(arena, refs[taken])->bytes, &arena->free_page, sizeof(uint32_t));
+            arena->free_page = refs[taken];
+        }
+    }
+    arena->private_count += taken;
+    pthread_mutex_unlock(&arena->lock);
+    return taken == n;
+}
+
+static void chip8_arena_drop_page(Chip8_Arena *arena, uint32_t ref)
+{
+    if (!(ref & ARENA_PRIVATE)) return;
+    pthread_mutex_lock(&arena->lock);
+    memcpy(chip8_arena_page(arena, ref)->bytes, &arena->free_page, sizeof(uint32_t));
+    arena->free_page = ref;
+    arena->private_count -= 1;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Returns a new instance, to be filled by chip8_arena_store before anything else, or ARENA_NONE
+// when the arena is full
+uint32_t chip8_arena_new(Chip8_Arena *arena)
+{
+    uint32_t i = arena->free_slot;
+    if (i != ARENA_NONE) {
+        memcpy(&arena->free_slot, arena->slots[i].state, sizeof(uint32_t));
+    } else if (arena->used < arena->capacity) {
+        i = arena->used++;
+    } else {
+        return ARENA_NONE;
+    }
+    memset(arena->slots[i].pages, 0xff, sizeof(arena->slots[i].pages));
+    arena->count += 1;
+    return i;
+}
+
+// Frees instance `i` and its private pages
+void chip8_arena_free(Chip8_Arena *arena, uint32_t i)
+{
+    Chip8_Arena_Slot *slot = &arena->slots[i];
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        if (slot->pages[p] != ARENA_NONE) chip8_arena_drop_page(arena, slot->pages[p]);
+    }
+    memcpy(slot->state, &arena->free_slot, sizeof(uint32_t));
+    arena->free_slot = i;
+    arena->count -= 1;
+}
+
+// Puts instance `i` on the worker. Only the pages that differ from what it holds are copied.
+void chip8_arena_load(Chip8_Arena *arena, uint32_t i, Chip8_Arena_Worker *worker)
+{
+    const Chip8_Arena_Slot *slot = &arena->slots[i];
+    Chip8 *cpu = &worker->cpu;
+    memcpy(cpu, slot->state, CHIP8_STATE_SIZE);
+    memcpy(cpu->display, slot->display, sizeof(cpu->display));
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        uint32_t ref = slot->pages[p];
+        if (ref == worker->pages[p]) continue;
+        // Private pages may change behind the worker's back, they are compared every time. Bytes
+        // already in place keep their decoded instructions.
+        worker->pages[p] = ref & ARENA_PRIVATE ? ARENA_NONE : ref;
+        const uint8_t *bytes = chip8_arena_page(arena, ref)->bytes;
+        if (memcmp(&cpu->memory[p*CHIP8_PAGE_SIZE], bytes, CHIP8_PAGE_SIZE) == 0) continue;
+        memcpy(&cpu->memory[p*CHIP8_PAGE_SIZE], bytes, CHIP8_PAGE_SIZE);
+        chip8_invalidate(cpu, p*CHIP8_PAGE_SIZE, CHIP8_PAGE_SIZE);
+    }
+    cpu->written_pages = 0;
+    worker->slot = i;
+}
+
+// Stores the worker into instance `i`. Pages the worker didn't write since chip8_arena_load put `i`
+// on it stay as they are, or since chip8_arena_share if the worker holds another instance, the
+// others get private copies. Returns false, leaving
+// the instance as it was, if those don't fit in the budget or can't be allocated.
+bool chip8_arena_store(Chip8_Arena *arena, uint32_t i, Chip8_Arena_Worker *worker)
+{
+    Chip8_Arena_Slot *slot = &arena->slots[i];
+    Chip8 *cpu = &worker->cpu;
+    bool same_slot = worker->slot == i;
+
+    // A page the worker may have written, or holds for another instance, goes to a private page
+    // unless it still matches the shared page it was loaded from
+    uint32_t refs[CHIP8_PAGES];
+    uint16_t copy = 0;
+    int missing = 0;
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        const uint8_t *bytes = &cpu->memory[p*CHIP8_PAGE_SIZE];
+        uint32_t shared = worker->pages[p];
+        bool written = (cpu->written_pages >> p) & 1;
+        refs[p] = slot->pages[p];
+        if (shared != ARENA_NONE && (!written || memcmp(arena->shared[shared].bytes, bytes, CHIP8_PAGE_SIZE) == 0)) {
+            refs[p] = shared;
+        } else if (written || !same_slot || refs[p] == ARENA_NONE) {
+            copy |= 1u << p;
+            if (refs[p] == ARENA_NONE || !(refs[p] & ARENA_PRIVATE)) missing += 1;
+        }
+    }
+    uint32_t taken[CHIP8_PAGES];
+    if (missing > 0 && !chip8_arena_take_pages(arena, taken, missing)) return false;
+
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        if ((copy >> p) & 1) {
+            if (refs[p] == ARENA_NONE || !(refs[p] & ARENA_PRIVATE)) refs[p] = taken[--missing];
+            memcpy(chip8_arena_page(arena, refs[p])->bytes, &cpu->memory[p*CHIP8_PAGE_SIZE], CHIP8_PAGE_SIZE);
+        }
+        if (slot->pages[p] != refs[p] && slot->pages[p] != ARENA_NONE) chip8_arena_drop_page(arena, slot->pages[p]);
+        slot->pages[p] = refs[p];
+        worker->pages[p] = refs[p] & ARENA_PRIVATE ? ARENA_NONE : refs[p];
+    }
+    cpu->written_pages = 0;
+    memcpy(slot->state, cpu, CHIP8_STATE_SIZE);
+    memcpy(slot->display, cpu->display, sizeof(slot->display));
+    worker->slot = ARENA_NONE;
+    return true;
+}
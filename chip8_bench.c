@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./chip8.c"
+#include "./chip8_arena.c"
+#include "./chip8_jit.c"
+#include "./chip8_lockstep.c"
+#include "./chip8_pool.c"
+#include "./chip8_profiling.c"
+#include "./chip8_rewind.c"
+#include "./chip8_rom.c"
+#include "./chip8_trace.c"
+
+#define DEFAULT_BUDGET 1000000 // Instructions executed per ROM
+#define SCRIPT_CHUNK 1000      // Instructions between scripted input changes
+#define STARTUP_RUNS 1000      // Starts of each ROM timed by -s
+#define MAX_ROMS 256
+#define POOL_FRAMES 600    // Frames per instance in -p mode (10 s of emulated time)
+#define POOL_STEP_FRAMES 4 // Frames per chip8_pool_step, i.e. per action
+
+typedef enum {
+    FORMAT_CSV,
+    FORMAT_JSON,
+} Format;
+
+typedef enum {
+    BACKEND_INTERP,
+    BACKEND_JIT,
+    BACKEND_LOCKSTEP,
+} Backend;
+
+typedef struct Bench_Result {
+    const char *name;
+    uint64_t instructions; // Emulated cycles
+    uint64_t executed;     // Instructions run, fewer than cycles where idle loops were fast-forwarded
+    uint64_t dispatches;   // Handler calls, JIT blocks or lockstep groups those took
+    double wall_ns;
+} Bench_Result;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// Deterministic input: every other chunk presses one key, the chunks in between release everything
+static void script_input(Chip8 *cpu, uint64_t chunk)
+{
+    chip8_set_keys(cpu, chunk % 2 == 0 ? 1u << (chunk/2*7 % 16) : 0);
+}
+
+// LOCKSTEP_LANES copies of the ROM with script_input shifted by one key and one chunk per lane,
+// so lane 0 sees exactly what the other backends see and the rest diverge from it
+static void bench_lockstep(const char *rom_bytes, size_t rom_size, uint64_t budget, int profile, Bench_Result *result)
+{
+    static Chip8_Lockstep group;
+    if (!chip8_lockstep_load_rom(&group, rom_bytes, rom_size)) {
+        fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", result->name, MAX_ROM_SIZE);
+        exit(1);
+    }
+    for (int lane = 0; lane < LOCKSTEP_LANES && profile >= 0; lane++) {
+        group.lanes[lane].profile = (uint8_t)profile;
+    }
+
+    double start = now_ns();
+    for (uint64_t executed = 0; executed < budget; ) {
+        uint64_t chunk = executed / SCRIPT_CHUNK;
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_set_keys(&group.lanes[lane], (chunk + lane) % 2 == 0 ? 1u << ((chunk/2*7 + lane) % 16) : 0);
+        }
+        uint64_t left = budget - executed;
+        executed += chip8_lockstep_run_cycles(&group, left < SCRIPT_CHUNK ? (uint32_t)left : SCRIPT_CHUNK);
+    }
+    result->wall_ns = now_ns() - start;
+
+    result->instructions = budget*LOCKSTEP_LANES;
+    result->executed = result->instructions;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        result->executed -= group.lanes[lane].skipped_cycles;
+    }
+    // Separate runs dispatch per lane like chip8_run_cycles
+    result->dispatches = group.dispatches;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        result->dispatches += group.lanes[lane].dispatches;
+    }
+}
+
+// `profile` overrides the quirk profile chip8_load_rom picks for the ROM, unless it's -1. With
+// `profile_dir`, which needs CHIP8_PROFILING, the counters of the run are written there as
+// <ROM name>.json and <ROM name>.folded.
+static Bench_Result bench_rom(const char *path, uint64_t budget, Backend backend, int profile, const char *profile_dir)
+{
+    static Chip8_Jit jit;
+    if (backend == BACKEND_JIT && !chip8_jit_init(&jit)) {
+        fprintf(stderr, "JIT is not supported on this platform\n");
+        exit(1);
+    }
+
+    size_t rom_size;
+    char *rom_bytes = read_entire_file(path, &rom_size);
+
+    const char *name = strrchr(path, '/');
+    if (backend == BACKEND_LOCKSTEP) {
+        Bench_Result result = {.name = name ? name + 1 : path};
+        bench_lockstep(rom_bytes, rom_size, budget, profile, &result);
+        free(rom_bytes);
+        return result;
+    }
+
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    if (!chip8_load_rom(&cpu, rom_bytes, rom_size)) {
+        fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", path, MAX_ROM_SIZE);
+        exit(1);
+    }
+    if (profile >= 0) cpu.profile = (uint8_t)profile;
+#ifdef CHIP8_PROFILING
+    static Chip8_Profiling prof;
+    memset(&prof, 0, sizeof(prof));
+    if (profile_dir) cpu.profiling = &prof;
+#else
+    (void)profile_dir;
+#endif
+
+    double start = now_ns();
+    for (uint64_t executed = 0; executed < budget; ) {
+        script_input(&cpu, executed / SCRIPT_CHUNK);
+        uint64_t chunk = budget - executed < SCRIPT_CHUNK ? budget - executed : SCRIPT_CHUNK;
+        if (backend == BACKEND_JIT) {
+            executed += chip8_jit_run_cycles(&jit, &cpu, (uint32_t)chunk);
+        } else {
+            executed += chip8_run_cycles(&cpu, (uint32_t)chunk);
+        }
+    }
+    double end = now_ns();
+
+#ifdef CHIP8_PROFILING
+    if (profile_dir) {
+        char json_path[4096], folded_path[4096];
+        snprintf(json_path, sizeof(json_path), "%s/%s.json", profile_dir, name ? name + 1 : path);
+        snprintf(folded_path, sizeof(folded_path), "%s/%s.folded", profile_dir, name ? name + 1 : path);
+        if (!chip8_profile_dump(&prof, &cpu, json_path, folded_path)) {
+            fprintf(stderr, "Could not write profile to %s: %s\n", profile_dir, strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+
+    if (backend == BACKEND_JIT) {
+        chip8_jit_free(&jit);
+    }
+    free(rom_bytes);
+
+    return (Bench_Result){
+        .name = name ? name + 1 : path,
+        .instructions = budget,
+        .executed = budget - cpu.skipped_cycles,
+        .dispatches = cpu.dispatches,
+        .wall_ns = end - start,
+    };
+}
+
+// Steps `instances` environments (ROMs assigned round-robin) with 1, 2, 4, ... threads up to the
+// number of cores and reports aggregate frames/sec, the speedup over one thread and the memory the
+// pool took per instance at the end
+static void bench_pool(char **paths, size_t count, size_t instances)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cores > 0 ? (size_t)cores : 1;
+
+    char *roms[MAX_ROMS];
+    size_t sizes[MAX_ROMS];
+    for (size_t i = 0; i < count; i++) {
+        roms[i] = read_entire_file(paths[i], &sizes[i]);
+    }
+
+    uint16_t *actions = malloc(instances*sizeof(actions[0]));
+    if (!actions) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    printf("threads,instances,frames,wall_ms,frames_per_sec,speedup,bytes_per_instance\n");
+    double base_fps = 0;
+    for (size_t threads = 1; ; threads = threads*2 < max_threads ? threads*2 : max_threads) {
+        static Chip8_Pool pool;
+        if (!chip8_pool_init(&pool, instances, threads, roms[0], sizes[0])) {
+            fprintf(stderr, "Failed to create a pool of %zu instances\n", instances);
+            exit(1);
+        }
+        for (size_t i = 1; i < instances; i++) {
+            chip8_pool_load_rom(&pool, i, roms[i % count], sizes[i % count]);
+        }
+
+        double start = now_ns();
+        for (uint32_t frame = 0; frame < POOL_FRAMES; frame += POOL_STEP_FRAMES) {
+            // Same key schedule as script_input, offset per instance
+            uint64_t chunk = frame / POOL_STEP_FRAMES;
+            for (size_t i = 0; i < instances; i++) {
+                actions[i] = (chunk + i) % 2 == 0 ? 1 << ((chunk/2*7 + i) % 16) : 0;
+            }
+            chip8_pool_step(&pool, actions, POOL_STEP_FRAMES, NULL);
+        }
+        double end = now_ns();
+
+        double frames = (double)instances*POOL_FRAMES;
+        double fps = frames/((end - start)/1e9);
+        if (threads == 1) base_fps = fps;
+        size_t bytes = chip8_arena_bytes(&pool.arena) + instances + pool.thread_count*POOL_WORKERS*sizeof(pool.cpus[0]);
+        printf("%zu,%zu,%.0f,%.3f,%.0f,%.2f,%.0f\n", pool.thread_count, instances, frames, (end - start)/1e6, fps, fps/base_fps, (double)bytes/instances);
+        chip8_pool_free(&pool);
+
+        if (threads == max_threads) break;
+    }
+
+    free(actions);
+    for (size_t i = 0; i < count; i++) {
+        free(roms[i]);
+    }
+}
+
+// Runs every ROM with script_input, keeping a rewind state per frame in REWIND_DEFAULT_BUDGET
+// bytes, then steps back through all of them and reports the storage cost and restore latency
+static void bench_rewind(char **paths, size_t count, uint64_t budget)
+{
+    static Chip8_Rewind rw;
+    printf("rom,frames,kept,bytes_per_frame,seconds_kept,keyframes,restore_us\n");
+    for (size_t i = 0; i < count; i++) {
+        size_t rom_size;
+        char *rom_bytes = read_entire_file(paths[i], &rom_size);
+        if (!chip8_rewind_init(&rw, REWIND_DEFAULT_BUDGET)) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        static Chip8 cpu;
+        memset(&cpu, 0, sizeof(cpu));
+        chip8_load_sprites(&cpu);
+        if (!chip8_load_rom(&cpu, rom_bytes, rom_size)) {
+            fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", paths[i], MAX_ROM_SIZE);
+            exit(1);
+        }
+        cpu.stop_on = CHIP8_EVENT_FRAME;
+        chip8_rewind_push(&rw, &cpu);
+        for (uint64_t executed = 0; executed < budget; ) {
+            script_input(&cpu, executed / SCRIPT_CHUNK);
+            executed += chip8_run_cycles(&cpu, SCRIPT_CHUNK);
+            if (cpu.events & CHIP8_EVENT_FRAME) chip8_rewind_push(&rw, &cpu);
+        }
+
+        size_t kept = rw.count;
+        double start = now_ns();
+        while (chip8_rewind_back(&rw, &cpu)) {}
+        double end = now_ns();
+
+        const char *name = strrchr(paths[i], '/');
+        printf("%s,%llu,%zu,%.1f,%.1f,%llu,%.3f\n", name ? name + 1 : paths[i], (unsigned long long)rw.pushed, kept,
+               (double)rw.pushed_bytes/rw.pushed, kept/(double)TIMER_RATE, (unsigned long long)rw.keyframes,
+               kept > 1 ? (end - start)/1e3/(kept - 1) : 0.0);
+        chip8_rewind_free(&rw);
+        free(rom_bytes);
+    }
+}
+
+// Time from nothing to SCRIPT_CHUNK cycles executed, averaged over STARTUP_RUNS starts of each ROM:
+// read and loaded as is (decoded as it runs), through chip8_rom_load analyzing it every time, and
+// through chip8_rom_load hitting the cache. The cache lives in a temporary directory.
+static void bench_startup(char **paths, size_t count)
+{
+    char dir[] = "/tmp/chip8_bench_cacheXXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Failed to create a cache directory because of %s\n", strerror(errno));
+        exit(1);
+    }
+
+    static Chip8 cpu;
+    static Chip8_Rom rom;
+    printf("rom,reachable,plain_us,cold_us,warm_us\n");
+    for (size_t i = 0; i < count; i++) {
+        double plain = now_ns();
+        for (int run = 0; run < STARTUP_RUNS; run++) {
+            size_t rom_size;
+            char *rom_bytes = read_entire_file(paths[i], &rom_size);
+            memset(&cpu, 0, sizeof(cpu));
+            chip8_load_sprites(&cpu);
+            if (!chip8_load_rom(&cpu, rom_bytes, rom_size)) {
+                fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", paths[i], MAX_ROM_SIZE);
+                exit(1);
+            }
+            chip8_run_cycles(&cpu, SCRIPT_CHUNK);
+            free(rom_bytes);
+        }
+
+        double cold = now_ns();
+        setenv("CHIP8_CACHE_DIR", "", 1);
+        for (int run = 0; run < STARTUP_RUNS; run++) {
+            memset(&cpu, 0, sizeof(cpu));
+            chip8_load_sprites(&cpu);
+            chip8_rom_load(&cpu, paths[i], &rom);
+            chip8_run_cycles(&cpu, SCRIPT_CHUNK);
+        }
+
+        setenv("CHIP8_CACHE_DIR", dir, 1);
+        chip8_rom_load(&cpu, paths[i], &rom);
+        double warm = now_ns();
+        for (int run = 0; run < STARTUP_RUNS; run++) {
+            memset(&cpu, 0, sizeof(cpu));
+            chip8_load_sprites(&cpu);
+            chip8_rom_load(&cpu, paths[i], &rom);
+            chip8_run_cycles(&cpu, SCRIPT_CHUNK);
+            if (!rom.cached) {
+                fprintf(stderr, "Failed to write the cache entry of %s to %s\n", paths[i], dir);
+                exit(1);
+            }
+        }
+        double end = now_ns();
+
+        size_t reachable = 0;
+        for (size_t b = 0; b < sizeof(rom.analysis.reachable); b++) {
+            reachable += __builtin_popcount(rom.analysis.reachable[b]);
+        }
+        char entry[4096];
+        chip8_rom_cache_path(entry, sizeof(entry), dir, rom.hash);
+        unlink(entry);
+
+        const char *name = strrchr(paths[i], '/');
+        printf("%s,%zu,%.2f,%.2f,%.2f\n", name ? name + 1 : paths[i], reachable, (cold - plain)/1e3/STARTUP_RUNS,
+               (warm - cold)/1e3/STARTUP_RUNS, (end - warm)/1e3/STARTUP_RUNS);
+    }
+    rmdir(dir);
+}
+
+// Replays a trace recorded by `chip8.sdl -r` on the first ROM as fast as possible and checks that
+// it ends in the recorded state. Exits with 1 if it doesn't.
+static void bench_replay(const char *trace_path, const char *rom_path)
+{
+    size_t trace_size, rom_size;
+    char *trace_bytes = read_entire_file(trace_path, &trace_size);
+    char *rom_bytes = read_entire_file(rom_path, &rom_size);
+
+    static Chip8 cpu;
+    uint64_t keys = 0;
+    double start = now_ns();
+    const char *error = chip8_trace_replay((uint8_t*)trace_bytes, trace_size, &cpu, rom_bytes, rom_size, &keys);
+    double end = now_ns();
+
+    printf("trace,cycles,keys,wall_ms,inst_per_sec,state\n");
+    printf("%s,%llu,%llu,%.3f,%.0f,%s\n", trace_path, (unsigned long long)cpu.cycles, (unsigned long long)keys,
+           (end - start)/1e6, cpu.cycles/((end - start)/1e9), error ? "MISMATCH" : "OK");
+    free(trace_bytes);
+    free(rom_bytes);
+
+    if (error) {
+        fprintf(stderr, "Replay of %s failed: %s\n", trace_path, error);
+        exit(1);
+    }
+}
+
+static void print_results(Format format, Bench_Result *results, size_t count)
+{
+    uint64_t total_instructions = 0, total_executed = 0, total_dispatches = 0;
+    double total_ns = 0;
+    for (size_t i = 0; i < count; i++) {
+        total_instructions += results[i].instructions;
+        total_executed += results[i].executed;
+        total_dispatches += results[i].dispatches;
+        total_ns += results[i].wall_ns;
+    }
+
+    if (format == FORMAT_CSV) {
+        printf("rom,instructions,executed,dispatches,wall_ms,ns_per_inst,inst_per_sec\n");
+        for (size_t i = 0; i < count; i++) {
+            Bench_Result *r = &results[i];
+            printf("%s,%llu,%llu,%llu,%.3f,%.3f,%.0f\n", r->name, (unsigned long long)r->instructions,
+                   (unsigned long long)r->executed, (unsigned long long)r->dispatches,
+                   r->wall_ns/1e6, r->wall_ns/r->instructions, r->instructions/(r->wall_ns/1e9));
+        }
+        printf("TOTAL,%llu,%llu,%llu,%.3f,%.3f,%.0f\n", (unsigned long long)total_instructions,
+               (unsigned long long)total_executed, (unsigned long long)total_dispatches,
+               total_ns/1e6, total_ns/total_instructions, total_instructions/(total_ns/1e9));
+    } else {
+        printf("{\n  \"roms\": [\n");
+        for (size_t i = 0; i < count; i++) {
+            Bench_Result *r = &results[i];
+            printf("    {\"rom\": \"%s\", \"instructions\": %llu, \"executed\": %llu, \"dispatches\": %llu, \"wall_ms\": %.3f, \"ns_per_inst\": %.3f, \"inst_per_sec\": %.0f}%s\n",
+                   r->name, (unsigned long long)r->instructions, (unsigned long long)r->executed,
+                   (unsigned long long)r->dispatches, r->wall_ns/1e6, r->wall_ns/r->instructions,
+                   r->instructions/(r->wall_ns/1e9), i + 1 < count ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"total\": {\"instructions\": %llu, \"executed\": %llu, \"dispatches\": %llu, \"wall_ms\": %.3f, \"ns_per_inst\": %.3f, \"inst_per_sec\": %.0f}\n",
+               (unsigned long long)total_instructions, (unsigned long long)total_executed,
+               (unsigned long long)total_dispatches, total_ns/1e6, total_ns/total_instructions, total_instructions/(total_ns/1e9));
+        printf("}\n");
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-n instructions] [-f csv|json] [-b interp|jit|lockstep] [-q profile] [-p instances] [-r trace] [-w] [-s] [-P dir] [ROM path...]\n", program);
+    fprintf(stderr, "  Runs every ROM headless (default: all of ROMS/) and reports interpreter throughput\n");
+    fprintf(stderr, "  -q runs every ROM with that quirk profile (default, cosmac, schip, xochip) instead of its own\n");
+    fprintf(stderr, "  -p runs that many instances in a chip8_pool_step pool and reports scaling with thread count\n");
+    fprintf(stderr, "  -w keeps a rewind state per frame and reports bytes per frame and restore latency\n");
+    fprintf(stderr, "  -P writes per-opcode counters and hotspots of every ROM to dir as JSON and folded stacks,\n");
+    fprintf(stderr, "     interp backend only, needs a build with -DCHIP8_PROFILING (see chip8.bench.prof)\n");
+    fprintf(stderr, "  -s reports the time to load every ROM and run its first %d cycles, with and without the ROM cache\n", SCRIPT_CHUNK);
+    fprintf(stderr, "  -r replays a trace recorded by chip8.sdl -r on the ROM it was recorded with and verifies the final state\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t budget = DEFAULT_BUDGET;
+    Format format = FORMAT_CSV;
+    Backend backend = BACKEND_INTERP;
+    size_t pool_instances = 0;
+    const char *trace_path = NULL;
+    bool rewind_report = false;
+    bool startup_report = false;
+    int profile = -1;
+    const char *profile_dir = NULL;
+
+    char *paths[MAX_ROMS];
+    size_t count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            budget = strtoull(argv[++i], NULL, 10);
+            if (budget == 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i += 1;
+            if (strcmp(argv[i], "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(argv[i], "json") == 0) {
+                format = FORMAT_JSON;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            i += 1;
+            if (strcmp(argv[i], "interp") == 0) {
+                backend = BACKEND_INTERP;
+            } else if (strcmp(argv[i], "jit") == 0) {
+                backend = BACKEND_JIT;
+            } else if (strcmp(argv[i], "lockstep") == 0) {
+                backend = BACKEND_LOCKSTEP;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            profile = chip8_profile_by_name(argv[++i]);
+            if (profile < 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            pool_instances = strtoull(argv[++i], NULL, 10);
+            if (pool_instances == 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            profile_dir = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0) {
+            rewind_report = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            startup_report = true;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else if (count < MAX_ROMS) {
+            paths[count++] = argv[i];
+        }
+    }
+
+    if (profile_dir) {
+#ifndef CHIP8_PROFILING
+        fprintf(stderr, "-P needs a build with -DCHIP8_PROFILING\n");
+        exit(1);
+#endif
+        if (backend != BACKEND_INTERP) usage(argv[0]);
+    }
+
+    if (trace_path) {
+        if (count != 1) usage(argv[0]);
+        bench_replay(trace_path, paths[0]);
+        return 0;
+    }
+
+    if (count == 0) {
+        count = list_roms("ROMS", paths, MAX_ROMS);
+    }
+
+    if (rewind_report) {
+        bench_rewind(paths, count, budget);
+        return 0;
+    }
+
+    if (startup_report) {
+        bench_startup(paths, count);
+        return 0;
+    }
+
+    if (pool_instances > 0) {
+        bench_pool(paths, count, pool_instances);
+        return 0;
+    }
+
+    Bench_Result results[MAX_ROMS];
+    for (size_t i = 0; i < count; i++) {
+        results[i] = bench_rom(paths[i], budget, backend, profile, profile_dir);
+    }
+
+    print_results(format, results, count);
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./chip8.c"
+#include "./chip8_jit.c"
+#include "./chip8_lockstep.c"
+#include "./chip8_rom.c"
+
+// Differential conformance harness: runs a ROM on one of the fast backends and, side by side, on
+// a reference that executes every instruction word through chip8_exec with nothing cached,
+// skipped or translated. Both get the same scripted input, and their whole architectural state
+// is compared every DIFF_CHUNK cycles. On a mismatch the chunk is replayed from its start, the
+// backend running 1, 2, 3... cycles, to find the first instruction after which they differ.
+
+#define DEFAULT_BUDGET 1000000 // Cycles per ROM and backend, per lane LOCKSTEP_BUDGET of it for lockstep
+#define LOCKSTEP_BUDGET(budget) ((budget)*4/LOCKSTEP_LANES) // Each lane has its own reference to run
+#define DIFF_CHUNK 1000        // Cycles between comparisons, and between scripted input changes
+#define DIFF_CONTEXT 6         // Instructions disassembled on each side of a divergence
+#define MAX_ROMS 256
+
+typedef enum {
+    BACKEND_INTERP,
+    BACKEND_JIT,
+    BACKEND_LOCKSTEP,
+    BACKEND_COUNT,
+} Backend;
+
+static const char *const backend_names[BACKEND_COUNT] = {"interp", "jit", "lockstep"};
+
+// What runs against the references. Interp and JIT run a single lane.
+typedef struct Harness {
+    Backend backend;
+    int lanes;
+    Chip8 cpu, cpu_start;
+    Chip8_Jit jit;
+    Chip8_Lockstep group, group_start;
+    Chip8 refs[LOCKSTEP_LANES], refs_start[LOCKSTEP_LANES];
+} Harness;
+
+static Harness harness;
+static bool verbose;
+
+// The reference: one instruction word at a time through chip8_exec, then the timers
+static void reference_run(Chip8 *cpu, uint32_t n)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    cpu->events = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        chip8_exec(cpu, chip8_fetch(cpu, cpu->PC & 0xfff));
+        chip8_tick(cpu, rate);
+        cpu->idle = false;
+    }
+}
+
+// Same pattern as chip8.bench's lockstep lanes: every other chunk presses one key, shifted by lane
+static void script_input(Chip8 *cpu, uint64_t chunk, int lane)
+{
+    chip8_set_keys(cpu, (chunk + lane) % 2 == 0 ? 1u << ((chunk/2*7 + lane) % 16) : 0);
+}
+
+// Describes the first architectural difference between `cpu` and the reference `ref` into `out`,
+// returns false if there is none
+static bool diff_state(const Chip8 *ref, const Chip8 *cpu, char *out, size_t size)
+{
+#define DIFF(cond, ...) do { if (cond) { snprintf(out, size, __VA_ARGS__); return true; } } while (0)
+    DIFF(cpu->PC != ref->PC, "PC = 0x%03x, expected 0x%03x", cpu->PC, ref->PC);
+    for (int r = 0; r < 16; r++) {
+        DIFF(cpu->V[r] != ref->V[r], "V%X = 0x%02x, expected 0x%02x", r, cpu->V[r], ref->V[r]);
+    }
+    DIFF(cpu->I != ref->I, "I = 0x%03x, expected 0x%03x", cpu->I, ref->I);
+    DIFF(cpu->stack_pointer != ref->stack_pointer, "SP = %d, expected %d", cpu->stack_pointer, ref->stack_pointer);
+    for (int i = 0; i < MAX_SUBROUTINES; i++) {
+        DIFF(cpu->call_stack[i] != ref->call_stack[i], "stack[%d] = 0x%03x, expected 0x%03x", i, cpu->call_stack[i], ref->call_stack[i]);
+    }
+    DIFF(cpu->delay_timer != ref->delay_timer, "DT = %d, expected %d", cpu->delay_timer, ref->delay_timer);
+    DIFF(cpu->sound_timer != ref->sound_timer, "ST = %d, expected %d", cpu->sound_timer, ref->sound_timer);
+    DIFF(cpu->timer_phase != ref->timer_phase, "timer phase = %u, expected %u", cpu->timer_phase, ref->timer_phase);
+    DIFF(cpu->cycles != ref->cycles, "cycles = %llu, expected %llu", (unsigned long long)cpu->cycles, (unsigned long long)ref->cycles);
+    DIFF(cpu->rng_state != ref->rng_state, "rng state = 0x%08x, expected 0x%08x", cpu->rng_state, ref->rng_state);
+    DIFF(cpu->keyboard != ref->keyboard, "keys = 0x%04x, expected 0x%04x", cpu->keyboard, ref->keyboard);
+    DIFF(cpu->key_presses != ref->key_presses, "key presses = 0x%04x, expected 0x%04x", cpu->key_presses, ref->key_presses);
+    DIFF(cpu->key_wait != ref->key_wait, "key wait = %d, expected %d", cpu->key_wait, ref->key_wait);
+    for (int addr = 0; addr < 0x1000 && memcmp(cpu->memory, ref->memory, sizeof(ref->memory)) != 0; addr++) {
+        DIFF(cpu->memory[addr] != ref->memory[addr], "memory[0x%03x] = 0x%02x, expected 0x%02x", addr, cpu->memory[addr], ref->memory[addr]);
+    }
+    for (int y = 0; y < 32; y++) {
+        DIFF(cpu->display[y] != ref->display[y], "display row %d = %016llx, expected %016llx",
+             y, (unsigned long long)cpu->display[y], (unsigned long long)ref->display[y]);
+    }
+    return false;
+#undef DIFF
+}
+
+static void harness_save(Harness *h)
+{
+    memcpy(h->refs_start, h->refs, sizeof(h->refs));
+    if (h->backend == BACKEND_LOCKSTEP) {
+        h->group_start = h->group;
+    } else {
+        h->cpu_start = h->cpu;
+    }
+}
+
+static void harness_restore(Harness *h)
+{
+    if (h->backend == BACKEND_LOCKSTEP) {
+        h->group = h->group_start;
+    } else {
+        h->cpu = h->cpu_start;
+        if (h->backend == BACKEND_JIT) chip8_jit_invalidate(&h->jit, 0, 0x1000);
+    }
+}
+
+static void harness_run(Harness *h, uint32_t n)
+{
+    switch (h->backend) {
+    case BACKEND_INTERP:   chip8_run_cycles(&h->cpu, n); break;
+    case BACKEND_JIT:      chip8_jit_run_cycles(&h->jit, &h->cpu, n); break;
+    case BACKEND_LOCKSTEP: chip8_lockstep_run_cycles(&h->group, n); break;
+    default: break;
+    }
+}
+
+static void harness_lane(Harness *h, int lane, Chip8 *out)
+{
+    if (h->backend == BACKEND_LOCKSTEP) {
+        chip8_lockstep_get(&h->group, lane, out);
+    } else {
+        *out = h->cpu;
+    }
+}
+
+// First lane whose state differs from its reference, -1 if all match
+static int harness_compare(Harness *h, char *out, size_t size)
+{
+    static Chip8 lane_state;
+    for (int lane = 0; lane < h->lanes; lane++) {
+        harness_lane(h, lane, &lane_state);
+        if (diff_state(&h->refs[lane], &lane_state, out, size)) return lane;
+    }
+    return -1;
+}
+
+// Prints the instructions around `pc` as they are in `cpu`'s memory, marking `pc`
+static void print_context(const Chip8 *cpu, uint16_t pc)
+{
+    for (int i = -DIFF_CONTEXT; i <= DIFF_CONTEXT; i++) {
+        int addr = pc + 2*i;
+        if (addr < 0 || addr > 0xffe) continue;
+        uint16_t inst = chip8_fetch((Chip8*)cpu, (uint16_t)addr);
+        printf("  %s 0x%03x: %04x  %s\n", i == 0 ? "=>" : "  ", addr, inst, chip8_decode(NULL, inst));
+    }
+}
+
+// Replays the chunk that started at harness_save to find the first cycle after which a lane
+// differs, and reports it
+static void harness_locate(Harness *h, const char *name, uint32_t n)
+{
+    memcpy(h->refs, h->refs_start, sizeof(h->refs));
+    char diff[128];
+    for (uint32_t k = 1; k <= n; k++) {
+        uint16_t pcs[LOCKSTEP_LANES];
+        for (int lane = 0; lane < h->lanes; lane++) {
+            pcs[lane] = h->refs[lane].PC & 0xfff;
+            reference_run(&h->refs[lane], 1);
+        }
+        harness_restore(h);
+        harness_run(h, k);
+        int lane = harness_compare(h, diff, sizeof(diff));
+        if (lane < 0) continue;
+
+        // Translated blocks only run whole, so the JIT can only be caught at the end of one
+        const Chip8 *ref = &h->refs[lane];
+        printf("%s %s: lane %d diverged at cycle %llu, %s the instruction at 0x%03x: %s\n",
+               name, backend_names[h->backend], lane, (unsigned long long)ref->cycles - 1,
+               h->backend == BACKEND_JIT ? "in the block ending with" : "after", pcs[lane], diff);
+        print_context(ref, pcs[lane]);
+        return;
+    }
+    harness_lane(h, 0, &h->cpu_start);
+    printf("%s %s: diverged within cycles %llu..%llu but not when replayed one cycle further at a time\n",
+           name, backend_names[h->backend], (unsigned long long)h->refs_start[0].cycles, (unsigned long long)h->refs_start[0].cycles + n);
+}
+
+// Loads the ROM into the backend and the references, false if chip8_load_rom won't take it
+static bool harness_load(Harness *h, const char *rom_bytes, size_t rom_size)
+{
+    h->lanes = h->backend == BACKEND_LOCKSTEP ? LOCKSTEP_LANES : 1;
+    for (int lane = 0; lane < h->lanes; lane++) {
+        Chip8 *ref = &h->refs[lane];
+        memset(ref, 0, sizeof(*ref));
+        chip8_load_sprites(ref);
+        if (!chip8_load_rom(ref, (char*)rom_bytes, rom_size)) return false;
+        chip8_seed(ref, (uint32_t)(lane + 1) * 0x9e3779b9u); // What chip8_lockstep_load_rom gives the lane
+    }
+    if (h->backend == BACKEND_LOCKSTEP) {
+        chip8_lockstep_load_rom(&h->group, rom_bytes, rom_size);
+    } else {
+        h->cpu = h->refs[0];
+        if (h->backend == BACKEND_JIT) chip8_jit_invalidate(&h->jit, 0, 0x1000);
+    }
+    return true;
+}
+
+static void harness_input(Harness *h, uint64_t chunk)
+{
+    for (int lane = 0; lane < h->lanes; lane++) {
+        script_input(&h->refs[lane], chunk, lane);
+        if (h->backend == BACKEND_LOCKSTEP) {
+            script_input(&h->group.lanes[lane], chunk, lane);
+        } else {
+            script_input(&h->cpu, chunk, lane);
+        }
+    }
+}
+
+// Runs `rom_bytes` for `budget` cycles on `backend` and on the reference, returns false on the
+// first divergence after reporting it
+static bool conform(Harness *h, const char *name, const char *rom_bytes, size_t rom_size, uint64_t budget)
+{
+    if (!harness_load(h, rom_bytes, rom_size)) {
+        fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", name, MAX_ROM_SIZE);
+        exit(1);
+    }
+
+    char diff[128];
+    for (uint64_t chunk = 0; chunk*DIFF_CHUNK < budget; chunk++) {
+        uint64_t left = budget - chunk*DIFF_CHUNK;
+        uint32_t n = left < DIFF_CHUNK ? (uint32_t)left : DIFF_CHUNK;
+        harness_input(h, chunk);
+        harness_run(h, n);
+        for (int lane = 0; lane < h->lanes; lane++) {
+            reference_run(&h->refs[lane], n);
+        }
+        if (harness_compare(h, diff, sizeof(diff)) < 0) continue;
+
+        // Everything is deterministic, so rather than keeping a copy of every chunk's starting
+        // state, run up to this chunk again to replay it
+        harness_load(h, rom_bytes, rom_size);
+        for (uint64_t c = 0; c < chunk; c++) {
+            harness_input(h, c);
+            harness_run(h, DIFF_CHUNK);
+            for (int lane = 0; lane < h->lanes; lane++) {
+                reference_run(&h->refs[lane], DIFF_CHUNK);
+            }
+        }
+        harness_input(h, chunk);
+        harness_save(h);
+        harness_locate(h, name, n);
+        return false;
+    }
+
+    if (verbose) {
+        printf("%s %s: %llu cycles on %d lane%s match\n", name, backend_names[h->backend],
+               (unsigned long long)budget, h->lanes, h->lanes > 1 ? "s" : "");
+    }
+    return true;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-n cycles] [-b interp|jit|lockstep] [-v] [ROM path...]\n", program);
+    fprintf(stderr, "  Runs every ROM (default: all of ROMS/) on each backend (default: all of them) against the\n");
+    fprintf(stderr, "  reference chip8_exec, comparing the whole state every %d cycles, and reports the first divergence\n", DIFF_CHUNK);
+    fprintf(stderr, "  -v also lists the runs that match\n");
+    fprintf(stderr, "  -n is per ROM and backend, lockstep runs %d lanes of 4/%d of it each\n", LOCKSTEP_LANES, LOCKSTEP_LANES);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t budget = DEFAULT_BUDGET;
+    int only = -1;
+
+    char *paths[MAX_ROMS];
+    size_t count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            budget = strtoull(argv[++i], NULL, 10);
+            if (budget == 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            i += 1;
+            for (int b = 0; b < BACKEND_COUNT; b++) {
+                if (strcmp(argv[i], backend_names[b]) == 0) only = b;
+            }
+            if (only < 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else if (count < MAX_ROMS) {
+            paths[count++] = argv[i];
+        }
+    }
+
+    if (count == 0) {
+        count = list_roms("ROMS", paths, MAX_ROMS);
+    }
+
+    bool has_jit = chip8_jit_init(&harness.jit);
+    if (only == BACKEND_JIT && !has_jit) {
+        fprintf(stderr, "JIT is not supported on this platform\n");
+        exit(1);
+    }
+
+    size_t runs = 0, failures = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t rom_size;
+        char *rom_bytes = read_entire_file(paths[i], &rom_size);
+        const char *name = strrchr(paths[i], '/');
+        name = name ? name + 1 : paths[i];
+
+        for (int b = 0; b < BACKEND_COUNT; b++) {
+            if ((only >= 0 && b != only) || (b == BACKEND_JIT && !has_jit)) continue;
+            harness.backend = (Backend)b;
+            uint64_t cycles = b == BACKEND_LOCKSTEP ? LOCKSTEP_BUDGET(budget) : budget;
+            runs += 1;
+            failures += !conform(&harness, name, rom_bytes, rom_size, cycles > 0 ? cycles : 1);
+        }
+        free(rom_bytes);
+    }
+
+    if (has_jit) chip8_jit_free(&harness.jit);
+    printf("%zu of %zu runs diverged from the reference\n", failures, runs);
+    return failures > 0;
+}
@@ -0,0 +1,124 @@
+// Execution traces kept in a file mapping, include after chip8.c. Decode them with chip8.trace.
+//
+// The Chip8_Exec_Trace ring chip8_run_cycles fills is the shared mapping of the file itself, so
+// recording costs a few stores per instruction and nothing is ever copied out. The mapped pages
+// belong to the kernel: whatever the process does, including crashing, the file holds the last
+// records written. chip8_exec_trace_flush only matters to survive the machine going down.
+//
+// Layout, integers in host byte order:
+//   0   4  "C8XT"
+//   4   2  EXEC_TRACE_VERSION
+//   6   2  sizeof(Chip8_Exec_Record)
+//   8   1  Chip8.profile when recording began
+//   9   7  zero
+//   16  .. Chip8_Exec_Trace: capacity - 1, reserved, records written, then the records
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXEC_TRACE_VERSION 1
+#define EXEC_TRACE_HEADER_SIZE 16
+#define EXEC_TRACE_DEFAULT_RECORDS (1u << 20) // 16 MB
+
+static size_t chip8_exec_trace_size(uint32_t capacity)
+{
+    return EXEC_TRACE_HEADER_SIZE + sizeof(Chip8_Exec_Trace) + (size_t)capacity*sizeof(Chip8_Exec_Record);
+}
+
+// Creates `path` holding room for `records` records (rounded up to a power of two) and returns
+// the ring to point cpu->exec_trace at, or NULL with errno set
+Chip8_Exec_Trace *chip8_exec_trace_open(const char *path, uint32_t records, const Chip8 *cpu)
+{
+    uint32_t capacity = 1;
+    while (capacity < records && capacity < (1u << 31)) capacity <<= 1;
+    size_t size = chip8_exec_trace_size(capacity);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, (off_t)size) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    uint8_t *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return NULL;
+
+    uint16_t version = EXEC_TRACE_VERSION;
+    uint16_t record_size = sizeof(Chip8_Exec_Record);
+    memcpy(file, "C8XT", 4);
+    memcpy(file + 4, &version, 2);
+    memcpy(file + 6, &record_size, 2);
+    file[8] = cpu->profile;
+
+    Chip8_Exec_Trace *trace = (Chip8_Exec_Trace*)(file + EXEC_TRACE_HEADER_SIZE);
+    trace->mask = capacity - 1;
+    return trace;
+}
+
+// Writes the records so far through to the disk
+bool chip8_exec_trace_flush(Chip8_Exec_Trace *trace)
+{
+    uint8_t *file = (uint8_t*)trace - EXEC_TRACE_HEADER_SIZE;
+    return msync(file, chip8_exec_trace_size(trace->mask + 1), MS_SYNC) == 0;
+}
+
+// Flushes and unmaps a trace from chip8_exec_trace_open, the file stays
+void chip8_exec_trace_close(Chip8_Exec_Trace *trace)
+{
+    chip8_exec_trace_flush(trace);
+    munmap((uint8_t*)trace - EXEC_TRACE_HEADER_SIZE, chip8_exec_trace_size(trace->mask + 1));
+}
+
+// Maps a trace file read-only. Returns NULL and sets `error` to why if it isn't one, the profile
+// it was recorded with goes to `profile` (may be NULL).
+const Chip8_Exec_Trace *chip8_exec_trace_map(const char *path, uint8_t *profile, const char **error)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < chip8_exec_trace_size(0)) {
+        close(fd);
+        *error = "not an execution trace";
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        *error = strerror(errno);
+        return NULL;
+    }
+
+    uint16_t version, record_size;
+    memcpy(&version, file + 4, 2);
+    memcpy(&record_size, file + 6, 2);
+    const Chip8_Exec_Trace *trace = (const Chip8_Exec_Trace*)(file + EXEC_TRACE_HEADER_SIZE);
+    if (memcmp(file, "C8XT", 4) != 0 || record_size != sizeof(Chip8_Exec_Record)) {
+        *error = "not an execution trace";
+    } else if (version != EXEC_TRACE_VERSION) {
+        *error = "unsupported execution trace version";
+    } else if (trace->mask >= (1u << 31) || (trace->mask & (trace->mask + 1)) != 0 || chip8_exec_trace_size(trace->mask + 1) != size) {
+        *error = "truncated execution trace";
+    } else {
+        if (profile) *profile = file[8];
+        return trace;
+    }
+    munmap((void*)file, size);
+    return NULL;
+}
+
+void chip8_exec_trace_unmap(const Chip8_Exec_Trace *trace)
+{
+    munmap((uint8_t*)trace - EXEC_TRACE_HEADER_SIZE, chip8_exec_trace_size(trace->mask + 1));
+}
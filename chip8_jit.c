@@ -0,0 +1,588 @@
+// Basic-block recompiler from CHIP-8 to x86-64, include after chip8.c.
+//
+// Register/arithmetic instructions and timer accesses are translated into native code that works
+// directly on a `Chip8` passed in rdi. The rest (display, keyboard, RND, RET, BNNN, memory loads and
+// stores, and whatever the profile's quirks change) become calls to the profile's interpreter
+// handler, so a block only ends with (and includes) an instruction that transfers control or writes
+// memory. Idle loops are fast-forwarded like chip8_run_cycles does.
+//
+// Only x86-64 Linux is supported, elsewhere chip8_jit_init fails and callers should keep using
+// chip8_run_cycles. Blocks are translated for the Chip8.profile they were first run with.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define CHIP8_JIT_SUPPORTED 1
+#else
+#define CHIP8_JIT_SUPPORTED 0
+#endif
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64      // Instructions per block
+#define JIT_MAX_INST_BYTES 96 // Longest native sequence emitted for one instruction
+
+// Returns the cycles at the end of the block whose timer ticks are still due
+typedef uint32_t (*Chip8_Jit_Fn)(Chip8 *cpu);
+
+typedef struct Chip8_Jit_Block {
+    Chip8_Jit_Fn fn;  // NULL if no whole instruction fits at `start`
+    uint16_t start;
+    uint16_t end;     // One past the last byte translated
+    uint16_t count;   // Instructions retired per call
+    uint8_t store;    // Bytes the closing Fx33/Fx55 wrote, 0 if the block ends otherwise
+    uint8_t store_i;  // How far that store moved I past the bytes (CHIP8_QUIRK_LOAD_STORE_I)
+    bool idle;        // `start` is an idle loop chip8_skip_idle knows
+    bool compiled;
+} Chip8_Jit_Block;
+
+// Translations of one Chip8's memory, keyed by PC like Chip8.decoded. Stores executed through
+// chip8_jit_run_cycles drop the blocks they overlap; any other write to `memory`
+// must be followed by chip8_jit_invalidate.
+typedef struct Chip8_Jit {
+    uint8_t *code;
+    size_t code_used;
+    Chip8_Jit_Block blocks[0x1000/2];
+    uint16_t covered[0x1000]; // Number of blocks translated from each byte
+} Chip8_Jit;
+
+typedef struct Jit_Emitter {
+    uint8_t *p;
+} Jit_Emitter;
+
+static void jit_emit8(Jit_Emitter *e, uint8_t b)
+{
+    *e->p++ = b;
+}
+
+static void jit_emit16(Jit_Emitter *e, uint16_t v)
+{
+    jit_emit8(e, v & 0xff);
+    jit_emit8(e, v >> 8);
+}
+
+static void jit_emit32(Jit_Emitter *e, uint32_t v)
+{
+    jit_emit16(e, v & 0xffff);
+    jit_emit16(e, v >> 16);
+}
+
+// ModRM for `[rdi + disp32]` with `reg` in the reg field
+static void jit_emit_mem(Jit_Emitter *e, uint8_t reg, size_t disp)
+{
+    jit_emit8(e, 0x80 | (reg << 3) | 7);
+    jit_emit32(e, (uint32_t)disp);
+}
+
+#define JIT_AL 0
+#define JIT_CL 1
+#define JIT_DL 2
+#define JIT_V(x) (offsetof(Chip8, V) + (x))
+#define JIT_VF JIT_V(0xf)
+
+static void jit_load8(Jit_Emitter *e, uint8_t reg, size_t disp) // mov r8, [rdi+disp]
+{
+    jit_emit8(e, 0x8a);
+    jit_emit_mem(e, reg, disp);
+}
+
+static void jit_store8(Jit_Emitter *e, uint8_t reg, size_t disp) // mov [rdi+disp], r8
+{
+    jit_emit8(e, 0x88);
+    jit_emit_mem(e, reg, disp);
+}
+
+static void jit_movzx8(Jit_Emitter *e, size_t disp) // movzx eax, byte [rdi+disp]
+{
+    jit_emit8(e, 0x0f);
+    jit_emit8(e, 0xb6);
+    jit_emit_mem(e, JIT_AL, disp);
+}
+
+static void jit_emit64(Jit_Emitter *e, uint64_t v)
+{
+    jit_emit32(e, (uint32_t)v);
+    jit_emit32(e, (uint32_t)(v >> 32));
+}
+
+static void jit_ret(Jit_Emitter *e, uint32_t pending) // mov eax, pending; ret
+{
+    jit_emit8(e, 0xb8);
+    jit_emit32(e, pending);
+    jit_emit8(e, 0xc3);
+}
+
+static void jit_store_pc(Jit_Emitter *e, uint16_t pc) // mov word [rdi+PC], imm16
+{
+    jit_emit8(e, 0x66);
+    jit_emit8(e, 0xc7);
+    jit_emit_mem(e, 0, offsetof(Chip8, PC));
+    jit_emit16(e, pc);
+}
+
+static void jit_set_pc(Jit_Emitter *e, uint16_t pc, uint32_t pending)
+{
+    jit_store_pc(e, pc);
+    jit_ret(e, pending);
+}
+
+// Expects flags from a compare, continues at pc+4 if `skip_cc` holds and pc+2 otherwise
+static void jit_skip(Jit_Emitter *e, uint16_t pc, uint8_t skip_cc, uint32_t pending)
+{
+    jit_emit8(e, 0xb9); // mov ecx, pc+2
+    jit_emit32(e, pc + 2);
+    jit_emit8(e, 0xba); // mov edx, pc+4
+    jit_emit32(e, pc + 4);
+    jit_emit8(e, 0x0f); // cmovcc ecx, edx
+    jit_emit8(e, skip_cc);
+    jit_emit8(e, 0xca);
+    jit_emit8(e, 0x66); // mov [rdi+PC], cx
+    jit_emit8(e, 0x89);
+    jit_emit_mem(e, JIT_CL, offsetof(Chip8, PC));
+    jit_ret(e, pending);
+}
+
+// Ticks the timers for the cycles a block retired so far, before it touches them
+static void chip8_jit_tick(Chip8 *cpu, uint32_t n)
+{
+    chip8_tick_many(cpu, n, chip8_clock_rate(cpu));
+}
+
+static void jit_call_tick(Jit_Emitter *e, uint32_t n)
+{
+    jit_emit8(e, 0x57); // push rdi, realigns the stack for the call
+    jit_emit8(e, 0xbe); // mov esi, n
+    jit_emit32(e, n);
+    jit_emit8(e, 0x48); // mov rax, chip8_jit_tick
+    jit_emit8(e, 0xb8);
+    jit_emit64(e, (uint64_t)(uintptr_t)chip8_jit_tick);
+    jit_emit8(e, 0xff); // call rax
+    jit_emit8(e, 0xd0);
+    jit_emit8(e, 0x5f); // pop rdi
+}
+
+// Runs `d` through `handler` with PC on the instruction, like chip8_dispatch would
+static void jit_call_handler(Jit_Emitter *e, Chip8_Handler handler, const Chip8_Decoded *d, uint16_t pc)
+{
+    uint64_t packed;
+    _Static_assert(sizeof(packed) == sizeof(*d), "a decoded instruction must fit in a register");
+    memcpy(&packed, d, sizeof(packed));
+
+    jit_store_pc(e, pc);
+    jit_emit8(e, 0x57); // push rdi
+    jit_emit8(e, 0x48); // sub rsp, 16
+    jit_emit8(e, 0x83);
+    jit_emit8(e, 0xec);
+    jit_emit8(e, 0x10);
+    jit_emit8(e, 0x48); // mov rax, packed
+    jit_emit8(e, 0xb8);
+    jit_emit64(e, packed);
+    jit_emit8(e, 0x48); // mov [rsp], rax
+    jit_emit8(e, 0x89);
+    jit_emit8(e, 0x04);
+    jit_emit8(e, 0x24);
+    jit_emit8(e, 0x48); // mov rsi, rsp
+    jit_emit8(e, 0x89);
+    jit_emit8(e, 0xe6);
+    jit_emit8(e, 0x48); // mov rax, handler
+    jit_emit8(e, 0xb8);
+    jit_emit64(e, (uint64_t)(uintptr_t)handler);
+    jit_emit8(e, 0xff); // call rax
+    jit_emit8(e, 0xd0);
+    jit_emit8(e, 0x48); // add rsp, 16
+    jit_emit8(e, 0x83);
+    jit_emit8(e, 0xc4);
+    jit_emit8(e, 0x10);
+    jit_emit8(e, 0x5f); // pop rdi
+}
+
+#define JIT_CMOVE  0x44
+#define JIT_CMOVNE 0x45
+
+typedef enum {
+    JIT_UNSUPPORTED,
+    JIT_CONTINUE, // Falls through to the next instruction
+    JIT_END,      // Transfers control, the block ends here
+} Jit_Result;
+
+// Inline translation of `d`, `pending` is what the block returns if it ends here
+static Jit_Result jit_emit_inst(Jit_Emitter *e, const Chip8_Decoded *d, uint16_t pc, uint32_t pending)
+{
+    switch (d->op) {
+    case CHIP8_OP_SYS:
+    case CHIP8_OP_INVALID:
+        return JIT_CONTINUE;
+    case CHIP8_OP_JP:
+        jit_set_pc(e, d->nnn, pending);
+        return JIT_END;
+    case CHIP8_OP_CALL:
+        jit_movzx8(e, offsetof(Chip8, stack_pointer));
+        jit_emit8(e, 0x83); // and eax, MAX_SUBROUTINES - 1
+        jit_emit8(e, 0xe0);
+        jit_emit8(e, MAX_SUBROUTINES - 1);
+        jit_emit8(e, 0x66); // mov word [rdi + rax*2 + call_stack], pc
+        jit_emit8(e, 0xc7);
+        jit_emit8(e, 0x84);
+        jit_emit8(e, 0x47);
+        jit_emit32(e, offsetof(Chip8, call_stack));
+        jit_emit16(e, pc);
+        jit_emit8(e, 0x80); // add byte [rdi+SP], 1
+        jit_emit_mem(e, 0, offsetof(Chip8, stack_pointer));
+        jit_emit8(e, 1);
+        jit_set_pc(e, d->nnn, pending);
+        return JIT_END;
+    case CHIP8_OP_SE_IMM:
+    case CHIP8_OP_SNE_IMM:
+        jit_emit8(e, 0x80); // cmp byte [rdi+Vx], nn
+        jit_emit_mem(e, 7, JIT_V(d->x));
+        jit_emit8(e, d->nn);
+        jit_skip(e, pc, d->op == CHIP8_OP_SE_IMM ? JIT_CMOVE : JIT_CMOVNE, pending);
+        return JIT_END;
+    case CHIP8_OP_SE_REG:
+    case CHIP8_OP_SNE_REG:
+        jit_load8(e, JIT_AL, JIT_V(d->x));
+        jit_emit8(e, 0x3a); // cmp al, [rdi+Vy]
+        jit_emit_mem(e, JIT_AL, JIT_V(d->y));
+        jit_skip(e, pc, d->op == CHIP8_OP_SE_REG ? JIT_CMOVE : JIT_CMOVNE, pending);
+        return JIT_END;
+    case CHIP8_OP_LD_IMM:
+        jit_emit8(e, 0xc6); // mov byte [rdi+Vx], nn
+        jit_emit_mem(e, 0, JIT_V(d->x));
+        jit_emit8(e, d->nn);
+        return JIT_CONTINUE;
+    case CHIP8_OP_ADD_IMM:
+        jit_emit8(e, 0x80); // add byte [rdi+Vx], nn
+        jit_emit_mem(e, 0, JIT_V(d->x));
+        jit_emit8(e, d->nn);
+        return JIT_CONTINUE;
+    case CHIP8_OP_LD_REG:
+        jit_load8(e, JIT_AL, JIT_V(d->y));
+        jit_store8(e, JIT_AL, JIT_V(d->x));
+        return JIT_CONTINUE;
+    case CHIP8_OP_OR:
+    case CHIP8_OP_AND:
+    case CHIP8_OP_XOR:
+        jit_load8(e, JIT_AL, JIT_V(d->y));
+        jit_emit8(e, d->op == CHIP8_OP_OR ? 0x08 : d->op == CHIP8_OP_AND ? 0x20 : 0x30); // op [rdi+Vx], al
+        jit_emit_mem(e, JIT_AL, JIT_V(d->x));
+        return JIT_CONTINUE;
+    case CHIP8_OP_ADD_REG:
+        jit_load8(e, JIT_AL, JIT_V(d->x));
+        jit_emit8(e, 0x02); // add al, [rdi+Vy]
+        jit_emit_mem(e, JIT_AL, JIT_V(d->y));
+        jit_emit8(e, 0x0f); // setc cl
+        jit_emit8(e, 0x92);
+        jit_emit8(e, 0xc1);
+        jit_store8(e, JIT_AL, JIT_V(d->x));
+        jit_store8(e, JIT_CL, JIT_VF);
+        return JIT_CONTINUE;
+    case CHIP8_OP_SUB:
+    case CHIP8_OP_SUBN:
+        // SUB: Vx = Vx - Vy, SUBN: Vx = Vy - Vx, VF = no borrow (greater or equal)
+        jit_load8(e, JIT_AL, JIT_V(d->op == CHIP8_OP_SUB ? d->x : d->y));
+        jit_load8(e, JIT_DL, JIT_V(d->op == CHIP8_OP_SUB ? d->y : d->x));
+        jit_emit8(e, 0x38); // cmp al, dl
+        jit_emit8(e, 0xd0);
+        jit_emit8(e, 0x0f); // setae cl
+        jit_emit8(e, 0x93);
+        jit_emit8(e, 0xc1);
+        jit_emit8(e, 0x28); // sub al, dl
+        jit_emit8(e, 0xd0);
+        jit_store8(e, JIT_AL, JIT_V(d->x));
+        jit_store8(e, JIT_CL, JIT_VF);
+        return JIT_CONTINUE;
+    case CHIP8_OP_SHR:
+    case CHIP8_OP_SHL:
+        // VF is written before Vx is reloaded, so x == 0xf behaves like the interpreter
+        jit_load8(e, JIT_AL, JIT_V(d->x));
+        jit_emit8(e, 0x88); // mov cl, al
+        jit_emit8(e, 0xc1);
+        if (d->op == CHIP8_OP_SHR) {
+            jit_emit8(e, 0x80); // and cl, 1
+            jit_emit8(e, 0xe1);
+            jit_emit8(e, 0x01);
+        } else {
+            jit_emit8(e, 0xc0); // shr cl, 7
+            jit_emit8(e, 0xe9);
+            jit_emit8(e, 0x07);
+        }
+        jit_store8(e, JIT_CL, JIT_VF);
+        jit_load8(e, JIT_AL, JIT_V(d->x));
+        jit_emit8(e, 0xd0); // shr al, 1 / shl al, 1
+        jit_emit8(e, d->op == CHIP8_OP_SHR ? 0xe8 : 0xe0);
+        jit_store8(e, JIT_AL, JIT_V(d->x));
+        return JIT_CONTINUE;
+    case CHIP8_OP_LD_I:
+        jit_emit8(e, 0x66); // mov word [rdi+I], nnn
+        jit_emit8(e, 0xc7);
+        jit_emit_mem(e, 0, offsetof(Chip8, I));
+        jit_emit16(e, d->nnn);
+        return JIT_CONTINUE;
+    case CHIP8_OP_ADD_I_VX:
+        jit_movzx8(e, JIT_V(d->x));
+        jit_emit8(e, 0x66); // add [rdi+I], ax
+        jit_emit8(e, 0x01);
+        jit_emit_mem(e, JIT_AL, offsetof(Chip8, I));
+        return JIT_CONTINUE;
+    case CHIP8_OP_LD_F_VX:
+        jit_movzx8(e, JIT_V(d->x));
+        jit_emit8(e, 0x8d); // lea eax, [rax + rax*4]
+        jit_emit8(e, 0x04);
+        jit_emit8(e, 0x80);
+        jit_emit8(e, 0x66); // mov [rdi+I], ax
+        jit_emit8(e, 0x89);
+        jit_emit_mem(e, JIT_AL, offsetof(Chip8, I));
+        return JIT_CONTINUE;
+    // The timers are up to date here, see jit_touches_timers
+    case CHIP8_OP_LD_VX_DT:
+        jit_load8(e, JIT_AL, offsetof(Chip8, delay_timer));
+        jit_store8(e, JIT_AL, JIT_V(d->x));
+        return JIT_CONTINUE;
+    case CHIP8_OP_LD_DT_VX:
+    case CHIP8_OP_LD_ST_VX:
+        jit_load8(e, JIT_AL, JIT_V(d->x));
+        jit_store8(e, JIT_AL, d->op == CHIP8_OP_LD_DT_VX ? offsetof(Chip8, delay_timer) : offsetof(Chip8, sound_timer));
+        return JIT_CONTINUE;
+    default:
+        return JIT_UNSUPPORTED;
+    }
+}
+
+// The block ticks the timers for the instructions before these, which read or set them
+static bool jit_touches_timers(uint8_t op)
+{
+    return op == CHIP8_OP_LD_VX_DT || op == CHIP8_OP_LD_DT_VX || op == CHIP8_OP_LD_ST_VX;
+}
+
+// The instructions chip8_skips knows
+static bool jit_is_skip(uint8_t op)
+{
+    return op == CHIP8_OP_SE_IMM || op == CHIP8_OP_SNE_IMM || op == CHIP8_OP_SE_REG ||
+           op == CHIP8_OP_SNE_REG || op == CHIP8_OP_SKP || op == CHIP8_OP_SKNP;
+}
+
+// Calls the interpreter handler for `d`. Instructions that may not continue at pc+2, or that
+// write memory the block may have been translated from, end the block.
+static Jit_Result jit_emit_fallback(Jit_Emitter *e, Chip8_Handler handler, const Chip8_Decoded *d, uint16_t pc, uint32_t pending)
+{
+    jit_call_handler(e, handler, d, pc);
+    switch (d->op) {
+    case CHIP8_OP_RET:
+    case CHIP8_OP_JP_V0:
+    case CHIP8_OP_SKP:
+    case CHIP8_OP_SKNP:
+    case CHIP8_OP_LD_VX_K:
+    case CHIP8_OP_LD_B_VX:
+    case CHIP8_OP_LD_MEM_VX:
+        jit_ret(e, pending);
+        return JIT_END;
+    default:
+        return JIT_CONTINUE;
+    }
+}
+
+static void chip8_jit_flush(Chip8_Jit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->code_used = 0;
+}
+
+static void chip8_jit_cover(Chip8_Jit *jit, const Chip8_Jit_Block *b, int delta)
+{
+    for (uint16_t addr = b->start; addr < b->end; addr++) {
+        jit->covered[addr] += delta;
+    }
+}
+
+// Whether the code at `pc` is one of the loops chip8_skip_idle knows, whatever the state. Fx0A
+// only is once it found no key, see Chip8.idle.
+static bool chip8_jit_is_idle_loop(Chip8 *cpu, uint16_t pc)
+{
+    uint16_t inst = chip8_fetch(cpu, pc);
+    uint16_t test = chip8_fetch(cpu, pc + 2);
+    uint16_t back = 0x1000 | (pc & 0xfff);
+    Chip8_Decoded d = chip8_decode_inst(inst);
+    if (inst == back) return true;
+    if (jit_is_skip(d.op) && test == back) return true;
+    return (inst & 0xf0ff) == 0xf007 && ((test >> 12) == 0x3 || (test >> 12) == 0x4) &&
+           ((test >> 8) & 0xf) == d.x && chip8_fetch(cpu, pc + 4) == back;
+}
+
+static void chip8_jit_compile(Chip8_Jit *jit, Chip8 *cpu, uint16_t pc)
+{
+#if CHIP8_JIT_SUPPORTED
+    if (jit->code_used + (JIT_MAX_BLOCK + 1)*JIT_MAX_INST_BYTES > JIT_CODE_SIZE) {
+        chip8_jit_flush(jit);
+    }
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+
+    uint8_t *entry = jit->code + jit->code_used;
+    Jit_Emitter e = {.p = entry};
+    const Chip8_Handler *handlers = chip8_handlers(cpu);
+    uint32_t quirks = chip8_quirks(cpu);
+    uint16_t addr = pc;
+    uint16_t count = 0;
+    uint16_t ticked = 0; // Instructions whose timer ticks the block already made
+    Chip8_Decoded d = {0};
+    Jit_Result result = JIT_CONTINUE;
+    while (result == JIT_CONTINUE && count < JIT_MAX_BLOCK && addr + 2 <= 0x1000) {
+        d = chip8_decode_inst(chip8_fetch(cpu, addr));
+        if (jit_touches_timers(d.op) && count > ticked) {
+            jit_call_tick(&e, count - ticked);
+            ticked = count;
+        }
+        uint32_t pending = count + 1 - ticked;
+        // The inline translations follow CHIP8_PROFILE_DEFAULT, the handlers know the other quirks
+        result = chip8_quirks_change(quirks, d.op) ? JIT_UNSUPPORTED : jit_emit_inst(&e, &d, addr, pending);
+        if (result == JIT_UNSUPPORTED) result = jit_emit_fallback(&e, handlers[d.op], &d, addr, pending);
+        count += 1;
+        addr += 2;
+    }
+    if (result != JIT_END) {
+        jit_set_pc(&e, addr, count - ticked);
+    }
+
+    Chip8_Jit_Block *b = &jit->blocks[pc >> 1];
+    b->compiled = true;
+    b->start = pc;
+    b->count = count;
+    if (count == 0) {
+        // Remember the miss, but keep it tied to the bytes so a store retries the translation
+        b->fn = NULL;
+        b->end = pc + 2;
+    } else {
+        b->fn = (Chip8_Jit_Fn)entry;
+        b->end = addr;
+        jit->code_used += e.p - entry;
+    }
+    b->store = 0;
+    b->store_i = 0;
+    if (result == JIT_END && d.op == CHIP8_OP_LD_B_VX) {
+        b->store = 3;
+    } else if (result == JIT_END && d.op == CHIP8_OP_LD_MEM_VX) {
+        b->store = d.x + 1;
+        b->store_i = quirks & CHIP8_QUIRK_LOAD_STORE_I ? d.x + 1 : 0;
+    }
+    b->idle = chip8_jit_is_idle_loop(cpu, pc);
+    chip8_jit_cover(jit, b, 1);
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+#else
+    (void)jit;
+    (void)cpu;
+    (void)pc;
+#endif
+}
+
+bool chip8_jit_init(Chip8_Jit *jit)
+{
+    memset(jit, 0, sizeof(*jit));
+#if CHIP8_JIT_SUPPORTED
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return false;
+    jit->code = code;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void chip8_jit_free(Chip8_Jit *jit)
+{
+#if CHIP8_JIT_SUPPORTED
+    if (jit->code) munmap(jit->code, JIT_CODE_SIZE);
+#endif
+    jit->code = NULL;
+}
+
+// Drops every block translated from memory[addr..addr+len)
+void chip8_jit_invalidate(Chip8_Jit *jit, uint16_t addr, size_t len)
+{
+    bool overlaps = false;
+    for (size_t i = 0; i < len; i++) {
+        if (jit->covered[(addr + i) & 0xfff]) {
+            overlaps = true;
+            break;
+        }
+    }
+    if (!overlaps) return;
+
+    for (size_t i = 0; i < 0x1000/2; i++) {
+        Chip8_Jit_Block *b = &jit->blocks[i];
+        if (!b->compiled) continue;
+        for (size_t j = 0; j < len; j++) {
+            uint16_t a = (addr + j) & 0xfff;
+            if (a >= b->start && a < b->end) {
+                chip8_jit_cover(jit, b, -1);
+                b->compiled = false;
+                break;
+            }
+        }
+    }
+}
+
+// Same contract as chip8_run_cycles. Events are checked between blocks, so a run can
+// overshoot a stop_on event by the rest of the block that raised it.
+uint32_t chip8_jit_run_cycles(Chip8_Jit *jit, Chip8 *cpu, uint32_t n)
+{
+    if (!jit->code || cpu->exec_trace) return chip8_run_cycles(cpu, n);
+
+    uint32_t rate = chip8_clock_rate(cpu);
+    uint32_t executed = 0;
+    uint64_t dispatches = 0;
+
+    cpu->events = 0;
+    cpu->idle = false;
+    while (executed < n) {
+        uint16_t pc = cpu->PC;
+        if (pc < 0x1000) {
+            Chip8_Jit_Block *b = &jit->blocks[pc >> 1];
+            if (b->compiled && b->start != pc) {
+                // Keyed like Chip8.decoded: the other address of the pair was translated
+                chip8_jit_cover(jit, b, -1);
+                b->compiled = false;
+            }
+            if (!b->compiled) chip8_jit_compile(jit, cpu, pc);
+            if (b->idle) {
+                executed += chip8_skip_idle(cpu, n - executed, rate);
+                if (executed == n || (cpu->events & cpu->stop_on)) break;
+            }
+            if (b->fn && b->count <= n - executed) {
+                chip8_tick_many(cpu, b->fn(cpu), rate);
+                executed += b->count;
+                dispatches += 1;
+                if (b->store) chip8_jit_invalidate(jit, cpu->I - b->store_i, b->store);
+                if (cpu->idle) {
+                    cpu->idle = false;
+                    executed += chip8_skip_idle(cpu, n - executed, rate);
+                }
+                if (cpu->events & cpu->stop_on) break;
+                continue;
+            }
+        }
+
+        uint16_t inst = chip8_fetch(cpu, pc & 0xfff);
+        uint16_t I = cpu->I;
+        chip8_dispatch(cpu);
+        if ((inst & 0xf0ff) == 0xf033) {
+            chip8_jit_invalidate(jit, I, 3);
+        } else if ((inst & 0xf0ff) == 0xf055) {
+            chip8_jit_invalidate(jit, I, ((inst >> 8) & 0xf) + 1);
+        }
+        chip8_tick(cpu, rate);
+        executed += 1;
+        dispatches += 1;
+        if (cpu->idle) {
+            cpu->idle = false;
+            executed += chip8_skip_idle(cpu, n - executed, rate);
+        }
+
+        if (cpu->events & cpu->stop_on) break;
+    }
+
+    cpu->dispatches += dispatches;
+    return executed;
+}
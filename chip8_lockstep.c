@@ -0,0 +1,468 @@
+// Lockstep interpreter for many instances of one ROM, include after chip8.c.
+//
+// A `Chip8_Lockstep` holds LOCKSTEP_LANES instances with the hot registers in structure-of-arrays
+// form: V[r] is one vector with a lane per instance, and the same goes for I, PC, the timers and
+// the RNG state. Every cycle the lanes that haven't executed yet are grouped by PC: the first
+// pending lane picks the instruction, every lane sitting at the same PC with the same instruction
+// joins it, and the instruction is decoded and dispatched once for the whole group with the other
+// lanes masked out. Lanes that diverged simply form their own group later in the same cycle, so
+// every lane still executes exactly one instruction per cycle and ends up bit for bit where
+// chip8_run_cycles would have taken it.
+//
+// Register and arithmetic instructions are executed with vector operations (GCC/Clang vector
+// extensions). On x86-64 Linux chip8_lockstep_run_cycles is built twice, for AVX2 and for the
+// baseline SSE2, and the loader picks the best one for the CPU. Everything else (display,
+// keyboard, stack, memory, RND) runs the regular handler on each lane of the group.
+//
+// Each group flags its lanes idle the way its instruction sets Chip8.idle. After a cycle in which
+// every lane was flagged, all of them are fast-forwarded by the cycles they can all skip (see
+// chip8_skip_idle), since the clock is shared.
+//
+// Lanes driven by different inputs can drift apart for good, at which point groups of one or two
+// lanes cost more than plain chip8_run_cycles. A run whose groups averaged fewer than
+// LOCKSTEP_MIN_GROUP lanes makes the following runs execute every lane on its own, and lockstep
+// is retried every LOCKSTEP_RETRY runs in case the lanes came back together.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOCKSTEP_LANES 32    // One bit per lane in a uint32_t
+#define LOCKSTEP_MIN_GROUP 4 // Average lanes per dispatch below which lanes run separately
+#define LOCKSTEP_RETRY 16    // Runs spent separately before trying lockstep again
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <emmintrin.h>
+#ifndef LOCKSTEP_TARGETS
+#ifdef __SANITIZE_THREAD__
+#define LOCKSTEP_TARGETS // Clone resolvers run before ThreadSanitizer is initialized and crash in it
+#else
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#else
+#define LOCKSTEP_TARGETS
+#endif
+
+typedef uint8_t Chip8_Lanes8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int8_t Chip8_Mask8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t Chip8_Pairs8 __attribute__((vector_size(LOCKSTEP_LANES))); // Two 8-bit lanes per element
+typedef uint16_t Chip8_Lanes16 __attribute__((vector_size(LOCKSTEP_LANES*2)));
+typedef uint32_t Chip8_Lanes32 __attribute__((vector_size(LOCKSTEP_LANES*4)));
+
+// Needs _Alignof(Chip8_Lockstep) alignment: use static storage or aligned_alloc
+typedef struct Chip8_Lockstep {
+    Chip8_Lanes8 V[16];
+    Chip8_Lanes16 I;
+    Chip8_Lanes16 PC;
+    Chip8_Lanes8 delay_timer;
+    Chip8_Lanes8 sound_timer;
+    Chip8_Lanes32 rng_state;
+
+    // Everything else of every lane: memory, display, keyboard, stack. Their V, I, PC, timers and
+    // rng_state are stale, the vectors above are the real ones (see chip8_lockstep_get).
+    Chip8 lanes[LOCKSTEP_LANES];
+
+    // Decoded instruction per address, valid while `inst` matches what the group fetched
+    struct {
+        uint16_t inst;
+        Chip8_Decoded decoded;
+    } decoded[0x1000];
+
+    // Nonzero where a lane may differ from `image`, the memory chip8_lockstep_load_rom set up.
+    // Lanes only have to be compared at those addresses.
+    uint8_t written[0x1000];
+    uint8_t image[0x1000];
+
+    uint32_t clock_rate;      // Shared by all lanes, see Chip8.clock_rate
+    uint32_t timer_phase;
+    uint64_t cycles;
+    uint64_t lockstep_cycles; // Cycles run in lockstep
+    uint64_t dispatches;      // Groups those cycles took, lockstep_cycles*LOCKSTEP_LANES/dispatches is the average group
+    uint32_t separate_runs;   // Runs left before retrying lockstep
+} Chip8_Lockstep;
+
+static inline void chip8_lockstep_sync_in(Chip8_Lockstep *group, int lane)
+{
+    Chip8 *cpu = &group->lanes[lane];
+    for (int r = 0; r < 16; r++) {
+        cpu->V[r] = group->V[r][lane];
+    }
+    cpu->I = group->I[lane];
+    cpu->PC = group->PC[lane];
+    cpu->delay_timer = group->delay_timer[lane];
+    cpu->sound_timer = group->sound_timer[lane];
+    cpu->rng_state = group->rng_state[lane];
+}
+
+static inline void chip8_lockstep_sync_out(Chip8_Lockstep *group, int lane)
+{
+    const Chip8 *cpu = &group->lanes[lane];
+    for (int r = 0; r < 16; r++) {
+        group->V[r][lane] = cpu->V[r];
+    }
+    group->I[lane] = cpu->I;
+    group->PC[lane] = cpu->PC;
+    group->delay_timer[lane] = cpu->delay_timer;
+    group->sound_timer[lane] = cpu->sound_timer;
+    group->rng_state[lane] = cpu->rng_state;
+}
+
+// Every lane runs `rom_bytes`, with distinct CXNN sequences like chip8_pool_load_rom. Returns
+// false if chip8_load_rom won't take it.
+bool chip8_lockstep_load_rom(Chip8_Lockstep *group, const char *rom_bytes, size_t rom_size)
+{
+    memset(group, 0, sizeof(*group));
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        Chip8 *cpu = &group->lanes[lane];
+        chip8_load_sprites(cpu);
+        if (!chip8_load_rom(cpu, (char*)rom_bytes, rom_size)) return false;
+        chip8_seed(cpu, (uint32_t)(lane + 1) * 0x9e3779b9u);
+        chip8_lockstep_sync_out(group, lane);
+    }
+    memcpy(group->image, group->lanes[0].memory, sizeof(group->image));
+    return true;
+}
+
+// Copies the state of `lane` out into a regular instance
+void chip8_lockstep_get(Chip8_Lockstep *group, int lane, Chip8 *cpu)
+{
+    chip8_lockstep_sync_in(group, lane);
+    *cpu = group->lanes[lane];
+    cpu->clock_rate = group->clock_rate;
+    cpu->timer_phase = group->timer_phase;
+    cpu->cycles = group->cycles;
+}
+
+// Replaces the state of `lane`. The clock is shared, so `cpu`'s timing fields are ignored.
+void chip8_lockstep_set(Chip8_Lockstep *group, int lane, const Chip8 *cpu)
+{
+    group->lanes[lane] = *cpu;
+    chip8_lockstep_sync_out(group, lane);
+    for (int addr = 0; addr < 0x1000; addr++) {
+        if (cpu->memory[addr] != group->image[addr]) group->written[addr] = 1;
+    }
+}
+
+static inline uint16_t chip8_lockstep_fetch(Chip8_Lockstep *group, int lane, uint16_t addr)
+{
+    return chip8_fetch(&group->lanes[lane], addr);
+}
+
+// All ones in the lanes whose bit is set in `bits`. Vectors are passed and returned through
+// pointers, their by-value ABI depends on whether AVX is enabled.
+static inline void chip8_lockstep_mask8(uint32_t bits, Chip8_Lanes8 *mask)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    // Spread byte k of `bits` over bytes 8k..8k+7, then test bit (i mod 8) in byte i
+    __m128i x = _mm_cvtsi32_si128((int)bits);
+    x = _mm_unpacklo_epi8(x, x);
+    x = _mm_unpacklo_epi16(x, x);
+    __m128i select = _mm_set1_epi64x((long long)0x8040201008040201ull);
+    __m128i low = _mm_unpacklo_epi32(x, x);
+    __m128i high = _mm_unpackhi_epi32(x, x);
+    low = _mm_cmpeq_epi8(_mm_and_si128(low, select), select);
+    high = _mm_cmpeq_epi8(_mm_and_si128(high, select), select);
+    memcpy((char*)mask, &low, 16);
+    memcpy((char*)mask + 16, &high, 16);
+#else
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        (*mask)[lane] = (bits >> lane) & 1 ? 0xff : 0;
+    }
+#endif
+}
+
+// Same as chip8_lockstep_mask8 with 16-bit lanes, from its result
+static inline void chip8_lockstep_mask16(const Chip8_Lanes8 *mask8, Chip8_Lanes16 *mask)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    __m128i m[2], wide[4];
+    memcpy(m, mask8, sizeof(m));
+    wide[0] = _mm_unpacklo_epi8(m[0], m[0]);
+    wide[1] = _mm_unpackhi_epi8(m[0], m[0]);
+    wide[2] = _mm_unpacklo_epi8(m[1], m[1]);
+    wide[3] = _mm_unpackhi_epi8(m[1], m[1]);
+    memcpy(mask, wide, sizeof(wide));
+#else
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        (*mask)[lane] = (*mask8)[lane] ? 0xffff : 0;
+    }
+#endif
+}
+
+// Lane bitmask of a 16-bit vector comparison result
+static inline uint32_t chip8_lockstep_bits16(const Chip8_Lanes16 *mask)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    __m128i q[4];
+    memcpy(q, mask, sizeof(q));
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(q[0], q[1])) |
+           (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(q[2], q[3])) << 16;
+#else
+    uint32_t bits = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        bits |= (uint32_t)((*mask)[lane] & 1) << lane;
+    }
+    return bits;
+#endif
+}
+
+// Lanes of `pending` at the same PC and instruction as its first lane
+static inline uint32_t chip8_lockstep_group(Chip8_Lockstep *group, uint32_t pending, uint16_t *inst)
+{
+    int leader = __builtin_ctz(pending);
+    uint16_t pc = group->PC[leader];
+    *inst = chip8_lockstep_fetch(group, leader, pc);
+
+    uint32_t lanes = pending;
+    if (lanes & (lanes - 1)) {
+        Chip8_Lanes16 same_pc = (Chip8_Lanes16)(group->PC == pc);
+        lanes &= chip8_lockstep_bits16(&same_pc);
+    }
+
+    if (group->written[pc & 0xfff] || group->written[(pc + 1) & 0xfff]) {
+        for (uint32_t rest = lanes; rest != 0; rest &= rest - 1) {
+            int lane = __builtin_ctz(rest);
+            if (chip8_lockstep_fetch(group, lane, pc) != *inst) lanes &= ~(1u << lane);
+        }
+    }
+    return lanes;
+}
+
+#define LOCKSTEP_BLEND(old, new, mask) (((new) & (mask)) | ((old) & ~(mask)))
+
+// SSE2 has neither unsigned nor shifting byte operations, so these are spelled with the ones it has
+#define LOCKSTEP_GT(a, b) ((Chip8_Lanes8)((Chip8_Mask8)((a) ^ 0x80) > (Chip8_Mask8)((b) ^ 0x80)) & 1)
+#define LOCKSTEP_GE(a, b) (LOCKSTEP_GT(b, a) ^ 1)
+#define LOCKSTEP_SHR1(a) ((Chip8_Lanes8)(((Chip8_Pairs8)(a) >> 1) & 0x7f7f))
+#define LOCKSTEP_MSB(a) ((Chip8_Lanes8)((Chip8_Mask8)(a) < 0) & 1)
+
+// Runs the regular handler on every lane of the group, returns the lanes it flagged idle
+static uint32_t chip8_lockstep_each(Chip8_Lockstep *group, uint32_t lanes, const Chip8_Decoded *d)
+{
+    uint32_t idle = 0;
+    for (uint32_t rest = lanes; rest != 0; rest &= rest - 1) {
+        int lane = __builtin_ctz(rest);
+        Chip8 *cpu = &group->lanes[lane];
+        chip8_lockstep_sync_in(group, lane);
+        uint16_t I = cpu->I;
+        chip8_dispatch(cpu);
+        chip8_lockstep_sync_out(group, lane);
+        if (cpu->idle) {
+            cpu->idle = false;
+            idle |= 1u << lane;
+        }
+
+        if (d->op == CHIP8_OP_LD_B_VX || d->op == CHIP8_OP_LD_MEM_VX) {
+            size_t len = d->op == CHIP8_OP_LD_B_VX ? 3 : (size_t)d->x + 1;
+            for (size_t i = 0; i < len; i++) {
+                group->written[(I + i) & 0xfff] = 1;
+            }
+        }
+    }
+    return idle;
+}
+
+// Fast-forwards every lane through the idle loop it is in, when all of them are in one, by the
+// cycles all of them can skip within `budget`. Returns the cycles skipped.
+static uint32_t chip8_lockstep_skip_idle(Chip8_Lockstep *group, uint32_t budget, uint32_t rate)
+{
+    uint32_t skip = budget;
+    for (int lane = 0; lane < LOCKSTEP_LANES && skip > 0; lane++) {
+        Chip8 *cpu = &group->lanes[lane];
+        chip8_lockstep_sync_in(group, lane);
+        cpu->clock_rate = group->clock_rate;
+        cpu->timer_phase = group->timer_phase;
+        cpu->stop_on = 0;
+        uint32_t cycles = chip8_idle_cycles(cpu, skip, rate);
+        if (cycles < skip) skip = cycles;
+    }
+    skip -= skip % 6; // Whole iterations of every loop, see chip8_idle_cycles
+    if (skip == 0) return 0;
+
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        Chip8 *cpu = &group->lanes[lane];
+        cpu->timer_phase = group->timer_phase;
+        chip8_idle_forward(cpu, skip, rate);
+        chip8_lockstep_sync_out(group, lane);
+    }
+    group->timer_phase = group->lanes[0].timer_phase;
+    group->cycles += skip;
+    return skip;
+}
+
+// Every lane on its own with chip8_run_cycles, for lanes that no longer share PCs
+static void chip8_lockstep_run_separately(Chip8_Lockstep *group, uint32_t n)
+{
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        Chip8 *cpu = &group->lanes[lane];
+        chip8_lockstep_sync_in(group, lane);
+        cpu->clock_rate = group->clock_rate;
+        cpu->timer_phase = group->timer_phase;
+        cpu->cycles = group->cycles;
+        cpu->stop_on = 0;
+        chip8_run_cycles(cpu, n);
+        chip8_lockstep_sync_out(group, lane);
+    }
+    group->timer_phase = group->lanes[0].timer_phase;
+    group->cycles = group->lanes[0].cycles;
+
+    // Stores aren't tracked here, find the bytes that moved away from the image
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        const uint8_t *memory = group->lanes[lane].memory;
+        for (int addr = 0; addr < 0x1000; addr++) {
+            group->written[addr] |= memory[addr] != group->image[addr];
+        }
+    }
+}
+
+// Runs every lane for `n` cycles, returns `n`
+LOCKSTEP_TARGETS
+uint32_t chip8_lockstep_run_cycles(Chip8_Lockstep *group, uint32_t n)
+{
+    if (group->separate_runs > 0) {
+        group->separate_runs -= 1;
+        chip8_lockstep_run_separately(group, n);
+        return n;
+    }
+
+    uint32_t rate = group->clock_rate != 0 ? group->clock_rate : CLOCK_RATE;
+    uint32_t quirks = chip8_quirks(&group->lanes[0]); // Every lane runs the same ROM, so the same profile
+    uint64_t dispatches = group->dispatches;
+
+    for (uint32_t cycle = 0; cycle < n; cycle++) {
+        uint32_t pending = 0xffffffffu;
+        uint32_t idle = 0; // Lanes that flagged an idle loop this cycle, like Chip8.idle
+        while (pending != 0) {
+            uint16_t inst;
+            uint32_t lanes = chip8_lockstep_group(group, pending, &inst);
+            pending &= ~lanes;
+            group->dispatches += 1;
+
+            uint16_t pc = group->PC[__builtin_ctz(lanes)] & 0xfff;
+            if (group->decoded[pc].inst != inst || group->decoded[pc].decoded.op == CHIP8_OP_UNDECODED) {
+                group->decoded[pc].inst = inst;
+                group->decoded[pc].decoded = chip8_decode_inst(inst);
+            }
+            Chip8_Decoded d = group->decoded[pc].decoded;
+            if (quirks != 0 && chip8_quirks_change(quirks, d.op)) {
+                idle |= chip8_lockstep_each(group, lanes, &d); // Vectorized below as CHIP8_PROFILE_DEFAULT
+                continue;
+            }
+
+            Chip8_Lanes8 mask;
+            Chip8_Lanes16 mask16;
+            chip8_lockstep_mask8(lanes, &mask);
+            chip8_lockstep_mask16(&mask, &mask16);
+            Chip8_Lanes8 *V = group->V;
+            Chip8_Lanes16 next = group->PC + 2;
+            Chip8_Lanes8 skips; // Lanes that skip the next instruction
+
+            switch (d.op) {
+            case CHIP8_OP_JP:
+                group->PC = LOCKSTEP_BLEND(group->PC, (Chip8_Lanes16){0} + d.nnn, mask16);
+                if ((uint16_t)(pc - d.nnn) <= 4) idle |= lanes; // Same test as chip8_op_jp
+                continue;
+            case CHIP8_OP_SE_IMM:
+                skips = (Chip8_Lanes8)(V[d.x] == d.nn);
+                goto skip;
+            case CHIP8_OP_SNE_IMM:
+                skips = (Chip8_Lanes8)(V[d.x] != d.nn);
+                goto skip;
+            case CHIP8_OP_SE_REG:
+                skips = (Chip8_Lanes8)(V[d.x] == V[d.y]);
+                goto skip;
+            case CHIP8_OP_SNE_REG:
+                skips = (Chip8_Lanes8)(V[d.x] != V[d.y]);
+            skip: {
+                Chip8_Lanes16 skips16;
+                skips &= mask;
+                chip8_lockstep_mask16(&skips, &skips16);
+                next += skips16 & 2;
+            } break;
+            case CHIP8_OP_LD_IMM:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], (Chip8_Lanes8){0} + d.nn, mask);
+                break;
+            case CHIP8_OP_ADD_IMM:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.x] + d.nn, mask);
+                break;
+            case CHIP8_OP_LD_REG:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.y], mask);
+                break;
+            case CHIP8_OP_OR:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.x] | V[d.y], mask);
+                break;
+            case CHIP8_OP_AND:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.x] & V[d.y], mask);
+                break;
+            case CHIP8_OP_XOR:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.x] ^ V[d.y], mask);
+                break;
+            // Same write order as the scalar handlers, VF last, so x == 0xf behaves the same
+            case CHIP8_OP_ADD_REG: {
+                Chip8_Lanes8 vx = V[d.x];
+                Chip8_Lanes8 sum = vx + V[d.y];
+                V[d.x] = LOCKSTEP_BLEND(vx, sum, mask);
+                V[0xf] = LOCKSTEP_BLEND(V[0xf], LOCKSTEP_GT(vx, sum), mask);
+            } break;
+            case CHIP8_OP_SUB: {
+                Chip8_Lanes8 vx = V[d.x], vy = V[d.y];
+                V[d.x] = LOCKSTEP_BLEND(vx, vx - vy, mask);
+                V[0xf] = LOCKSTEP_BLEND(V[0xf], LOCKSTEP_GE(vx, vy), mask);
+            } break;
+            case CHIP8_OP_SUBN: {
+                Chip8_Lanes8 vx = V[d.x], vy = V[d.y];
+                V[d.x] = LOCKSTEP_BLEND(vx, vy - vx, mask);
+                V[0xf] = LOCKSTEP_BLEND(V[0xf], LOCKSTEP_GE(vy, vx), mask);
+            } break;
+            // VF first here, then Vx is shifted from whatever V[x] holds afterwards
+            case CHIP8_OP_SHR:
+                V[0xf] = LOCKSTEP_BLEND(V[0xf], V[d.x] & 1, mask);
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], LOCKSTEP_SHR1(V[d.x]), mask);
+                break;
+            case CHIP8_OP_SHL:
+                V[0xf] = LOCKSTEP_BLEND(V[0xf], LOCKSTEP_MSB(V[d.x]), mask);
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], V[d.x] + V[d.x], mask);
+                break;
+            case CHIP8_OP_LD_I:
+                group->I = LOCKSTEP_BLEND(group->I, (Chip8_Lanes16){0} + d.nnn, mask16);
+                break;
+            case CHIP8_OP_LD_VX_DT:
+                V[d.x] = LOCKSTEP_BLEND(V[d.x], group->delay_timer, mask);
+                break;
+            case CHIP8_OP_LD_DT_VX:
+                group->delay_timer = LOCKSTEP_BLEND(group->delay_timer, V[d.x], mask);
+                break;
+            case CHIP8_OP_LD_ST_VX:
+                group->sound_timer = LOCKSTEP_BLEND(group->sound_timer, V[d.x], mask);
+                break;
+            case CHIP8_OP_SYS:
+            case CHIP8_OP_INVALID:
+                break;
+            default:
+                idle |= chip8_lockstep_each(group, lanes, &d);
+                continue;
+            }
+            group->PC = LOCKSTEP_BLEND(group->PC, next, mask16);
+        }
+
+        // Every lane has executed one instruction, tick the shared clock like chip8_tick
+        group->cycles += 1;
+        group->timer_phase += TIMER_RATE;
+        while (group->timer_phase >= rate) {
+            group->timer_phase -= rate;
+            group->delay_timer -= (Chip8_Lanes8)(group->delay_timer != 0) & 1;
+            group->sound_timer -= (Chip8_Lanes8)(group->sound_timer != 0) & 1;
+        }
+
+        if (idle == 0xffffffffu) {
+            cycle += chip8_lockstep_skip_idle(group, n - cycle - 1, rate);
+        }
+    }
+
+    group->lockstep_cycles += n;
+    if ((uint64_t)n*LOCKSTEP_LANES < (group->dispatches - dispatches)*LOCKSTEP_MIN_GROUP) {
+        group->separate_runs = LOCKSTEP_RETRY;
+    }
+    return n;
+}
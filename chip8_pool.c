@@ -0,0 +1,286 @@
+// Vectorized environment: a pool of independent `Chip8` instances stepped frame by frame across
+// all cores, include after chip8.c and chip8_arena.c and link with -lpthread.
+//
+// Every chip8_pool_step applies one action (a 16-bit keyboard mask) per instance, runs each
+// instance for the requested number of 60 Hz frames and sums a per-frame reward. Instances share
+// nothing, so the only synchronization is handing out work: each thread owns a contiguous slice of
+// the instances and claims POOL_CHUNK of them at a time, and a thread that runs out of its own
+// slice steals chunks from the others' slices with the same atomic counter.
+//
+// The instances live in a Chip8_Arena, a few hundred bytes each while they share the pages of their
+// ROM, and run on arena workers. Each thread has POOL_WORKERS of them and runs all instances of a
+// ROM on the same one, so moving from one instance to the next copies little and keeps the
+// decoded instructions.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POOL_CHUNK 8        // Instances claimed at once from a slice
+#define POOL_WORKERS 32     // Arena workers per thread
+#define POOL_MAX_THREADS 256
+
+// Reward for one instance after one frame, summed over the frames of a chip8_pool_step
+typedef float (*Chip8_Pool_Reward)(const Chip8 *cpu, void *user);
+
+// A thread's slice of instances, padded so claiming from one slice doesn't contend with another
+typedef struct Chip8_Pool_Slice {
+    _Alignas(64) atomic_size_t next;
+    size_t end;
+} Chip8_Pool_Slice;
+
+typedef struct Chip8_Pool Chip8_Pool;
+
+typedef struct Chip8_Pool_Worker {
+    Chip8_Pool *pool;
+    size_t index;
+} Chip8_Pool_Worker;
+
+// Workers point back into the pool, so it must not be moved between init and free
+struct Chip8_Pool {
+    Chip8_Arena arena;         // Instance i is arena slot i
+    Chip8_Arena_Worker *cpus;  // Thread t runs its instances on cpus[t*POOL_WORKERS + homes[i]]
+    uint8_t *homes;            // Picked by ROM
+    uint32_t home_pages[POOL_WORKERS]; // Shared page at 0x200 of the ROM each home was given to
+    uint32_t next_home;
+    size_t count;
+
+    Chip8_Pool_Reward reward; // NULL means every reward is 0
+    void *reward_user;
+
+    // Thread 0 is whoever calls chip8_pool_step, threads[1..thread_count) are workers
+    size_t thread_count;
+    pthread_t threads[POOL_MAX_THREADS];
+    Chip8_Pool_Worker workers[POOL_MAX_THREADS];
+    Chip8_Pool_Slice *slices;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation; // Bumped by every chip8_pool_step, workers wait for it to change
+    size_t busy;         // Workers still running the current step
+    bool quit;
+
+    // Arguments of the step in progress
+    const uint16_t *actions;
+    uint32_t frames;
+    float *rewards;
+};
+
+static void chip8_pool_step_one(Chip8_Pool *pool, size_t i, Chip8_Arena_Worker *worker)
+{
+    Chip8 *cpu = &worker->cpu;
+    chip8_arena_load(&pool->arena, (uint32_t)i, worker);
+    uint16_t action = pool->actions ? pool->actions[i] : 0;
+    float reward = 0;
+
+    chip8_set_keys(cpu, action);
+    uint32_t stop_on = cpu->stop_on;
+    cpu->stop_on = CHIP8_EVENT_FRAME;
+    for (uint32_t frame = 0; frame < pool->frames; frame++) {
+        // A second of cycles is always enough to reach the next timer tick
+        chip8_run_cycles(cpu, chip8_clock_rate(cpu));
+        if (pool->reward) reward += pool->reward(cpu, pool->reward_user);
+    }
+    cpu->stop_on = stop_on;
+
+    if (!chip8_arena_store(&pool->arena, (uint32_t)i, worker)) {
+        fprintf(stderr, "Out of memory for the pages of pool instance %zu\n", i);
+        exit(1);
+    }
+    if (pool->rewards) pool->rewards[i] = reward;
+}
+
+// Drains the thread's own slice first, then steals from the others in order
+static void chip8_pool_run_share(Chip8_Pool *pool, size_t index)
+{
+    for (size_t k = 0; k < pool->thread_count; k++) {
+        Chip8_Pool_Slice *slice = &pool->slices[(index + k) % pool->thread_count];
+        while (true) {
+            size_t first = atomic_fetch_add_explicit(&slice->next, POOL_CHUNK, memory_order_relaxed);
+            if (first >= slice->end) break;
+            size_t last = first + POOL_CHUNK < slice->end ? first + POOL_CHUNK : slice->end;
+            for (size_t i = first; i < last; i++) {
+                chip8_pool_step_one(pool, i, &pool->cpus[index*POOL_WORKERS + pool->homes[i]]);
+            }
+        }
+    }
+}
+
+static void *chip8_pool_worker(void *arg)
+{
+    Chip8_Pool_Worker *worker = arg;
+    Chip8_Pool *pool = worker->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        chip8_pool_run_share(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy -= 1;
+        if (pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Distinct CXNN sequences per instance
+static void chip8_pool_store_new(Chip8_Pool *pool, size_t i, Chip8_Arena_Worker *worker)
+{
+    // ROMs get homes of their own in turn, past POOL_WORKERS ROMs they start sharing them
+    uint32_t page = worker->pages[0x200/CHIP8_PAGE_SIZE];
+    uint32_t home = 0;
+    while (home < POOL_WORKERS && pool->home_pages[home] != page) home++;
+    if (home == POOL_WORKERS) {
+        home = pool->next_home++ % POOL_WORKERS;
+        pool->home_pages[home] = page;
+    }
+    pool->homes[i] = (uint8_t)home;
+    chip8_seed(&worker->cpu, (uint32_t)(i + 1) * 0x9e3779b9u);
+    if (!chip8_arena_store(&pool->arena, (uint32_t)i, worker)) {
+        fprintf(stderr, "Out of memory for the pages of pool instance %zu\n", i);
+        exit(1);
+    }
+}
+
+// Resets the worker to a fresh instance of the ROM and shares its pages
+static void chip8_pool_reset(Chip8_Pool *pool, Chip8_Arena_Worker *worker, const char *rom_bytes, size_t rom_size)
+{
+    Chip8 *cpu = &worker->cpu;
+    memset(cpu, 0, sizeof(*cpu));
+    chip8_load_sprites(cpu);
+    if (!chip8_load_rom(cpu, (char*)rom_bytes, rom_size)) {
+        fprintf(stderr, "Pool ROM is larger than the %d bytes that fit in memory\n", MAX_ROM_SIZE);
+        exit(1);
+    }
+    if (!chip8_arena_share(&pool->arena, worker)) {
+        fprintf(stderr, "Out of memory for the pages of a pool ROM\n");
+        exit(1);
+    }
+}
+
+// Replaces the program of instance `i` and resets it
+void chip8_pool_load_rom(Chip8_Pool *pool, size_t i, const char *rom_bytes, size_t rom_size)
+{
+    chip8_pool_reset(pool, &pool->cpus[0], rom_bytes, rom_size);
+    chip8_pool_store_new(pool, i, &pool->cpus[0]);
+}
+
+// Creates `count` instances running the same ROM. `threads` of 0 means one per online core.
+// Returns false if the instances could not be allocated, threads that fail to start are skipped.
+bool chip8_pool_init(Chip8_Pool *pool, size_t count, size_t threads, const char *rom_bytes, size_t rom_size)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (size_t)cores : 1;
+    }
+    if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+    if (threads > count && count > 0) threads = count;
+
+    if (count >= ARENA_NONE || !chip8_arena_init(&pool->arena, count > 0 ? (uint32_t)count : 1, 0)) return false;
+    pool->cpus = aligned_alloc(_Alignof(Chip8_Arena_Worker), threads*POOL_WORKERS*sizeof(Chip8_Arena_Worker));
+    pool->homes = malloc(count > 0 ? count : 1);
+    pool->slices = aligned_alloc(_Alignof(Chip8_Pool_Slice), threads*sizeof(Chip8_Pool_Slice));
+    if (!pool->cpus || !pool->homes || !pool->slices) {
+        chip8_arena_free_all(&pool->arena);
+        free(pool->cpus);
+        free(pool->homes);
+        free(pool->slices);
+        return false;
+    }
+    for (size_t w = 0; w < threads*POOL_WORKERS; w++) {
+        chip8_arena_worker_init(&pool->cpus[w]);
+    }
+    memset(pool->home_pages, 0xff, sizeof(pool->home_pages));
+    pool->count = count;
+    if (count > 0) chip8_pool_reset(pool, &pool->cpus[0], rom_bytes, rom_size);
+    for (size_t i = 0; i < count; i++) {
+        chip8_arena_new(&pool->arena);
+        chip8_pool_store_new(pool, i, &pool->cpus[0]);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->thread_count = 1;
+    for (size_t t = 1; t < threads; t++) {
+        pool->workers[t] = (Chip8_Pool_Worker){.pool = pool, .index = t};
+        if (pthread_create(&pool->threads[t], NULL, chip8_pool_worker, &pool->workers[t]) != 0) break;
+        pool->thread_count += 1;
+    }
+    return true;
+}
+
+void chip8_pool_free(Chip8_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t t = 1; t < pool->thread_count; t++) {
+        pthread_join(pool->threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    chip8_arena_free_all(&pool->arena);
+    free(pool->cpus);
+    free(pool->homes);
+    free(pool->slices);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Holds `actions[i]` (bit k = key k, NULL for no keys) on instance i for `frames` frames and
+// stores the summed reward in `rewards[i]` (may be NULL). Blocks until every instance is done,
+// after which chip8_pool_display(pool, i) is instance i's framebuffer.
+void chip8_pool_step(Chip8_Pool *pool, const uint16_t *actions, uint32_t frames, float *rewards)
+{
+    pool->actions = actions;
+    pool->frames = frames;
+    pool->rewards = rewards;
+
+    size_t per_thread = (pool->count + pool->thread_count - 1) / pool->thread_count;
+    for (size_t t = 0; t < pool->thread_count; t++) {
+        size_t first = t*per_thread < pool->count ? t*per_thread : pool->count;
+        size_t end = first + per_thread < pool->count ? first + per_thread : pool->count;
+        atomic_store_explicit(&pool->slices[t].next, first, memory_order_relaxed);
+        pool->slices[t].end = end;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation += 1;
+    pool->busy = pool->thread_count - 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    chip8_pool_run_share(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline const uint64_t *chip8_pool_display(const Chip8_Pool *pool, size_t i)
+{
+    return pool->arena.slots[i].display;
+}
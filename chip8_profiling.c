@@ -0,0 +1,158 @@
+// Writes out the counters of a CHIP8_PROFILING build, include after chip8.c.
+//
+// Build with -DCHIP8_PROFILING and point Chip8.profiling at a zeroed Chip8_Profiling, then
+// chip8_profile_dump writes:
+//   - JSON: instructions per opcode class, per-address hotspots with their disassembly, DXYN
+//     statistics and the cycles spent idling;
+//   - folded stacks, one "frame;frame;... count" line per address, for flamegraph.pl, speedscope
+//     or inferno. The frames are the subroutine the address ran in and the instruction itself.
+// Without CHIP8_PROFILING none of the counters exist and this file compiles to nothing.
+#ifdef CHIP8_PROFILING
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *const chip8_op_names[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_UNDECODED] = "UNDECODED",
+    [CHIP8_OP_CLS]       = "CLS",
+    [CHIP8_OP_RET]       = "RET",
+    [CHIP8_OP_SYS]       = "SYS",
+    [CHIP8_OP_JP]        = "JP",
+    [CHIP8_OP_CALL]      = "CALL",
+    [CHIP8_OP_SE_IMM]    = "SE_IMM",
+    [CHIP8_OP_SNE_IMM]   = "SNE_IMM",
+    [CHIP8_OP_SE_REG]    = "SE_REG",
+    [CHIP8_OP_LD_IMM]    = "LD_IMM",
+    [CHIP8_OP_ADD_IMM]   = "ADD_IMM",
+    [CHIP8_OP_LD_REG]    = "LD_REG",
+    [CHIP8_OP_OR]        = "OR",
+    [CHIP8_OP_AND]       = "AND",
+    [CHIP8_OP_XOR]       = "XOR",
+    [CHIP8_OP_ADD_REG]   = "ADD_REG",
+    [CHIP8_OP_SUB]       = "SUB",
+    [CHIP8_OP_SHR]       = "SHR",
+    [CHIP8_OP_SUBN]      = "SUBN",
+    [CHIP8_OP_SHL]       = "SHL",
+    [CHIP8_OP_SNE_REG]   = "SNE_REG",
+    [CHIP8_OP_LD_I]      = "LD_I",
+    [CHIP8_OP_JP_V0]     = "JP_V0",
+    [CHIP8_OP_RND]       = "RND",
+    [CHIP8_OP_DRW]       = "DRW",
+    [CHIP8_OP_SKP]       = "SKP",
+    [CHIP8_OP_SKNP]      = "SKNP",
+    [CHIP8_OP_LD_VX_DT]  = "LD_VX_DT",
+    [CHIP8_OP_LD_VX_K]   = "LD_VX_K",
+    [CHIP8_OP_LD_DT_VX]  = "LD_DT_VX",
+    [CHIP8_OP_LD_ST_VX]  = "LD_ST_VX",
+    [CHIP8_OP_ADD_I_VX]  = "ADD_I_VX",
+    [CHIP8_OP_LD_F_VX]   = "LD_F_VX",
+    [CHIP8_OP_LD_B_VX]   = "LD_B_VX",
+    [CHIP8_OP_LD_MEM_VX] = "LD_MEM_VX",
+    [CHIP8_OP_LD_VX_MEM] = "LD_VX_MEM",
+    [CHIP8_OP_INVALID]   = "INVALID",
+    [CHIP8_OP_LD_I_DRW]  = "LD_I_DRW",
+    [CHIP8_OP_ADD_SE_JP] = "ADD_SE_JP",
+    [CHIP8_OP_DT_SE_JP]  = "DT_SE_JP",
+    [CHIP8_OP_LD_IMM2]   = "LD_IMM2",
+    [CHIP8_OP_SKIP_JP]   = "SKIP_JP",
+};
+
+static const Chip8_Profiling *chip8_profile_sorting;
+
+static int chip8_profile_by_count(const void *a, const void *b)
+{
+    uint64_t ca = chip8_profile_sorting->pcs[*(const uint16_t*)a];
+    uint64_t cb = chip8_profile_sorting->pcs[*(const uint16_t*)b];
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+// Disassembly of the instruction at `pc` as it is in memory now, without the explanations in
+// parentheses, which would only get in the way of a flamegraph
+static const char *chip8_profile_inst(Chip8 *cpu, uint16_t pc)
+{
+    static char buf[128];
+    const char *text = chip8_decode(cpu, chip8_fetch(cpu, pc));
+    size_t i = 0;
+    while (text[i] != 0 && text[i] != '(' && i + 1 < sizeof(buf)) {
+        buf[i] = text[i];
+        i += 1;
+    }
+    while (i > 0 && buf[i - 1] == ' ') i -= 1;
+    buf[i] = 0;
+    return buf;
+}
+
+static bool chip8_profile_write_json(const Chip8_Profiling *prof, Chip8 *cpu, FILE *f)
+{
+    uint32_t rate = chip8_clock_rate(cpu);
+    fprintf(f, "{\n");
+    fprintf(f, "  \"cycles\": %llu,\n", (unsigned long long)cpu->cycles);
+    fprintf(f, "  \"clock_rate\": %u,\n", rate);
+
+    fprintf(f, "  \"ops\": {");
+    const char *sep = "\n";
+    for (int op = 0; op < CHIP8_OP_COUNT; op++) {
+        if (prof->ops[op] == 0) continue;
+        fprintf(f, "%s    \"%s\": %llu", sep, chip8_op_names[op], (unsigned long long)prof->ops[op]);
+        sep = ",\n";
+    }
+    fprintf(f, "\n  },\n");
+
+    static uint16_t order[0x1000];
+    size_t count = 0;
+    for (uint16_t pc = 0; pc < 0x1000; pc++) {
+        if (prof->pcs[pc] != 0) order[count++] = pc;
+    }
+    chip8_profile_sorting = prof;
+    qsort(order, count, sizeof(order[0]), chip8_profile_by_count);
+    fprintf(f, "  \"hotspots\": [");
+    for (size_t i = 0; i < count; i++) {
+        uint16_t pc = order[i];
+        fprintf(f, "%s\n    {\"pc\": \"0x%03x\", \"count\": %llu, \"routine\": \"0x%03x\", \"inst\": \"%s\"}",
+                i > 0 ? "," : "", pc, (unsigned long long)prof->pcs[pc], prof->routines[pc], chip8_profile_inst(cpu, pc));
+    }
+    fprintf(f, "\n  ],\n");
+
+    fprintf(f, "  \"draw\": {\"calls\": %llu, \"pixels\": %llu, \"collisions\": %llu},\n",
+            (unsigned long long)prof->draws, (unsigned long long)prof->pixels, (unsigned long long)prof->collisions);
+    fprintf(f, "  \"idle\": {\"cycles\": %llu, \"wait_key_cycles\": %llu, \"seconds\": %.3f}\n",
+            (unsigned long long)prof->idle_cycles, (unsigned long long)prof->wait_key_cycles, (double)prof->idle_cycles/rate);
+    fprintf(f, "}\n");
+    return !ferror(f);
+}
+
+static bool chip8_profile_write_folded(const Chip8_Profiling *prof, Chip8 *cpu, FILE *f)
+{
+    for (uint16_t pc = 0; pc < 0x1000; pc++) {
+        if (prof->pcs[pc] == 0) continue;
+        if (prof->routines[pc] == 0) {
+            fprintf(f, "main;");
+        } else {
+            fprintf(f, "sub_0x%03x;", prof->routines[pc]);
+        }
+        fprintf(f, "0x%03x %s %llu\n", pc, chip8_profile_inst(cpu, pc), (unsigned long long)prof->pcs[pc]);
+    }
+    // Fast-forwarded cycles never went through the interpreter, so they get a frame of their own
+    if (prof->idle_cycles != 0) {
+        fprintf(f, "idle %llu\n", (unsigned long long)prof->idle_cycles);
+    }
+    return !ferror(f);
+}
+
+// Writes the counters of `prof`, collected on `cpu`, to `json_path` and `folded_path` (either
+// may be NULL). Instructions are disassembled from cpu->memory as it is now. Returns false if a
+// file could not be written, errno tells why.
+bool chip8_profile_dump(const Chip8_Profiling *prof, Chip8 *cpu, const char *json_path, const char *folded_path)
+{
+    const char *paths[2] = {json_path, folded_path};
+    for (int i = 0; i < 2; i++) {
+        if (!paths[i]) continue;
+        FILE *f = fopen(paths[i], "w");
+        if (!f) return false;
+        bool ok = i == 0 ? chip8_profile_write_json(prof, cpu, f) : chip8_profile_write_folded(prof, cpu, f);
+        if (fclose(f) != 0 || !ok) return false;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,322 @@
+// Rewind: a bounded history of states to step backwards through, include after chip8.c.
+//
+// chip8_rewind_push flattens the instance into REWIND_STATE_SIZE bytes and stores it XORed against
+// the latest keyframe, so everything that didn't change since then is a run of zeros. Runs of
+// zeros are skipped and the rest is stored as literals, which makes a typical frame a few dozen
+// bytes. Every REWIND_KEYFRAME_INTERVAL states a keyframe is stored instead (encoded the same way
+// against all zeros).
+//
+// Encoded states are appended to an arena of fixed size that wraps around, and the oldest states
+// are dropped to make room. A delta is useless without its keyframe, so the oldest state kept is
+// always a keyframe. chip8_rewind_back drops the newest state and puts the instance back into the
+// one before it.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REWIND_DEFAULT_BUDGET (16 << 20) // Bytes of encoded states
+#define REWIND_KEYFRAME_INTERVAL 64      // States between keyframes
+#define REWIND_MIN_ENTRY 16              // Smallest encoded state the index is sized for
+
+// V, I, PC, timers, keyboard, key_presses, key_wait, display, frame_generation, stack, clock, cycles, rng, memory
+#define REWIND_STATE_SIZE (16 + 2 + 2 + 1 + 1 + 2 + 2 + 1 + 32*8 + 4 + 1 + MAX_SUBROUTINES*2 + 4*2 + 8 + 8 + 4 + 0x1000)
+#define REWIND_MAX_ENCODED (REWIND_STATE_SIZE + REWIND_STATE_SIZE/4*2 + 16) // Alternating 1-byte runs
+
+typedef struct Chip8_Rewind_Entry {
+    size_t offset;
+    size_t size;
+    uint64_t keyframe; // Sequence number of the keyframe it is a delta of, its own if it is one
+} Chip8_Rewind_Entry;
+
+typedef struct Chip8_Rewind {
+    uint8_t *arena;
+    size_t arena_size;
+    size_t head; // Where the next state goes
+
+    // States first..first+count-1 by sequence number, state s is entries[s % capacity]
+    Chip8_Rewind_Entry *entries;
+    size_t capacity;
+    uint64_t first;
+    size_t count;
+
+    uint8_t keyframe[REWIND_STATE_SIZE]; // Flattened keyframe new deltas are made against
+    uint64_t keyframe_seq;               // Its sequence number, dropped once it's no longer kept
+    uint8_t scratch[REWIND_STATE_SIZE];
+    uint8_t encoded[REWIND_MAX_ENCODED];
+
+    // Instrumentation
+    uint64_t pushed;
+    uint64_t pushed_bytes;
+    uint64_t keyframes;
+} Chip8_Rewind;
+
+// Keeps up to `budget` bytes of encoded states. Returns false if they can't be allocated.
+bool chip8_rewind_init(Chip8_Rewind *rw, size_t budget)
+{
+    memset(rw, 0, sizeof(*rw));
+    if (budget < REWIND_MAX_ENCODED) budget = REWIND_MAX_ENCODED;
+    rw->arena = malloc(budget);
+    rw->capacity = budget / REWIND_MIN_ENTRY;
+    rw->entries = malloc(rw->capacity*sizeof(rw->entries[0]));
+    if (!rw->arena || !rw->entries) {
+        free(rw->arena);
+        free(rw->entries);
+        return false;
+    }
+    rw->arena_size = budget;
+    rw->keyframe_seq = UINT64_MAX;
+    return true;
+}
+
+void chip8_rewind_free(Chip8_Rewind *rw)
+{
+    free(rw->arena);
+    free(rw->entries);
+    memset(rw, 0, sizeof(*rw));
+}
+
+static uint8_t *chip8_rewind_put(uint8_t *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        *out++ = (uint8_t)(value >> (8*i));
+    }
+    return out;
+}
+
+static uint64_t chip8_rewind_get(const uint8_t **in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)(*in)[i] << (8*i);
+    }
+    *in += bytes;
+    return value;
+}
+
+static void chip8_rewind_flatten(const Chip8 *cpu, uint8_t *out)
+{
+    memcpy(out, cpu->V, 16);
+    out += 16;
+    out = chip8_rewind_put(out, cpu->I, 2);
+    out = chip8_rewind_put(out, cpu->PC, 2);
+    out = chip8_rewind_put(out, cpu->delay_timer, 1);
+    out = chip8_rewind_put(out, cpu->sound_timer, 1);
+    out = chip8_rewind_put(out, cpu->keyboard, 2);
+    out = chip8_rewind_put(out, cpu->key_presses, 2);
+    out = chip8_rewind_put(out, cpu->key_wait, 1);
+    for (int row = 0; row < 32; row++) {
+        out = chip8_rewind_put(out, cpu->display[row], 8);
+    }
+    out = chip8_rewind_put(out, cpu->frame_generation, 4);
+    out = chip8_rewind_put(out, cpu->stack_pointer, 1);
+    for (int i = 0; i < MAX_SUBROUTINES; i++) {
+        out = chip8_rewind_put(out, cpu->call_stack[i], 2);
+    }
+    out = chip8_rewind_put(out, cpu->clock_rate, 4);
+    out = chip8_rewind_put(out, cpu->timer_phase, 4);
+    out = chip8_rewind_put(out, cpu->cycle_credit, 8);
+    out = chip8_rewind_put(out, cpu->cycles, 8);
+    out = chip8_rewind_put(out, cpu->rng_state, 4);
+    memcpy(out, cpu->memory, 0x1000);
+}
+
+// Inverse of chip8_rewind_flatten. Only memory pages that differ are copied, so the decoded
+// instruction cache of the others survives.
+static void chip8_rewind_unflatten(Chip8 *cpu, const uint8_t *in)
+{
+    memcpy(cpu->V, in, 16);
+    in += 16;
+    cpu->I = chip8_rewind_get(&in, 2);
+    cpu->PC = chip8_rewind_get(&in, 2);
+    cpu->delay_timer = chip8_rewind_get(&in, 1);
+    cpu->sound_timer = chip8_rewind_get(&in, 1);
+    cpu->keyboard = chip8_rewind_get(&in, 2);
+    cpu->key_presses = chip8_rewind_get(&in, 2);
+    cpu->key_wait = chip8_rewind_get(&in, 1) != 0;
+    for (int row = 0; row < 32; row++) {
+        uint64_t pixels = chip8_rewind_get(&in, 8);
+        if (cpu->display[row] != pixels) cpu->dirty_rows |= 1u << row;
+        cpu->display[row] = pixels;
+    }
+    cpu->frame_generation = chip8_rewind_get(&in, 4);
+    cpu->stack_pointer = chip8_rewind_get(&in, 1);
+    for (int i = 0; i < MAX_SUBROUTINES; i++) {
+        cpu->call_stack[i] = chip8_rewind_get(&in, 2);
+    }
+    cpu->clock_rate = chip8_rewind_get(&in, 4);
+    cpu->timer_phase = chip8_rewind_get(&in, 4);
+    cpu->cycle_credit = chip8_rewind_get(&in, 8);
+    cpu->cycles = chip8_rewind_get(&in, 8);
+    cpu->rng_state = chip8_rewind_get(&in, 4);
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        const uint8_t *page = in + p*CHIP8_PAGE_SIZE;
+        if (memcmp(&cpu->memory[p*CHIP8_PAGE_SIZE], page, CHIP8_PAGE_SIZE) == 0) continue;
+        memcpy(&cpu->memory[p*CHIP8_PAGE_SIZE], page, CHIP8_PAGE_SIZE);
+        chip8_invalidate(cpu, p*CHIP8_PAGE_SIZE, CHIP8_PAGE_SIZE);
+    }
+}
+
+static uint8_t *chip8_rewind_put_varint(uint8_t *out, size_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        *out++ = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+    return out;
+}
+
+static size_t chip8_rewind_get_varint(const uint8_t **in)
+{
+    size_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*in)++;
+        value |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static const uint8_t chip8_rewind_zeros[REWIND_STATE_SIZE];
+
+// Encodes `state` XOR `base` as pairs of varints, bytes equal to `base` then bytes that differ,
+// each pair followed by the differing bytes XORed with `base`
+static size_t chip8_rewind_encode(const uint8_t *state, const uint8_t *base, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+    while (i < REWIND_STATE_SIZE) {
+        // Most of the state is unchanged, skip it a word at a time
+        size_t same = i;
+        while (same + 8 <= REWIND_STATE_SIZE) {
+            uint64_t a, b;
+            memcpy(&a, state + same, 8);
+            memcpy(&b, base + same, 8);
+            if (a != b) break;
+            same += 8;
+        }
+        while (same < REWIND_STATE_SIZE && state[same] == base[same]) same++;
+        if (same == REWIND_STATE_SIZE) break;
+
+        // A literal ends at the next run of 4 equal bytes, shorter runs cost more to skip than to store
+        size_t end = same;
+        size_t equal = 0;
+        while (end < REWIND_STATE_SIZE && equal < 4) {
+            equal = state[end] == base[end] ? equal + 1 : 0;
+            end++;
+        }
+        if (equal == 4) end -= 4;
+
+        p = chip8_rewind_put_varint(p, same - i);
+        p = chip8_rewind_put_varint(p, end - same);
+        for (size_t k = same; k < end; k++) {
+            *p++ = state[k] ^ base[k];
+        }
+        i = end;
+    }
+    return p - out;
+}
+
+// `state` must already hold the base the delta was made against
+static void chip8_rewind_decode(const uint8_t *in, size_t size, uint8_t *state)
+{
+    const uint8_t *end = in + size;
+    size_t i = 0;
+    while (in < end) {
+        i += chip8_rewind_get_varint(&in);
+        size_t len = chip8_rewind_get_varint(&in);
+        for (size_t k = 0; k < len; k++) {
+            state[i++] ^= *in++;
+        }
+    }
+}
+
+static Chip8_Rewind_Entry *chip8_rewind_entry(Chip8_Rewind *rw, uint64_t seq)
+{
+    return &rw->entries[seq % rw->capacity];
+}
+
+// Drops the oldest state, and every delta left without its keyframe after it
+static void chip8_rewind_drop_oldest(Chip8_Rewind *rw)
+{
+    do {
+        rw->first += 1;
+        rw->count -= 1;
+    } while (rw->count > 0 && chip8_rewind_entry(rw, rw->first)->keyframe != rw->first);
+}
+
+// Frees `size` bytes at rw->head, wrapping around and dropping the oldest states as needed
+static void chip8_rewind_reserve(Chip8_Rewind *rw, size_t size)
+{
+    if (rw->head + size > rw->arena_size) rw->head = 0;
+    while (rw->count > 0) {
+        Chip8_Rewind_Entry *oldest = chip8_rewind_entry(rw, rw->first);
+        bool overlaps = oldest->offset < rw->head + size && rw->head < oldest->offset + oldest->size;
+        if (!overlaps && rw->count < rw->capacity) break;
+        chip8_rewind_drop_oldest(rw);
+    }
+}
+
+// Stores the current state of `cpu` as the newest one
+void chip8_rewind_push(Chip8_Rewind *rw, const Chip8 *cpu)
+{
+    uint64_t seq = rw->first + rw->count;
+    chip8_rewind_flatten(cpu, rw->scratch);
+
+    bool keyframe = rw->keyframe_seq < rw->first || rw->keyframe_seq >= seq ||
+                    seq - rw->keyframe_seq >= REWIND_KEYFRAME_INTERVAL;
+    size_t size = chip8_rewind_encode(rw->scratch, keyframe ? chip8_rewind_zeros : rw->keyframe, rw->encoded);
+    chip8_rewind_reserve(rw, size);
+    if (!keyframe && rw->keyframe_seq < rw->first) {
+        // Making room dropped the keyframe this delta refers to
+        keyframe = true;
+        size = chip8_rewind_encode(rw->scratch, chip8_rewind_zeros, rw->encoded);
+        chip8_rewind_reserve(rw, size);
+    }
+    if (keyframe) {
+        memcpy(rw->keyframe, rw->scratch, REWIND_STATE_SIZE);
+        rw->keyframe_seq = seq;
+        rw->keyframes += 1;
+    }
+
+    *chip8_rewind_entry(rw, seq) = (Chip8_Rewind_Entry){
+        .offset = rw->head,
+        .size = size,
+        .keyframe = rw->keyframe_seq,
+    };
+    memcpy(rw->arena + rw->head, rw->encoded, size);
+    rw->head += size;
+    rw->count += 1;
+
+    rw->pushed += 1;
+    rw->pushed_bytes += size;
+}
+
+// Drops the newest state and puts `cpu` into the one before it. Returns false, leaving `cpu`
+// alone, when there is no state before it.
+bool chip8_rewind_back(Chip8_Rewind *rw, Chip8 *cpu)
+{
+    if (rw->count < 2) return false;
+    Chip8_Rewind_Entry *newest = chip8_rewind_entry(rw, rw->first + rw->count - 1);
+    rw->head = newest->offset;
+    rw->count -= 1;
+
+    Chip8_Rewind_Entry *entry = chip8_rewind_entry(rw, rw->first + rw->count - 1);
+    if (entry->keyframe != rw->keyframe_seq) {
+        // Stepped back past the keyframe new deltas were made against, switch to this one's
+        Chip8_Rewind_Entry *keyframe = chip8_rewind_entry(rw, entry->keyframe);
+        memset(rw->keyframe, 0, REWIND_STATE_SIZE);
+        chip8_rewind_decode(rw->arena + keyframe->offset, keyframe->size, rw->keyframe);
+        rw->keyframe_seq = entry->keyframe;
+    }
+    memcpy(rw->scratch, rw->keyframe, REWIND_STATE_SIZE);
+    if (entry->keyframe != rw->first + rw->count - 1) {
+        chip8_rewind_decode(rw->arena + entry->offset, entry->size, rw->scratch);
+    }
+    chip8_rewind_unflatten(cpu, rw->scratch);
+    return true;
+}
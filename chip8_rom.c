@@ -0,0 +1,414 @@
+// ROM files for the hosted frontends, include after chip8.c.
+//
+// chip8_rom_load reads a ROM, hashes it and looks the hash up in a content-addressed cache of
+// what there is to know about it before it runs: its quirk profile, the addresses its control
+// flow reaches from 0x200 and the decode cache entries of those addresses, superinstructions
+// included. A hit installs them as they are, so a warm start neither analyzes nor decodes. A miss
+// analyzes the ROM and writes the entry for the next start.
+//
+// Entries are <hash>.c8cache files in $CHIP8_CACHE_DIR, else $XDG_CACHE_HOME/chip8, else
+// ~/.cache/chip8. An empty CHIP8_CACHE_DIR turns the cache off. Layout, host byte order:
+//   0   4  "C8RC"
+//   4   2  ROM_CACHE_VERSION
+//   6   1  CHIP8_OP_COUNT, Chip8_Op values are only meaningful to the build that wrote them
+//   7   1  ROM_CACHE_FUSED if the entries may hold superinstructions
+//   8   8  chip8_rom_hash of the ROM
+//   16  4  ROM size
+//   20  1  Chip8_Profile
+//   21  1  sizeof(Chip8_Decoded)
+//   22  2  zero
+//   24  8  chip8_rom_fingerprint of the build that wrote it
+//   32  .. Chip8_Rom_Analysis.reachable, the Chip8_Rom_Analysis.decoded entries from 0x200 to the
+//          end of the ROM, then the ROM itself, which a hit must match byte for byte
+//
+// Decoded entries are installed as they are and index the handler table and V, so every one is
+// checked by chip8_rom_entry_valid before a hit is accepted.
+//
+// ROMs and entries are a few KB, read with a single read(2) each into buffers of their largest
+// size: mapping files that small costs more in mmap and munmap than copying them.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ROM_CACHE_VERSION 1
+#define ROM_CACHE_HEADER_SIZE 32
+#define ROM_CACHE_MAX_SIZE (ROM_CACHE_HEADER_SIZE + 0x1000/8 + (MAX_ROM_SIZE + 1)/2*sizeof(Chip8_Decoded) + MAX_ROM_SIZE)
+#ifdef CHIP8_NO_FUSION
+#define ROM_CACHE_FUSED 0
+#else
+#define ROM_CACHE_FUSED 1
+#endif
+
+char *read_entire_file(const char *path, size_t *out_size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open file %s\n", path);
+        exit(1);
+    }
+    if (fseek(f, 0, SEEK_END) == -1) {
+        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
+        exit(1);
+    }
+    long size = ftell(f);
+    if (size == -1) {
+        fprintf(stderr, "Failed to get file size of %s because of %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (fseek(f, 0, SEEK_SET) == -1) {
+        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    char *raw = malloc(size);
+    if (!raw) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    size_t nread = fread(raw, 1, size, f);
+    if (nread != (size_t)size) {
+        fprintf(stderr, "Failed to read file\n");
+        exit(1);
+    }
+    fclose(f);
+
+    if (out_size) {
+        *out_size = nread;
+    }
+
+    return raw;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Collects every regular file in `dir_path`, sorted by name so runs are comparable
+size_t list_roms(const char *dir_path, char **paths, size_t capacity)
+{
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s because of %s\n", dir_path, strerror(errno));
+        exit(1);
+    }
+
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < capacity) {
+        if (entry->d_name[0] == '.') continue;
+        size_t len = strlen(dir_path) + 1 + strlen(entry->d_name) + 1;
+        char *path = malloc(len);
+        if (!path) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        snprintf(path, len, "%s/%s", dir_path, entry->d_name);
+        paths[count++] = path;
+    }
+    closedir(dir);
+
+    qsort(paths, count, sizeof(paths[0]), compare_strings);
+    return count;
+}
+
+// What a start needs to know about a ROM, and all a cache entry holds besides the ROM
+typedef struct Chip8_Rom_Analysis {
+    uint8_t profile;                      // Chip8_Profile, chip8_rom_profile
+    uint8_t reachable[0x1000/8];          // Bit pc: control flow from 0x200 reaches an instruction at pc
+    Chip8_Decoded decoded[0x1000/2];      // Chip8.decoded entries of the reachable instructions, the rest undecoded
+} Chip8_Rom_Analysis;
+
+typedef struct Chip8_Rom {
+    char bytes[MAX_ROM_SIZE + 1]; // One more, to tell a file that doesn't fit
+    size_t size;
+    uint64_t hash;     // chip8_rom_hash
+    bool cached;       // The analysis came from the cache
+    Chip8_Rom_Analysis analysis;
+} Chip8_Rom;
+
+// Follows every path from 0x200 that stays inside the ROM, both ways at skips, into and past
+// subroutines. BNNN and 00EE end a path since their targets aren't known statically.
+static void chip8_rom_walk(const uint8_t *memory, size_t rom_size, uint8_t *reachable)
+{
+    uint16_t end = (uint16_t)(0x200 + rom_size);
+    static uint16_t pending[2*MAX_ROM_SIZE + 1]; // Every instruction queues at most two more
+    size_t count = 0;
+    pending[count++] = 0x200;
+    while (count > 0) {
+        uint16_t pc = pending[--count];
+        if (pc < 0x200 || pc + 2 > end || (reachable[pc >> 3] & (1 << (pc & 7)))) continue;
+        reachable[pc >> 3] |= 1 << (pc & 7);
+
+        Chip8_Decoded d = chip8_decode_inst((memory[pc] << 8) | memory[pc + 1]);
+        switch (d.op) {
+        case CHIP8_OP_JP:
+            pending[count++] = d.nnn;
+            break;
+        case CHIP8_OP_CALL:
+            pending[count++] = d.nnn;
+            pending[count++] = pc + 2;
+            break;
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+            pending[count++] = pc + 2;
+            pending[count++] = pc + 4;
+            break;
+        case CHIP8_OP_RET:
+        case CHIP8_OP_JP_V0:
+            break;
+        default:
+            pending[count++] = pc + 2;
+            break;
+        }
+    }
+}
+
+// Everything chip8_rom_load would otherwise find out at each start. Returns false if
+// chip8_load_rom_as won't take the ROM.
+bool chip8_rom_analyze(const char *rom_bytes, size_t rom_size, Chip8_Rom_Analysis *analysis)
+{
+    static Chip8 scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    memset(analysis, 0, sizeof(*analysis));
+    analysis->profile = chip8_rom_profile(rom_bytes, rom_size);
+    if (!chip8_load_rom_as(&scratch, rom_bytes, rom_size, analysis->profile)) return false;
+    chip8_rom_walk(scratch.memory, rom_size, analysis->reachable);
+
+    // Past the ROM memory holds whatever the instance had before, so an instruction is only
+    // fused with ones that are part of the ROM too
+    uint16_t end = (uint16_t)(0x200 + rom_size);
+    for (uint16_t pc = 0x200; pc < end; pc++) {
+        if (!(analysis->reachable[pc >> 3] & (1 << (pc & 7))) || analysis->decoded[pc >> 1].op != CHIP8_OP_UNDECODED) continue;
+        Chip8_Decoded d = pc + CHIP8_FUSED_MAX*2 <= end ? chip8_decode_at(&scratch, pc) : chip8_decode_inst(chip8_fetch(&scratch, pc));
+        d.odd = pc & 1;
+        analysis->decoded[pc >> 1] = d;
+    }
+    return true;
+}
+
+// Directory of the cache entries, NULL if the cache is off
+static const char *chip8_rom_cache_dir(void)
+{
+    static char path[4096];
+    const char *dir = getenv("CHIP8_CACHE_DIR");
+    if (dir) return dir[0] != 0 ? dir : NULL;
+
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && xdg[0] != 0) {
+        snprintf(path, sizeof(path), "%s/chip8", xdg);
+    } else if (home && home[0] != 0) {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/.cache/chip8", home);
+    } else {
+        return NULL;
+    }
+    mkdir(path, 0755);
+    return path;
+}
+
+static void chip8_rom_cache_path(char *path, size_t size, const char *dir, uint64_t hash)
+{
+    snprintf(path, size, "%s/%016llx.c8cache", dir, (unsigned long long)hash);
+}
+
+// Decode cache entries from 0x200 to the end of a ROM
+static size_t chip8_rom_entries(size_t rom_size)
+{
+    return (rom_size + 1)/2;
+}
+
+static size_t chip8_rom_cache_size(size_t rom_size)
+{
+    return ROM_CACHE_HEADER_SIZE + 0x1000/8 + chip8_rom_entries(rom_size)*sizeof(Chip8_Decoded) + rom_size;
+}
+
+// An instruction of every kind and every sequence chip8_fuse turns into a superinstruction
+static const uint8_t chip8_rom_probe[] = {
+    0xa2, 0x34, 0xd1, 0x25,             // LD I; DRW
+    0x71, 0x01, 0x31, 0x10, 0x12, 0x0a, // ADD; SE; JP
+    0xf2, 0x07, 0x32, 0x00, 0x12, 0x10, // LD Vx, DT; SE; JP
+    0x63, 0x45, 0x64, 0x56,             // LD; LD
+    0x00, 0xe0, 0x22, 0x18, 0x55, 0x60, 0x85, 0x60, 0x85, 0x61, 0x85, 0x62, 0x85, 0x63, 0x85, 0x64,
+    0x85, 0x65, 0x85, 0x66, 0x85, 0x67, 0x85, 0x6e, 0x95, 0x60, 0xa1, 0x23, 0xc5, 0x3f, 0xe5, 0x9e,
+    0xe5, 0xa1, 0xf5, 0x0a, 0xf5, 0x15, 0xf5, 0x18, 0xf5, 0x1e, 0xf5, 0x29, 0xf5, 0x33, 0xf5, 0x55,
+    0xf5, 0x65, 0xff, 0xff, 0x45, 0x67, 0xb2, 0x30, 0x00, 0xee,
+};
+
+// Identifies how this build lays out decode cache entries: a hash of what chip8_rom_analyze makes
+// of chip8_rom_probe. Renumbering Chip8_Op, changing Chip8_Decoded or how chip8_fuse packs its
+// operands changes it, so entries written by another build are misses instead of being run.
+static uint64_t chip8_rom_fingerprint(void)
+{
+    static uint64_t fingerprint;
+    if (fingerprint != 0) return fingerprint;
+    static Chip8_Rom_Analysis probe;
+    chip8_rom_analyze((const char*)chip8_rom_probe, sizeof(chip8_rom_probe), &probe);
+    uint64_t hash = chip8_rom_hash((const char*)&probe.decoded[0x200 >> 1], chip8_rom_entries(sizeof(chip8_rom_probe))*sizeof(Chip8_Decoded));
+    fingerprint = hash != 0 ? hash : 1;
+    return fingerprint;
+}
+
+// Whether `d` could have come out of chip8_rom_analyze. Operands a handler indexes with must be in
+// range: a corrupted entry would call outside the handler table or reach past V.
+static bool chip8_rom_entry_valid(const Chip8_Decoded *d)
+{
+    if (d->op >= CHIP8_OP_COUNT || d->odd > 1 || d->x > 0xf || d->nnn > 0xfff) return false;
+    switch (d->op) {
+    case CHIP8_OP_ADD_SE_JP: return true;                                         // y holds the increment
+    case CHIP8_OP_LD_IMM2:   return d->y <= 0xf;                                  // n holds the second immediate
+    case CHIP8_OP_SKIP_JP:   return d->y <= 0xf && d->n < CHIP8_OP_INVALID;       // n holds the skip's Chip8_Op
+    default:                 return d->y <= 0xf && d->n <= 0xf;
+    }
+}
+
+// Reads up to `capacity` bytes of `path`, returns how many or -1 with errno set
+static ssize_t chip8_read_small_file(const char *path, void *buffer, size_t capacity)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    size_t size = 0;
+    while (size < capacity) {
+        ssize_t n = read(fd, (uint8_t*)buffer + size, capacity - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        if (n == 0) break;
+        size += (size_t)n;
+    }
+    close(fd);
+    return (ssize_t)size;
+}
+
+// Fills rom->analysis from the cache entry of `rom` in `dir`, false if there is no valid one
+bool chip8_rom_cache_read(const char *dir, Chip8_Rom *rom)
+{
+    char path[4096];
+    chip8_rom_cache_path(path, sizeof(path), dir, rom->hash);
+    static uint8_t file[ROM_CACHE_MAX_SIZE + 1];
+    if (chip8_read_small_file(path, file, sizeof(file)) != (ssize_t)chip8_rom_cache_size(rom->size)) return false;
+
+    uint16_t version;
+    uint64_t hash, fingerprint;
+    uint32_t rom_size;
+    memcpy(&version, file + 4, 2);
+    memcpy(&hash, file + 8, 8);
+    memcpy(&rom_size, file + 16, 4);
+    memcpy(&fingerprint, file + 24, 8);
+    Chip8_Rom_Analysis *a = &rom->analysis;
+    const uint8_t *reachable = file + ROM_CACHE_HEADER_SIZE;
+    const uint8_t *decoded = reachable + sizeof(a->reachable);
+    const uint8_t *bytes = decoded + chip8_rom_entries(rom->size)*sizeof(Chip8_Decoded);
+    bool valid = memcmp(file, "C8RC", 4) == 0 && version == ROM_CACHE_VERSION && file[6] == CHIP8_OP_COUNT &&
+                 file[7] == ROM_CACHE_FUSED && hash == rom->hash && rom_size == rom->size &&
+                 file[20] < CHIP8_PROFILE_COUNT && file[21] == sizeof(Chip8_Decoded) &&
+                 fingerprint == chip8_rom_fingerprint() && memcmp(bytes, rom->bytes, rom->size) == 0;
+    for (size_t i = 0; valid && i < chip8_rom_entries(rom->size); i++) {
+        Chip8_Decoded d;
+        memcpy(&d, decoded + i*sizeof(d), sizeof(d));
+        valid = chip8_rom_entry_valid(&d);
+    }
+    if (valid) {
+        a->profile = file[20];
+        memcpy(a->reachable, reachable, sizeof(a->reachable));
+        memcpy(&a->decoded[0x200 >> 1], decoded, chip8_rom_entries(rom->size)*sizeof(Chip8_Decoded));
+    }
+    return valid;
+}
+
+// Writes the cache entry of `rom` to `dir`. Several processes may start the same ROM at once,
+// so the entry is written to a file of its own and renamed into place.
+bool chip8_rom_cache_write(const char *dir, const Chip8_Rom *rom)
+{
+    char path[4096], tmp[4096 + 32];
+    chip8_rom_cache_path(path, sizeof(path), dir, rom->hash);
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+
+    uint8_t header[ROM_CACHE_HEADER_SIZE] = {0};
+    uint16_t version = ROM_CACHE_VERSION;
+    uint32_t rom_size = (uint32_t)rom->size;
+    memcpy(header, "C8RC", 4);
+    memcpy(header + 4, &version, 2);
+    header[6] = CHIP8_OP_COUNT;
+    header[7] = ROM_CACHE_FUSED;
+    memcpy(header + 8, &rom->hash, 8);
+    memcpy(header + 16, &rom_size, 4);
+    header[20] = rom->analysis.profile;
+    header[21] = sizeof(Chip8_Decoded);
+    uint64_t fingerprint = chip8_rom_fingerprint();
+    memcpy(header + 24, &fingerprint, 8);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return false;
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(rom->analysis.reachable, 1, sizeof(rom->analysis.reachable), f);
+    fwrite(&rom->analysis.decoded[0x200 >> 1], sizeof(Chip8_Decoded), chip8_rom_entries(rom->size), f);
+    fwrite(rom->bytes, 1, rom->size, f);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+// Reads the ROM at `path` into `rom` and hashes it. Returns false with errno set if it can't be
+// read, a ROM too large for memory reads as MAX_ROM_SIZE + 1 bytes.
+bool chip8_rom_read(const char *path, Chip8_Rom *rom)
+{
+    ssize_t size = chip8_read_small_file(path, rom->bytes, sizeof(rom->bytes));
+    if (size < 0) return false;
+    rom->size = (size_t)size;
+    rom->hash = chip8_rom_hash(rom->bytes, rom->size);
+    return true;
+}
+
+// Copies rom->bytes into `cpu` like chip8_load_rom, along with the profile and the decode cache
+// entries of the analysis
+bool chip8_rom_install(Chip8 *cpu, const Chip8_Rom *rom)
+{
+    if (!chip8_load_rom_as(cpu, rom->bytes, rom->size, rom->analysis.profile)) return false;
+#ifdef CHIP8_PROFILING
+    if (cpu->profiling) return true; // Counted per instruction as in the ROM, see chip8_fuse
+#endif
+    memcpy(&cpu->decoded[0x200 >> 1], &rom->analysis.decoded[0x200 >> 1], chip8_rom_entries(rom->size)*sizeof(Chip8_Decoded));
+    return true;
+}
+
+// Loads the ROM at `path` into `cpu` through the cache, exits with a message if it can't be read
+// or doesn't fit in memory. `rom` is left holding the ROM and its analysis.
+void chip8_rom_load(Chip8 *cpu, const char *path, Chip8_Rom *rom)
+{
+    if (!chip8_rom_read(path, rom)) {
+        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    const char *dir = chip8_rom_cache_dir();
+    rom->cached = dir && chip8_rom_cache_read(dir, rom);
+    if (!rom->cached && chip8_rom_analyze(rom->bytes, rom->size, &rom->analysis) && dir) {
+        chip8_rom_cache_write(dir, rom);
+    }
+    if (!chip8_rom_install(cpu, rom)) {
+        fprintf(stderr, "ROM %s is larger than the %d bytes that fit in memory\n", path, MAX_ROM_SIZE);
+        exit(1);
+    }
+}
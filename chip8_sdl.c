@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -6,6 +7,11 @@
 
 #include <SDL.h>
 #include "./chip8.c"
+#include "./chip8_exec_trace.c"
+#include "./chip8_rewind.c"
+#include "./chip8_rom.c"
+#include "./chip8_spsc.c"
+#include "./chip8_trace.c"
 
 #define SCALE 20
 #define WIDTH (64*SCALE)
@@ -14,69 +20,294 @@
 #define BG_COLOR 0x111111ff // RRGGBBAA
 #define FG_COLOR 0x117821ff // RRGGBBAA
 
-char *read_entire_file(const char *path, size_t *out_size)
+// The streaming texture is ARGB8888, so the colors are rotated once up front
+#define TO_ARGB(c) ((((c) & 0xff) << 24) | ((c) >> 8))
+
+#define FRAME_REPORT_MS 1000 // How often the average frame time is printed
+
+enum {
+    INPUT_KEY,    // `key` went down or up
+    INPUT_STEP,   // Run one instruction, only with -s
+    INPUT_REWIND, // Backspace went down or up
+    INPUT_DUMP,   // Print the registers and flush the execution trace
+};
+
+// The render thread (main) polls SDL, sends input through `input` and presents frames from `frames`,
+// the emulation thread owns everything else until it's joined.
+typedef struct Emulator {
+    Chip8 cpu;
+    Chip8_Input_Queue input;
+    Chip8_Frame_Buffer frames;
+    SDL_sem *wake;              // Posted after sending input, so a sleeping emulation thread sees it right away
+    Uint32 frame_event;         // Pushed to the render thread when a frame is published
+    atomic_bool frame_signaled; // A frame_event is pending, publishing faster than vsync doesn't flood SDL's queue
+    atomic_bool quit;
+    bool step_debug;
+    const char *trace_path;
+    Chip8_Trace trace;
+    Chip8_Rewind history;       // A state per frame (per instruction with -s), restoring one would invalidate a trace
+    Uint64 restore_time_sum;
+    Uint32 restore_count;
+
+    // Key events popped from `input` and waiting for the cycle they're stamped with, oldest first
+    Chip8_Input pending[INPUT_QUEUE_SIZE];
+    size_t pending_head;
+    size_t pending_count;
+    Uint32 input_delay;         // -d, keys apply this many ms after they happened
+    Uint32 late_count;          // Keys that arrived after their time had already been emulated
+    Uint32 late_max_ms;
+
+    // (frame generation << 32) | host ms of the key press it's the first frame after, 0 when no
+    // press is being measured. Set by the emulation thread, cleared once the render thread has shown it.
+    atomic_uint_fast64_t input_probe;
+} Emulator;
+
+static Emulator emu;
+
+static bool send_input(Emulator *emu, uint8_t kind, uint8_t key, bool pressed, Uint32 time)
 {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        fprintf(stderr, "Failed to open file %s\n", path);
-        exit(1);
-    }
-    if (fseek(f, 0, SEEK_END) == -1) {
-        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
-        exit(1);
+    Chip8_Input input = {kind, key, pressed, time, 0};
+    if (!chip8_input_push(&emu->input, input)) {
+        fprintf(stderr, "Input queue is full, dropped an event\n");
+        return false;
     }
-    long size = ftell(f);
-    if (size == -1) {
-        fprintf(stderr, "Failed to get file size of %s because of %s\n", path, strerror(errno));
-        exit(1);
+    return true;
+}
+
+// Stamps a key event with the cycle matching input->time + the input delay, given that the CPU
+// has been credited time up to `ticks`. Keys whose time is already emulated apply at once and are
+// counted late. Stamps never go back, so keys apply in the order they happened.
+static void stamp_input(Emulator *emu, Chip8_Input *input, Uint32 ticks)
+{
+    Uint32 due = input->time + emu->input_delay;
+    if ((Sint32)(due - ticks) >= 0) {
+        input->cycle = chip8_cycle_in(&emu->cpu, due - ticks);
+    } else {
+        input->cycle = chip8_cycle_in(&emu->cpu, 0);
+        emu->late_count += 1;
+        if (ticks - due > emu->late_max_ms) emu->late_max_ms = ticks - due;
     }
-    if (fseek(f, 0, SEEK_SET) == -1) {
-        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
-        exit(1);
+    if (emu->pending_count > 0) {
+        const Chip8_Input *last = &emu->pending[(emu->pending_head + emu->pending_count - 1) % INPUT_QUEUE_SIZE];
+        if (input->cycle < last->cycle) input->cycle = last->cycle;
     }
+}
 
-    char *raw = malloc(size);
-    if (!raw) {
-        fprintf(stderr, "Failed to allocate memory\n");
-        exit(1);
+static void apply_input(Emulator *emu, const Chip8_Input *input, Uint32 *press_time, bool *pressed)
+{
+    chip8_set_key(&emu->cpu, input->key, input->pressed);
+    if (emu->trace_path) chip8_trace_key(&emu->trace, &emu->cpu, input->key, input->pressed);
+    if (input->pressed) {
+        *press_time = input->time;
+        *pressed = true;
     }
+}
 
-    size_t nread = fread(raw, 1, size, f);
-    if (nread != (size_t)size) {
-        fprintf(stderr, "Failed to read file\n");
-        exit(1);
-    }
+// Emulation thread: runs the CPU on its own clock, so a render thread stalled on vsync, a window
+// drag or a slow driver changes how many frames are shown but not how fast the program runs.
+// Keys go through `pending` and apply at the exact cycle they're stamped with, so how late the
+// thread happens to pop them doesn't change what the program sees.
+static int emulate(void *data)
+{
+    Emulator *emu = data;
+    Chip8 *cpu = &emu->cpu;
+    bool step = false;
+    bool step_back = false;
+    bool rewinding = false;
+
+    Uint32 press_time = 0;   // Host time of the last key press applied
+    bool press_shown = true; // No press is waiting for a frame to measure its latency with
+
+    Uint32 prev_ticks = SDL_GetTicks();
+    Uint32 report_ticks = prev_ticks;
+    uint64_t report_cycles = cpu->cycles;
+    while (!atomic_load(&emu->quit)) {
+        Chip8_Input input;
+        while (chip8_input_pop(&emu->input, &input)) {
+            switch (input.kind) {
+            case INPUT_KEY:
+                if (emu->pending_count == INPUT_QUEUE_SIZE) {
+                    bool pressed = false;
+                    apply_input(emu, &emu->pending[emu->pending_head], &press_time, &pressed);
+                    press_shown &= !pressed;
+                    emu->pending_head = (emu->pending_head + 1) % INPUT_QUEUE_SIZE;
+                    emu->pending_count -= 1;
+                }
+                stamp_input(emu, &input, prev_ticks);
+                emu->pending[(emu->pending_head + emu->pending_count) % INPUT_QUEUE_SIZE] = input;
+                emu->pending_count += 1;
+                break;
+            case INPUT_STEP:
+                step = true;
+                break;
+            case INPUT_REWIND:
+                rewinding = input.pressed;
+                if (rewinding) step_back = true;
+                break;
+            case INPUT_DUMP:
+                chip8_dump(cpu);
+                if (cpu->exec_trace) chip8_exec_trace_flush(cpu->exec_trace);
+                break;
+            }
+        }
+
+        Uint32 curr_ticks = SDL_GetTicks();
+        Uint32 delta_ticks = curr_ticks - prev_ticks;
+        prev_ticks = curr_ticks;
+
+        // Stepping and rewinding don't follow the clock, keys apply as soon as they arrive
+        bool stamped = !emu->step_debug && !rewinding && !step_back;
+        uint32_t ms = (uint32_t)delta_ticks;
+        uint32_t events = 0;
+        while (emu->pending_count > 0) {
+            const Chip8_Input *next = &emu->pending[emu->pending_head];
+            if (stamped) {
+                events |= chip8_run_for_until(cpu, ms, next->cycle);
+                ms = 0;
+                if (cpu->cycles < next->cycle) break;
+            }
+            bool pressed = false;
+            apply_input(emu, next, &press_time, &pressed);
+            press_shown &= !pressed;
+            emu->pending_head = (emu->pending_head + 1) % INPUT_QUEUE_SIZE;
+            emu->pending_count -= 1;
+        }
+
+        if (step_back || (rewinding && !emu->step_debug)) {
+            Uint64 restore_start = SDL_GetPerformanceCounter();
+            bool restored = chip8_rewind_back(&emu->history, cpu);
+            emu->restore_time_sum += SDL_GetPerformanceCounter() - restore_start;
+            emu->restore_count += restored;
+            if (emu->step_debug && restored) chip8_dump(cpu);
+            step_back = false;
+        } else if (emu->step_debug) {
+            if (step) {
+                chip8_run_cycles(cpu, 1);
+                chip8_rewind_push(&emu->history, cpu);
+                chip8_dump(cpu);
+                step = false;
+            }
+        } else {
+            // Up to the next key if it's still pending, chip8_run_for_until keeps the time after it owed
+            uint64_t until = emu->pending_count > 0 ? emu->pending[emu->pending_head].cycle : UINT64_MAX;
+            events |= chip8_run_for_until(cpu, ms, until);
+            if (events & CHIP8_EVENT_FRAME) {
+                chip8_rewind_push(&emu->history, cpu);
+            }
+        }
+
+        if (chip8_take_dirty_rows(cpu) != 0) {
+            chip8_frames_publish(&emu->frames, cpu);
+            // The first frame drawn after a press is the earliest that can show it. One press is
+            // measured at a time, the ones made while it's in flight are left out.
+            uint_fast64_t idle = 0;
+            if (!press_shown && atomic_compare_exchange_strong(&emu->input_probe, &idle, (uint_fast64_t)emu->frames.generation << 32 | press_time)) {
+                press_shown = true;
+            }
+            if (!atomic_exchange(&emu->frame_signaled, true)) {
+                SDL_Event e = {0};
+                e.type = emu->frame_event;
+                SDL_PushEvent(&e);
+            }
+        }
 
-    if (out_size) {
-        *out_size = size;
+        if (!emu->step_debug && curr_ticks - report_ticks >= FRAME_REPORT_MS) {
+            printf("Emulation: %.0f cycles/s, %u keys late by up to %u ms\n", (cpu->cycles - report_cycles)*1000.0/(curr_ticks - report_ticks),
+                   emu->late_count, emu->late_max_ms);
+            emu->late_count = 0;
+            emu->late_max_ms = 0;
+            report_cycles = cpu->cycles;
+            report_ticks = curr_ticks;
+        }
+
+        // Sleep until input arrives or there's something to do. A program that is idling or waiting
+        // for a key won't do anything before the next timer tick, and rewinding goes a frame per frame.
+        Uint32 wait_ms = 1;
+        if (emu->step_debug) {
+            wait_ms = FRAME_REPORT_MS;
+        } else if (rewinding) {
+            wait_ms = 1000/TIMER_RATE;
+        } else if (events & (CHIP8_EVENT_IDLE | CHIP8_EVENT_WAIT_KEY)) {
+            wait_ms = chip8_ms_until_tick(cpu);
+        }
+        if (stamped && emu->pending_count > 0) {
+            Sint32 due_ms = (Sint32)(emu->pending[emu->pending_head].time + emu->input_delay - curr_ticks);
+            if (due_ms < (Sint32)wait_ms) wait_ms = due_ms > 0 ? (Uint32)due_ms : 0;
+        }
+        SDL_SemWaitTimeout(emu->wake, wait_ms > 0 ? wait_ms : 1);
     }
+    return 0;
+}
 
-    return raw;
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s <ROM path> [-s] [-r trace] [-S seed] [-q profile] [-x file] [-d ms]\n", program);
+    fprintf(stderr, "  -s steps one instruction per Enter, Backspace steps back\n");
+    fprintf(stderr, "  -r records the keyboard into a trace for chip8.bench -r, written on exit\n");
+    fprintf(stderr, "  -S seeds the CXNN generator\n");
+    fprintf(stderr, "  -q picks the quirk profile (default, cosmac, schip, xochip) instead of the one known for the ROM\n");
+    fprintf(stderr, "  -x keeps the last instructions executed in a file mapping for chip8.trace, even across a crash\n");
+    fprintf(stderr, "  -d applies keys ms after they happened (default 0), enough to cover a frame makes input latency constant\n");
+    fprintf(stderr, "  Holding Backspace rewinds one frame per frame, unless a trace is being recorded\n");
+    exit(1);
 }
 
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <ROM path>\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
     }
 
-    bool step_debug = false;
-    if (argc == 3 && strcmp(argv[2], "-s") == 0) {
-        step_debug = true;
+    uint32_t seed = 0;
+    int profile = -1;
+    const char *exec_trace_path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            emu.step_debug = true;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            emu.trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            profile = chip8_profile_by_name(argv[++i]);
+            if (profile < 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            exec_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            emu.input_delay = (Uint32)strtoul(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
     }
 
-    bool step = false;
+    Chip8 *cpu = &emu.cpu;
+    chip8_load_sprites(cpu);
+    static Chip8_Rom rom;
+    chip8_rom_load(cpu, argv[1], &rom);
+    chip8_seed(cpu, seed);
+    if (profile >= 0) cpu->profile = (uint8_t)profile;
+
+    if (exec_trace_path) {
+        cpu->exec_trace = chip8_exec_trace_open(exec_trace_path, EXEC_TRACE_DEFAULT_RECORDS, cpu);
+        if (!cpu->exec_trace) {
+            fprintf(stderr, "Failed to create execution trace %s because of %s\n", exec_trace_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (emu.trace_path) {
+        chip8_trace_begin(&emu.trace, cpu, rom.bytes, rom.size);
+    }
 
-    Chip8 cpu = {0};
-    chip8_load_sprites(&cpu);
-    size_t rom_size;
-    char *rom_bytes = read_entire_file(argv[1], &rom_size);
-    chip8_load_rom(&cpu, rom_bytes, rom_size);
+    if (!chip8_rewind_init(&emu.history, REWIND_DEFAULT_BUDGET)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    chip8_rewind_push(&emu.history, cpu);
 
-    printf("Game Initialized! Rom size: %ld\n", rom_size);
+    printf("Game Initialized! Rom size: %zu, quirk profile: %s%s\n", rom.size, chip8_profile_names[cpu->profile], rom.cached ? " (cached)" : "");
 
-    chip8_disassemble(&cpu);
+    chip8_disassemble(cpu);
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "Failed to initialize SDL\n");
@@ -90,12 +321,19 @@ int main(int argc, char **argv)
     }
 
     // GPU rendering
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!renderer) {
         fprintf(stderr, "Failed to create renderer\n");
         exit(1);
     }
 
+    // The display is expanded into a 64x32 texture and the renderer scales it to the window
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    if (!texture) {
+        fprintf(stderr, "Failed to create texture because of %s\n", SDL_GetError());
+        exit(1);
+    }
+
     // CPU rendering
     //SDL_Surface *surface = SDL_GetWindowSurface(window);
     //if (!surface) {
@@ -103,63 +341,146 @@ int main(int argc, char **argv)
     //    exit(1);
     //}
 
-    Uint32 prev_ticks = SDL_GetTicks();
+    chip8_input_init(&emu.input);
+    chip8_frames_init(&emu.frames);
+    chip8_frames_publish(&emu.frames, cpu); // So there is something to show before the first frame
+    emu.frame_event = SDL_RegisterEvents(1);
+    emu.wake = SDL_CreateSemaphore(0);
+    if (emu.frame_event == (Uint32)-1 || !emu.wake) {
+        fprintf(stderr, "Failed to set up the emulation thread because of %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_Thread *thread = SDL_CreateThread(emulate, "chip8", &emu);
+    if (!thread) {
+        fprintf(stderr, "Failed to start the emulation thread because of %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    Uint64 perf_freq = SDL_GetPerformanceFrequency();
+    Uint64 frame_time_sum = 0;
+    Uint32 frame_count = 0;
+    Uint32 skipped_count = 0;
+    uint32_t shown_generation = 0;
+    Uint64 latency_sum = 0;
+    Uint32 latency_max = 0;
+    Uint32 latency_count = 0;
+    Uint32 report_ticks = SDL_GetTicks();
 
     SDL_Event e;
     bool running = true;
-    while (running) {
-        SDL_PollEvent(&e);
-        if (e.type == SDL_QUIT) {
-            running = false;
-        } else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
-            SDL_Keycode keycode = e.key.keysym.sym;
-            if (keycode == SDLK_ESCAPE) {
+    while (running && SDL_WaitEvent(&e)) {
+        bool redraw = false;
+        bool sent = false;
+        do {
+            if (e.type == SDL_QUIT) {
                 running = false;
-            } else if (keycode == SDLK_SPACE && e.key.state == SDL_PRESSED) {
-                chip8_dump(&cpu);
-            } else if (keycode == SDLK_RETURN && e.key.state == SDL_PRESSED) {
-                step = true;
-            } else if (keycode >= '0' && keycode <= '9') {
-                //printf("Key '%c' %s\n", keycode, e.key.state == SDL_PRESSED ? "pressed" : "released");
-                cpu.keyboard[keycode - '0'] = e.key.state == SDL_PRESSED ? 1 : 0;
-            } else if (keycode >= 'a' && keycode <= 'f') {
-                cpu.keyboard[keycode - 'a' + 10] = e.key.state == SDL_PRESSED ? 1 : 0;
+            } else if (e.type == SDL_WINDOWEVENT) {
+                redraw = true;
+            } else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+                SDL_Keycode keycode = e.key.keysym.sym;
+                bool pressed = e.key.state == SDL_PRESSED;
+                if (keycode == SDLK_ESCAPE) {
+                    running = false;
+                } else if (keycode == SDLK_SPACE && pressed) {
+                    sent |= send_input(&emu, INPUT_DUMP, 0, true, e.key.timestamp);
+                } else if (keycode == SDLK_RETURN && pressed) {
+                    sent |= send_input(&emu, INPUT_STEP, 0, true, e.key.timestamp);
+                } else if (keycode == SDLK_BACKSPACE && !emu.trace_path) {
+                    sent |= send_input(&emu, INPUT_REWIND, 0, pressed, e.key.timestamp);
+                } else if (((keycode >= '0' && keycode <= '9') || (keycode >= 'a' && keycode <= 'f')) && !e.key.repeat) {
+                    //printf("Key '%c' %s\n", keycode, pressed ? "pressed" : "released");
+                    uint8_t key = keycode <= '9' ? keycode - '0' : keycode - 'a' + 10;
+                    sent |= send_input(&emu, INPUT_KEY, key, pressed, e.key.timestamp);
+                }
             }
+        } while (SDL_PollEvent(&e));
+        if (sent) {
+            SDL_SemPost(emu.wake);
         }
 
-        Uint32 curr_ticks = SDL_GetTicks();
-        Uint32 delta_ticks = curr_ticks - prev_ticks;
-        prev_ticks = curr_ticks;
+        // Cleared before acquiring, a frame published after this point signals again
+        atomic_store(&emu.frame_signaled, false);
+        const Chip8_Frame *frame = chip8_frames_acquire(&emu.frames);
 
-        if (step_debug) {
-            if (step) {
-                chip8_step(&cpu, (uint32_t)delta_ticks);
-                chip8_dump(&cpu);
-                step = false;
+        Uint64 frame_start = SDL_GetPerformanceCounter();
+        if (frame) {
+            void *pixels;
+            int pitch;
+            if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+                fprintf(stderr, "Failed to lock texture because of %s\n", SDL_GetError());
+                exit(1);
             }
-        } else {
-            chip8_step(&cpu, (uint32_t)delta_ticks);
+            for (int row = 0; row < 32; row++) {
+                chip8_unpack_row(frame->display[row], (uint32_t*)((uint8_t*)pixels + row*pitch), TO_ARGB(FG_COLOR), TO_ARGB(BG_COLOR));
+            }
+            SDL_UnlockTexture(texture);
+            skipped_count += frame->generation - shown_generation - 1;
+            shown_generation = frame->generation;
+            redraw = true;
+        }
+        if (!redraw) {
+            continue;
         }
 
         // CPU rendering
         //SDL_FillRect(surface, &rect, 0xffffffff);
         //SDL_UpdateWindowSurface(window);
 
-        // GPU rendering
-        SDL_SetRenderDrawColor(renderer, (BG_COLOR >> 24) & 0xff, (BG_COLOR >> 16) & 0xff, (BG_COLOR >> 8) & 0xff, BG_COLOR & 0xff);
-        SDL_RenderClear(renderer);
-
-        for (int row = 0; row < 32; row++) {
-            for (int col = 0; col < 64; col++) {
-                uint32_t color = cpu.display[row*64 + col] > 0 ? FG_COLOR : BG_COLOR;
-                SDL_Rect rect = {.x = col*SCALE, .y = row*SCALE, .w = SCALE, .h = SCALE};
-                SDL_SetRenderDrawColor(renderer, color, color, color, 0xff);
-                SDL_SetRenderDrawColor(renderer, (color >> 24) & 0xff, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
-                SDL_RenderFillRect(renderer, &rect);
+        // GPU rendering, presenting blocks until vsync while the emulation thread keeps publishing,
+        // so the next acquire picks up the newest frame and skips the ones in between
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+
+        frame_time_sum += SDL_GetPerformanceCounter() - frame_start;
+        frame_count += 1;
+        Uint32 curr_ticks = SDL_GetTicks();
+        uint_fast64_t probe = atomic_load(&emu.input_probe);
+        if (probe != 0 && shown_generation >= (uint32_t)(probe >> 32)) {
+            Uint32 latency = curr_ticks - (Uint32)probe;
+            latency_sum += latency;
+            if (latency > latency_max) latency_max = latency;
+            latency_count += 1;
+            atomic_store(&emu.input_probe, 0);
+        }
+        if (curr_ticks - report_ticks >= FRAME_REPORT_MS) {
+            printf("Frames: %u, average frame time: %.3f ms, skipped %u", frame_count, frame_time_sum*1000.0/perf_freq/frame_count, skipped_count);
+            if (latency_count > 0) {
+                // In timer ticks, the frames a CHIP-8 program counts in
+                printf(", input latency %.1f frames (max %.1f)", latency_sum*(double)TIMER_RATE/1000/latency_count, latency_max*(double)TIMER_RATE/1000);
             }
+            printf("\n");
+            latency_sum = 0;
+            latency_max = 0;
+            latency_count = 0;
+            frame_time_sum = 0;
+            frame_count = 0;
+            skipped_count = 0;
+            report_ticks = curr_ticks;
         }
+    }
 
-        SDL_RenderPresent(renderer);
+    atomic_store(&emu.quit, true);
+    SDL_SemPost(emu.wake);
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroySemaphore(emu.wake);
+
+    printf("Rewind: %zu states kept (%.1f s), %.1f bytes per state, average restore %.1f us\n",
+           emu.history.count, emu.history.count/(double)TIMER_RATE, emu.history.pushed ? (double)emu.history.pushed_bytes/emu.history.pushed : 0.0,
+           emu.restore_count ? emu.restore_time_sum*1e6/perf_freq/emu.restore_count : 0.0);
+    chip8_rewind_free(&emu.history);
+
+    if (emu.trace_path) {
+        chip8_trace_end(&emu.trace, cpu);
+        if (!chip8_trace_save(&emu.trace, emu.trace_path)) {
+            fprintf(stderr, "Failed to write trace %s because of %s\n", emu.trace_path, strerror(errno));
+            exit(1);
+        }
+        printf("Recorded %llu cycles into %s\n", (unsigned long long)cpu->cycles, emu.trace_path);
+        chip8_trace_free(&emu.trace);
+    }
+    if (cpu->exec_trace) {
+        printf("Kept the last of %llu instructions in %s\n", (unsigned long long)cpu->exec_trace->count, exec_trace_path);
+        chip8_exec_trace_close(cpu->exec_trace);
     }
     return 0;
 }
@@ -0,0 +1,349 @@
+// Save states with copy-on-write memory, include after chip8.c.
+//
+// A `Chip8_Snapshot` keeps the registers and the display by value and `memory` as CHIP8_PAGES
+// reference-counted pages. Pages are never modified once they belong to a snapshot, so snapshots
+// share every page they have in common and chip8_fork is a handful of reference count bumps.
+// chip8_snapshot copies only the pages the instance wrote (Fx33, Fx55, ROM loads: everything
+// that goes through chip8_invalidate) since it was last in sync with `base`, and chip8_restore
+// copies only the pages that differ from the snapshot the instance was restored from. The display
+// is 256 bytes, less than a page allocation costs, so it is always copied.
+//
+// Branching search, trying every key from one state:
+//
+//     chip8_snapshot(cpu, NULL, &root);
+//     for (int key = 0; key < 16; key++) {
+//         chip8_restore(cpu, &root, key == 0 ? &root : &child[key - 1]);
+//         chip8_set_key(cpu, key, true);
+//         chip8_run_cycles(cpu, n);
+//         chip8_snapshot(cpu, &root, &child[key]); // Shares the pages the branch didn't write
+//     }
+//
+// Page references are atomic, so snapshots sharing pages may be forked and freed from different
+// threads. A single snapshot must not be used by two threads while one of them changes it.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_VERSION 1
+// Serialized size with every memory page present, enough for any snapshot
+#define SNAPSHOT_MAX_SIZE (4 + 4 + 1 + 16 + 2*2 + 2*1 + 2 + 2 + 1 + 32*8 + 4 + 1 + MAX_SUBROUTINES*2 + 4*2 + 8 + 8 + 4 + 2 + 0x1000)
+
+typedef struct Chip8_Page {
+    atomic_uint refs;
+    uint8_t bytes[CHIP8_PAGE_SIZE];
+} Chip8_Page;
+
+typedef struct Chip8_Snapshot {
+    uint8_t profile;
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint16_t keyboard;
+    uint16_t key_presses;
+    bool key_wait;
+
+    uint64_t display[32];
+    uint32_t frame_generation;
+
+    uint8_t stack_pointer;
+    uint16_t call_stack[MAX_SUBROUTINES];
+
+    uint32_t clock_rate;
+    uint32_t timer_phase;
+    uint64_t cycle_credit;
+    uint64_t cycles;
+    uint32_t rng_state;
+
+    Chip8_Page *pages[CHIP8_PAGES]; // NULL only in an empty snapshot
+} Chip8_Snapshot;
+
+static Chip8_Page *chip8_page_new(const uint8_t *bytes)
+{
+    Chip8_Page *page = malloc(sizeof(*page));
+    if (!page) return NULL;
+    atomic_init(&page->refs, 1);
+    memcpy(page->bytes, bytes, CHIP8_PAGE_SIZE);
+    return page;
+}
+
+static void chip8_page_release(Chip8_Page *page)
+{
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+// Releases the pages of `snap` and leaves it empty
+void chip8_snapshot_free(Chip8_Snapshot *snap)
+{
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        chip8_page_release(snap->pages[p]);
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Captures `cpu` into `snap`, which must be empty or `base`. `base` (may be NULL) is the snapshot
+// `cpu` was last restored from or captured into, the pages `cpu` hasn't written since are shared
+// with it instead of copied. Returns false, leaving `snap` untouched, if a page can't be allocated.
+bool chip8_snapshot(Chip8 *cpu, Chip8_Snapshot *base, Chip8_Snapshot *snap)
+{
+    Chip8_Snapshot next;
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        if (base && !((cpu->written_pages >> p) & 1)) {
+            next.pages[p] = base->pages[p];
+            atomic_fetch_add_explicit(&next.pages[p]->refs, 1, memory_order_relaxed);
+        } else {
+            next.pages[p] = chip8_page_new(&cpu->memory[p*CHIP8_PAGE_SIZE]);
+            if (!next.pages[p]) {
+                for (int q = 0; q < p; q++) {
+                    chip8_page_release(next.pages[q]);
+                }
+                return false;
+            }
+        }
+    }
+    cpu->written_pages = 0;
+
+    next.profile = cpu->profile;
+    memcpy(next.V, cpu->V, sizeof(next.V));
+    next.I = cpu->I;
+    next.PC = cpu->PC;
+    next.delay_timer = cpu->delay_timer;
+    next.sound_timer = cpu->sound_timer;
+    next.keyboard = cpu->keyboard;
+    next.key_presses = cpu->key_presses;
+    next.key_wait = cpu->key_wait;
+    memcpy(next.display, cpu->display, sizeof(next.display));
+    next.frame_generation = cpu->frame_generation;
+    next.stack_pointer = cpu->stack_pointer;
+    memcpy(next.call_stack, cpu->call_stack, sizeof(next.call_stack));
+    next.clock_rate = cpu->clock_rate;
+    next.timer_phase = cpu->timer_phase;
+    next.cycle_credit = cpu->cycle_credit;
+    next.cycles = cpu->cycles;
+    next.rng_state = cpu->rng_state;
+
+    if (snap == base) chip8_snapshot_free(snap);
+    *snap = next;
+    return true;
+}
+
+// Puts `cpu` back into the state captured in `snap`. `current` (may be NULL) is the snapshot
+// `cpu` was last restored from or captured into: pages it shares with `snap` that `cpu` hasn't
+// written since are already in place, and so is their decoded instruction cache.
+void chip8_restore(Chip8 *cpu, const Chip8_Snapshot *snap, const Chip8_Snapshot *current)
+{
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        bool in_place = current && current->pages[p] == snap->pages[p] && !((cpu->written_pages >> p) & 1);
+        if (in_place) continue;
+        memcpy(&cpu->memory[p*CHIP8_PAGE_SIZE], snap->pages[p]->bytes, CHIP8_PAGE_SIZE);
+        chip8_invalidate(cpu, p*CHIP8_PAGE_SIZE, CHIP8_PAGE_SIZE);
+    }
+    cpu->written_pages = 0;
+
+    uint32_t dirty = 0;
+    for (int row = 0; row < 32; row++) {
+        if (cpu->display[row] != snap->display[row]) dirty |= 1u << row;
+    }
+    cpu->dirty_rows |= dirty;
+
+    cpu->profile = snap->profile;
+    memcpy(cpu->V, snap->V, sizeof(cpu->V));
+    cpu->I = snap->I;
+    cpu->PC = snap->PC;
+    cpu->delay_timer = snap->delay_timer;
+    cpu->sound_timer = snap->sound_timer;
+    cpu->keyboard = snap->keyboard;
+    cpu->key_presses = snap->key_presses;
+    cpu->key_wait = snap->key_wait;
+    memcpy(cpu->display, snap->display, sizeof(cpu->display));
+    cpu->frame_generation = snap->frame_generation;
+    cpu->stack_pointer = snap->stack_pointer;
+    memcpy(cpu->call_stack, snap->call_stack, sizeof(cpu->call_stack));
+    cpu->clock_rate = snap->clock_rate;
+    cpu->timer_phase = snap->timer_phase;
+    cpu->cycle_credit = snap->cycle_credit;
+    cpu->cycles = snap->cycles;
+    cpu->rng_state = snap->rng_state;
+}
+
+// Makes `copy` (empty) an independent snapshot equal to `snap` without copying any memory
+void chip8_fork(const Chip8_Snapshot *snap, Chip8_Snapshot *copy)
+{
+    *copy = *snap;
+    for (int p = 0; p < CHIP8_PAGES; p++) {
+        atomic_fetch_add_explicit(&copy->pages[p]->refs, 1, memory_order_relaxed);
+    }
+}
+
+static uint8_t *chip8_snapshot_put(uint8_t *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        *out++ = (uint8_t)(value >> (8*i));
+    }
+    return out;
+}
+
+static uint64_t chip8_snapshot_get(const uint8_t **in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)(*in)[i] << (8*i);
+    }
+    *in += bytes;
+    return value;
+}
+
+static bool chip8_page_is_zero(const Chip8_Page *page)
+{
+    for (int i = 0; i < CHIP8_PAGE_SIZE; i++) {
+        if (page->bytes[i] != 0) return false;
+    }
+    return true;
+}
+
+// Writes `snap` into `out`, which must hold SNAPSHOT_MAX_SIZE bytes, and returns the size used.
+// Integers are little-endian, only the used part of the call stack and the memory pages that
+// aren't all zero are stored:
+//   "C8SS", SNAPSHOT_VERSION (4), profile (1), V (16), I (2), PC (2), delay and sound timer
+//   (1 each), keyboard as a bitmask (2), key_presses (2), key_wait (1), display rows (32*8),
+//   frame_generation (4), stack_pointer (1), call_stack[0..stack_pointer) capped at
+//   MAX_SUBROUTINES entries (2 each), clock_rate, timer_phase (4 each), cycle_credit, cycles
+//   (8 each), rng_state (4), bitmask of stored pages (2), the stored pages (CHIP8_PAGE_SIZE each)
+size_t chip8_snapshot_serialize(const Chip8_Snapshot *snap, uint8_t *out)
+{
+    uint8_t *p = out;
+    memcpy(p, "C8SS", 4);
+    p += 4;
+    p = chip8_snapshot_put(p, SNAPSHOT_VERSION, 4);
+    p = chip8_snapshot_put(p, snap->profile, 1);
+    memcpy(p, snap->V, 16);
+    p += 16;
+    p = chip8_snapshot_put(p, snap->I, 2);
+    p = chip8_snapshot_put(p, snap->PC, 2);
+    p = chip8_snapshot_put(p, snap->delay_timer, 1);
+    p = chip8_snapshot_put(p, snap->sound_timer, 1);
+    p = chip8_snapshot_put(p, snap->keyboard, 2);
+    p = chip8_snapshot_put(p, snap->key_presses, 2);
+    p = chip8_snapshot_put(p, snap->key_wait, 1);
+    for (int row = 0; row < 32; row++) {
+        p = chip8_snapshot_put(p, snap->display[row], 8);
+    }
+    p = chip8_snapshot_put(p, snap->frame_generation, 4);
+    uint8_t depth = snap->stack_pointer < MAX_SUBROUTINES ? snap->stack_pointer : MAX_SUBROUTINES;
+    p = chip8_snapshot_put(p, snap->stack_pointer, 1);
+    for (int i = 0; i < depth; i++) {
+        p = chip8_snapshot_put(p, snap->call_stack[i], 2);
+    }
+    p = chip8_snapshot_put(p, snap->clock_rate, 4);
+    p = chip8_snapshot_put(p, snap->timer_phase, 4);
+    p = chip8_snapshot_put(p, snap->cycle_credit, 8);
+    p = chip8_snapshot_put(p, snap->cycles, 8);
+    p = chip8_snapshot_put(p, snap->rng_state, 4);
+
+    uint16_t stored = 0;
+    for (int page = 0; page < CHIP8_PAGES; page++) {
+        if (!chip8_page_is_zero(snap->pages[page])) stored |= 1u << page;
+    }
+    p = chip8_snapshot_put(p, stored, 2);
+    for (int page = 0; page < CHIP8_PAGES; page++) {
+        if ((stored >> page) & 1) {
+            memcpy(p, snap->pages[page]->bytes, CHIP8_PAGE_SIZE);
+            p += CHIP8_PAGE_SIZE;
+        }
+    }
+    return p - out;
+}
+
+// Reads a snapshot written by chip8_snapshot_serialize into `snap` (empty). Returns NULL on
+// success, otherwise why it failed, in which case `snap` is left empty.
+const char *chip8_snapshot_deserialize(const uint8_t *data, size_t size, Chip8_Snapshot *snap)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    memset(snap, 0, sizeof(*snap));
+
+    // Everything up to the call stack, then everything after it but the pages
+    size_t head = 4 + 4 + 1 + 16 + 2*2 + 2*1 + 2 + 2 + 1 + 32*8 + 4 + 1;
+    size_t tail = 4*2 + 8 + 8 + 4 + 2;
+    if (size < head || memcmp(p, "C8SS", 4) != 0) return "not a snapshot";
+    p += 4;
+    if (chip8_snapshot_get(&p, 4) != SNAPSHOT_VERSION) return "unsupported snapshot version";
+    snap->profile = chip8_snapshot_get(&p, 1);
+    if (snap->profile >= CHIP8_PROFILE_COUNT) {
+        memset(snap, 0, sizeof(*snap));
+        return "unknown quirk profile";
+    }
+
+    memcpy(snap->V, p, 16);
+    p += 16;
+    snap->I = chip8_snapshot_get(&p, 2);
+    snap->PC = chip8_snapshot_get(&p, 2);
+    snap->delay_timer = chip8_snapshot_get(&p, 1);
+    snap->sound_timer = chip8_snapshot_get(&p, 1);
+    snap->keyboard = chip8_snapshot_get(&p, 2);
+    snap->key_presses = chip8_snapshot_get(&p, 2);
+    snap->key_wait = chip8_snapshot_get(&p, 1) != 0;
+    for (int row = 0; row < 32; row++) {
+        snap->display[row] = chip8_snapshot_get(&p, 8);
+    }
+    snap->frame_generation = chip8_snapshot_get(&p, 4);
+    snap->stack_pointer = chip8_snapshot_get(&p, 1);
+    int depth = snap->stack_pointer < MAX_SUBROUTINES ? snap->stack_pointer : MAX_SUBROUTINES;
+    if ((size_t)(end - p) < depth*2u + tail) {
+        memset(snap, 0, sizeof(*snap));
+        return "truncated snapshot";
+    }
+    for (int i = 0; i < depth; i++) {
+        snap->call_stack[i] = chip8_snapshot_get(&p, 2);
+    }
+    snap->clock_rate = chip8_snapshot_get(&p, 4);
+    snap->timer_phase = chip8_snapshot_get(&p, 4);
+    snap->cycle_credit = chip8_snapshot_get(&p, 8);
+    snap->cycles = chip8_snapshot_get(&p, 8);
+    snap->rng_state = chip8_snapshot_get(&p, 4);
+
+    uint16_t stored = chip8_snapshot_get(&p, 2);
+    if ((size_t)(end - p) != (size_t)__builtin_popcount(stored)*CHIP8_PAGE_SIZE) {
+        memset(snap, 0, sizeof(*snap));
+        return "truncated snapshot";
+    }
+    static const uint8_t zero[CHIP8_PAGE_SIZE];
+    for (int page = 0; page < CHIP8_PAGES; page++) {
+        bool present = (stored >> page) & 1;
+        snap->pages[page] = chip8_page_new(present ? p : zero);
+        if (!snap->pages[page]) {
+            chip8_snapshot_free(snap);
+            return "out of memory";
+        }
+        if (present) p += CHIP8_PAGE_SIZE;
+    }
+    return NULL;
+}
+
+bool chip8_snapshot_save(const Chip8_Snapshot *snap, const char *path)
+{
+    uint8_t buffer[SNAPSHOT_MAX_SIZE];
+    size_t size = chip8_snapshot_serialize(snap, buffer);
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(buffer, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+
+// Same as chip8_snapshot_deserialize on the contents of `path`
+const char *chip8_snapshot_load(const char *path, Chip8_Snapshot *snap)
+{
+    uint8_t buffer[SNAPSHOT_MAX_SIZE + 1];
+    FILE *f = fopen(path, "rb");
+    if (!f) return "can't open the file";
+    size_t size = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+    return chip8_snapshot_deserialize(buffer, size, snap);
+}
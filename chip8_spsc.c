@@ -0,0 +1,101 @@
+// Lock-free single-producer single-consumer primitives for running the emulator on its own thread
+// while another one renders, include after chip8.c.
+//
+// Chip8_Frame_Buffer is a triple buffer: the producer always owns one frame to fill, the consumer
+// always owns one frame to show, and the third is the newest completed frame. Publishing and
+// acquiring are one atomic exchange each, so neither side ever waits for the other and a stalled
+// consumer just makes the producer overwrite frames nobody saw.
+//
+// Chip8_Input_Queue is a bounded ring of input events going the other way. Head and tail each have
+// one writer, so pushing and popping are a load and a release store; a full queue drops the event
+// and says so instead of blocking.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_FRESH 4u // Set in Chip8_Frame_Buffer.middle when it holds a frame not yet acquired
+#define INPUT_QUEUE_SIZE 256 // Power of two
+
+typedef struct Chip8_Frame {
+    uint64_t display[32];
+    uint64_t cycles;     // cpu->cycles when the frame was published
+    uint32_t generation; // Counts published frames, the consumer can tell how many it skipped
+} Chip8_Frame;
+
+typedef struct Chip8_Frame_Buffer {
+    Chip8_Frame frames[3];
+    _Alignas(64) atomic_uint middle; // Index of the shared frame, FRAME_FRESH if it's new
+    _Alignas(64) unsigned back;      // Producer's frame
+    uint32_t generation;
+    _Alignas(64) unsigned front;     // Consumer's frame
+} Chip8_Frame_Buffer;
+
+void chip8_frames_init(Chip8_Frame_Buffer *fb)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->back = 0;
+    atomic_init(&fb->middle, 1);
+    fb->front = 2;
+}
+
+// Producer: copies the display of `cpu` into the back frame and makes it the newest one
+void chip8_frames_publish(Chip8_Frame_Buffer *fb, const Chip8 *cpu)
+{
+    Chip8_Frame *frame = &fb->frames[fb->back];
+    memcpy(frame->display, cpu->display, sizeof(frame->display));
+    frame->cycles = cpu->cycles;
+    frame->generation = ++fb->generation;
+    fb->back = atomic_exchange_explicit(&fb->middle, fb->back | FRAME_FRESH, memory_order_acq_rel) & 3;
+}
+
+// Consumer: returns the newest frame published since the previous call, or NULL if there is none.
+// The frame stays valid and untouched by the producer until the next call.
+const Chip8_Frame *chip8_frames_acquire(Chip8_Frame_Buffer *fb)
+{
+    if ((atomic_load_explicit(&fb->middle, memory_order_relaxed) & FRAME_FRESH) == 0) return NULL;
+    fb->front = atomic_exchange_explicit(&fb->middle, fb->front, memory_order_acq_rel) & 3;
+    return &fb->frames[fb->front];
+}
+
+// What an event means is up to the frontend, chip8_sdl.c uses `kind` for keys and debugger commands
+typedef struct Chip8_Input {
+    uint8_t kind;
+    uint8_t key;
+    bool pressed;
+    uint32_t time;  // Host milliseconds when it happened
+    uint64_t cycle; // Cycle it applies at, stamped by the consumer
+} Chip8_Input;
+
+typedef struct Chip8_Input_Queue {
+    Chip8_Input events[INPUT_QUEUE_SIZE];
+    _Alignas(64) atomic_size_t head; // Next event to pop, written by the consumer
+    _Alignas(64) atomic_size_t tail; // Next slot to push into, written by the producer
+} Chip8_Input_Queue;
+
+void chip8_input_init(Chip8_Input_Queue *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+// Producer: returns false and drops `input` when the consumer is INPUT_QUEUE_SIZE events behind
+bool chip8_input_push(Chip8_Input_Queue *q, Chip8_Input input)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == INPUT_QUEUE_SIZE) return false;
+    q->events[tail & (INPUT_QUEUE_SIZE - 1)] = input;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer: takes the oldest event, returns false when the queue is empty
+bool chip8_input_pop(Chip8_Input_Queue *q, Chip8_Input *input)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) return false;
+    *input = q->events[head & (INPUT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
@@ -7,52 +7,67 @@
 #include <unistd.h>
 
 #include "./chip8.c"
+#include "./chip8_rom.c"
+
+#define CELL_ROWS 16 // Every character cell holds two pixel rows
+#define CELL_COLS 64
+#define FRAME_CAPACITY (CELL_ROWS*CELL_COLS*16 + 64) // Worst case: a cursor move and a glyph per cell
+
+// Indexed by (top pixel << 1) | bottom pixel
+static const char *cell_glyphs[4] = {" ", "\u2584", "\u2580", "\u2588"};
+
+static uint64_t frames_emitted;
+static uint64_t bytes_emitted;
 
 static void handler(int signum)
 {
     (void)signum;
-    printf("\e[m\e[?25h\e[2J");
+    printf("\e[m\e[?25h\e[2J\e[H");
+    if (frames_emitted > 0) {
+        printf("Frames: %llu, bytes: %llu, average bytes per frame: %.1f\n",
+               (unsigned long long)frames_emitted, (unsigned long long)bytes_emitted, (double)bytes_emitted/frames_emitted);
+    }
     exit(0);
 }
 
-char *read_entire_file(const char *path, size_t *out_size)
+static void write_all(const char *data, size_t size)
 {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        fprintf(stderr, "Failed to open file %s\n", path);
-        exit(1);
-    }
-    if (fseek(f, 0, SEEK_END) == -1) {
-        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
-        exit(1);
-    }
-    long size = ftell(f);
-    if (size == -1) {
-        fprintf(stderr, "Failed to get file size of %s because of %s\n", path, strerror(errno));
-        exit(1);
-    }
-    if (fseek(f, 0, SEEK_SET) == -1) {
-        fprintf(stderr, "Failed to read file %s because of %s\n", path, strerror(errno));
-        exit(1);
-    }
-
-    char *raw = malloc(size);
-    if (!raw) {
-        fprintf(stderr, "Failed to allocate memory\n");
-        exit(1);
-    }
-
-    size_t nread = fread(raw, 1, size, f);
-    if (nread != (size_t)size) {
-        fprintf(stderr, "Failed to read file\n");
-        exit(1);
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write frame because of %s\n", strerror(errno));
+            exit(1);
+        }
+        data += n;
+        size -= n;
     }
+}
 
-    if (out_size) {
-        *out_size = size;
+// Appends the cells that differ from `prev` to `out`, moving the cursor only when it isn't already in place
+static size_t render_frame(const Chip8 *cpu, uint32_t dirty, uint8_t prev[CELL_ROWS][CELL_COLS], char *out)
+{
+    size_t size = 0;
+    for (int row = 0; row < CELL_ROWS; row++) {
+        if ((dirty & (0x3u << row*2)) == 0) continue;
+        uint64_t top = cpu->display[row*2];
+        uint64_t bottom = cpu->display[row*2 + 1];
+        int cursor_col = -1;
+        for (int col = 0; col < CELL_COLS; col++) {
+            uint8_t cell = (uint8_t)(((top >> (63 - col)) & 1) << 1 | ((bottom >> (63 - col)) & 1));
+            if (cell == prev[row][col]) continue;
+            prev[row][col] = cell;
+            if (cursor_col != col) {
+                size += sprintf(out + size, "\e[%d;%dH", row + 1, col + 1);
+            }
+            const char *glyph = cell_glyphs[cell];
+            size_t len = strlen(glyph);
+            memcpy(out + size, glyph, len);
+            size += len;
+            cursor_col = col + 1;
+        }
     }
-
-    return raw;
+    return size;
 }
 
 int main(int argc, char **argv)
@@ -73,23 +88,30 @@ int main(int argc, char **argv)
 
     Chip8 cpu = {0};
     chip8_load_sprites(&cpu);
-    size_t rom_size;
-    char *rom_bytes = read_entire_file(argv[1], &rom_size);
-    chip8_load_rom(&cpu, rom_bytes, rom_size);
+    static Chip8_Rom rom;
+    chip8_rom_load(&cpu, argv[1], &rom);
+
+    static char frame[FRAME_CAPACITY];
+    uint8_t prev[CELL_ROWS][CELL_COLS];
+    memset(prev, 0xff, sizeof(prev)); // Matches no cell, so the first frame paints everything
+
+    size_t setup = (size_t)sprintf(frame, "\e[?25l\e[2J\e[97;40m");
+    write_all(frame, setup);
 
-    printf("\e[?25l\e[H");
+    uint32_t dirty = 0xffffffff;
     while (true) {
-        chip8_step(&cpu, 10);
+        chip8_run_for(&cpu, 10);
         usleep(10*1000);
 
-        for (int row = 0; row < 32; row++) {
-            for (int col = 0; col < 64; col++) {
-                uint8_t color = cpu.display[row*64 + col] > 0 ? 0xff : 0;
-                printf("\e[48;2;%d;%d;%dm  \e[m", color, color, color);
-            }
-            printf("\n");
-        }
-        printf("\e[H");
+        dirty |= chip8_take_dirty_rows(&cpu);
+        if (dirty == 0) continue;
+        size_t size = render_frame(&cpu, dirty, prev, frame);
+        dirty = 0;
+        if (size == 0) continue;
+
+        write_all(frame, size);
+        frames_emitted += 1;
+        bytes_emitted += size;
     }
 
     return 0;
@@ -1,6 +1,1125 @@
+#include <assert.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "./chip8.c"
+#include "./chip8_jit.c"
+#include "./chip8_arena.c"
+#include "./chip8_pool.c"
+#include "./chip8_lockstep.c"
+#include "./chip8_trace.c"
+#include "./chip8_snapshot.c"
+#include "./chip8_rewind.c"
+#include "./chip8_spsc.c"
+#include "./chip8_profiling.c"
+#include "./chip8_exec_trace.c"
+#include "./chip8_rom.c"
+
+static void test_run_cycles(void)
+{
+    uint8_t rom[] = {
+        0x6a, 0x0a, // 0x200: LD VA, 0x0a
+        0xfa, 0x15, // 0x202: LD DT, VA
+        0xf0, 0x0a, // 0x204: LD V0, K
+        0x12, 0x06, // 0x206: JP 0x206
+    };
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+
+    // At the default 300 Hz the timers tick every 5 cycles
+    assert(chip8_run_cycles(&cpu, 49) == 49);
+    assert(cpu.delay_timer == 1);
+    assert(cpu.PC == 0x204);
+    assert(cpu.events & CHIP8_EVENT_WAIT_KEY);
+
+    cpu.stop_on = CHIP8_EVENT_FRAME;
+    assert(chip8_run_cycles(&cpu, 100) == 1);
+    assert(cpu.delay_timer == 0);
+
+    cpu.stop_on = CHIP8_EVENT_WAIT_KEY;
+    assert(chip8_run_cycles(&cpu, 100) == 1);
+    chip8_set_key(&cpu, 7, true);
+    assert(chip8_run_cycles(&cpu, 100) == 100);
+    assert(cpu.V[0] == 7);
+    assert(cpu.PC == 0x206);
+
+    // 16 ms at 300 Hz is 4.8 cycles, the remainder carries over to the next call
+    Chip8 timed = {0};
+    chip8_load_rom(&timed, (char*)rom, sizeof(rom));
+    chip8_run_for(&timed, 16);
+    assert(timed.cycles == 4);
+    chip8_run_for(&timed, 16);
+    assert(timed.cycles == 9);
+
+    // A long pause at a high clock rate is capped at MAX_BACKLOG_MS instead of wrapping
+    Chip8 fast = {0};
+    chip8_load_rom(&fast, (char*)rom, sizeof(rom));
+    fast.clock_rate = 1000000;
+    assert(chip8_cycle_in(&fast, 5000) == 100000);
+    chip8_run_for(&fast, 5000);
+    assert(fast.cycles == 100000);
+    // Above 42.9 MHz the capped credit no longer fits in 32 bits
+    fast.clock_rate = 100000000;
+    assert(chip8_cycle_in(&fast, 5000) == fast.cycles + 10000000);
+}
+
+static void test_keys(void)
+{
+    uint8_t rom[] = {
+        0x60, 0x05, // 0x200: LD V0, 0x05
+        0xe0, 0x9e, // 0x202: SKP V0
+        0x12, 0x02, // 0x204: JP 0x202
+        0xe0, 0x9e, // 0x206: SKP V0
+        0x12, 0x02, // 0x208: JP 0x202
+        0xf1, 0x0a, // 0x20a: LD V1, K
+        0x12, 0x0c, // 0x20c: JP 0x20c
+    };
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+
+    // A held key stays down however often it's read
+    chip8_set_key(&cpu, 5, true);
+    assert(chip8_run_cycles(&cpu, 4) == 4);
+    assert(cpu.PC == 0x20a);
+    assert(chip8_is_key_pressed(&cpu, 5));
+
+    // Fx0A doesn't take the key held since before it started waiting, only one that goes down
+    chip8_run_cycles(&cpu, 10);
+    assert(cpu.PC == 0x20a);
+    chip8_set_key(&cpu, 5, false);
+    chip8_run_cycles(&cpu, 10);
+    assert(cpu.PC == 0x20a);
+    chip8_set_keys(&cpu, 1u << 9 | 1u << 5);
+    chip8_run_cycles(&cpu, 1);
+    assert(cpu.PC == 0x20c);
+    assert(cpu.V[1] == 5);
+
+    // Stopping at a cycle keeps the rest of the time owed, so the total matches one long run
+    Chip8 whole = {0};
+    chip8_load_rom(&whole, (char*)rom, sizeof(rom));
+    chip8_run_for(&whole, 50);
+    Chip8 split = {0};
+    chip8_load_rom(&split, (char*)rom, sizeof(rom));
+    uint64_t until = chip8_cycle_in(&split, 20);
+    assert(until == 6);
+    chip8_run_for_until(&split, 50, until);
+    assert(split.cycles == until);
+    chip8_run_for_until(&split, 0, UINT64_MAX);
+    assert(split.cycles == whole.cycles);
+}
+
+static void test_self_modifying_code(void)
+{
+    uint8_t rom[] = {
+        0x12, 0x0a, // 0x200: JP 0x20a
+        0xa2, 0x0a, // 0x202: LD I, 0x20a
+        0x60, 0x63, // 0x204: LD V0, 0x63
+        0x61, 0xaa, // 0x206: LD V1, 0xaa
+        0xf1, 0x55, // 0x208: LD [I], V1 (rewrites 0x20a into LD V3, 0xaa)
+        0x63, 0x00, // 0x20a: LD V3, 0x00
+        0x43, 0x00, // 0x20c: SNE V3, 0x00
+        0x12, 0x02, // 0x20e: JP 0x202
+        0x12, 0x10, // 0x210: JP 0x210
+    };
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+
+    chip8_run_cycles(&cpu, 20);
+    assert(cpu.V[3] == 0xaa);
+    assert(cpu.PC == 0x210);
+
+    static Chip8_Jit jit;
+    if (chip8_jit_init(&jit)) {
+        Chip8 jitted = {0};
+        chip8_load_rom(&jitted, (char*)rom, sizeof(rom));
+        assert(chip8_jit_run_cycles(&jit, &jitted, 20) == 20);
+        assert(memcmp(jitted.V, cpu.V, sizeof(cpu.V)) == 0);
+        assert(jitted.I == cpu.I);
+        assert(jitted.PC == cpu.PC);
+        chip8_jit_free(&jit);
+    }
+}
+
+static void test_draw_wraps_and_collides(void)
+{
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    cpu.V[0] = 62;
+    cpu.V[1] = 30;
+    cpu.I = 0; // "0": f0 90 90 90 f0
+
+    chip8_exec(&cpu, 0xd015);
+    assert(cpu.V[0xf] == 0);
+    assert(chip8_pixel(&cpu, 62, 30) && chip8_pixel(&cpu, 63, 30));
+    assert(chip8_pixel(&cpu, 0, 30) && chip8_pixel(&cpu, 1, 30));
+    assert(!chip8_pixel(&cpu, 2, 30) && !chip8_pixel(&cpu, 61, 30));
+    assert(chip8_pixel(&cpu, 62, 31) && !chip8_pixel(&cpu, 63, 31) && chip8_pixel(&cpu, 1, 31));
+    assert(chip8_pixel(&cpu, 62, 0) && chip8_pixel(&cpu, 1, 2));
+    assert(cpu.display[3] == 0);
+
+    chip8_exec(&cpu, 0xd015);
+    assert(cpu.V[0xf] == 1);
+    for (int row = 0; row < 32; row++) {
+        assert(cpu.display[row] == 0);
+    }
+}
+
+static void test_dirty_rows(void)
+{
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    cpu.V[0] = 0;
+    cpu.V[1] = 30;
+    cpu.I = 0;
+
+    chip8_exec(&cpu, 0xd015);
+    assert(chip8_take_dirty_rows(&cpu) == (0x3u << 30 | 0x7u));
+    assert(cpu.frame_generation == 1);
+    assert(cpu.events & CHIP8_EVENT_DISPLAY);
+    assert(chip8_take_dirty_rows(&cpu) == 0);
+
+    // Clearing an already empty screen is not a change
+    cpu.I = 0;
+    chip8_exec(&cpu, 0xd015);
+    cpu.events = 0;
+    chip8_take_dirty_rows(&cpu);
+    chip8_exec(&cpu, 0x00e0);
+    assert(chip8_take_dirty_rows(&cpu) == 0);
+    assert(cpu.frame_generation == 2);
+    assert(!(cpu.events & CHIP8_EVENT_DISPLAY));
+}
+
+static float pool_reward(const Chip8 *cpu, void *user)
+{
+    (void)user;
+    return cpu->V[3];
+}
+
+// A pool spread over several threads must end up exactly where a single thread does
+static void test_pool(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0x3f, // 0x200: RND V0, 0x3f
+        0xa0, 0x00, // 0x202: LD I, 0x000
+        0xd0, 0x15, // 0x204: DRW V0, V1, 5
+        0x62, 0x05, // 0x206: LD V2, 0x05
+        0xe2, 0x9e, // 0x208: SKP V2
+        0x12, 0x0e, // 0x20a: JP 0x20e
+        0x73, 0x01, // 0x20c: ADD V3, 0x01
+        0x12, 0x00, // 0x20e: JP 0x200
+    };
+    enum { COUNT = 37 };
+    uint16_t actions[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        actions[i] = i % 2 ? 1 << 5 : 0;
+    }
+
+    static Chip8_Pool serial, parallel;
+    assert(chip8_pool_init(&serial, COUNT, 1, (char*)rom, sizeof(rom)));
+    assert(chip8_pool_init(&parallel, COUNT, 4, (char*)rom, sizeof(rom)));
+    serial.reward = pool_reward;
+    parallel.reward = pool_reward;
+
+    static Chip8_Arena_Worker a, b;
+    chip8_arena_worker_init(&a);
+    chip8_arena_worker_init(&b);
+    float serial_rewards[COUNT], parallel_rewards[COUNT];
+    for (int step = 0; step < 3; step++) {
+        chip8_pool_step(&serial, actions, 10, serial_rewards);
+        chip8_pool_step(&parallel, actions, 10, parallel_rewards);
+        for (int i = 0; i < COUNT; i++) {
+            assert(serial_rewards[i] == parallel_rewards[i]);
+            assert(memcmp(chip8_pool_display(&serial, i), chip8_pool_display(&parallel, i), sizeof(a.cpu.display)) == 0);
+            chip8_arena_load(&serial.arena, i, &a);
+            chip8_arena_load(&parallel.arena, i, &b);
+            assert(chip8_state_hash(&a.cpu) == chip8_state_hash(&b.cpu));
+        }
+    }
+    // 10 frames of 5 cycles each per step, only instances holding key 5 score
+    chip8_arena_load(&parallel.arena, 0, &a);
+    chip8_arena_load(&parallel.arena, 1, &b);
+    assert(a.cpu.cycles == 3*10*5);
+    assert(a.cpu.V[3] == 0 && b.cpu.V[3] > 0);
+    assert(memcmp(chip8_pool_display(&parallel, 0), chip8_pool_display(&parallel, 2), sizeof(a.cpu.display)) != 0);
+    // Nothing in the ROM writes memory, every page is shared
+    assert(parallel.arena.private_count == 0);
+
+    chip8_pool_free(&serial);
+    chip8_pool_free(&parallel);
+}
+
+static void arena_reset(Chip8 *cpu, const uint8_t *rom, size_t size)
+{
+    memset(cpu, 0, sizeof(*cpu));
+    chip8_load_sprites(cpu);
+    chip8_load_rom(cpu, (char*)rom, size);
+}
+
+// Instances switched in and out of one worker must run exactly like instances of their own
+static void test_arena(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0xff, // 0x200: RND V0, 0xff
+        0xa3, 0x00, // 0x202: LD I, 0x300
+        0xf0, 0x33, // 0x204: LD B, V0 (writes page 3)
+        0x71, 0x01, // 0x206: ADD V1, 0x01
+        0x12, 0x00, // 0x208: JP 0x200
+    };
+    static Chip8_Arena arena;
+    static Chip8_Arena_Worker worker, check;
+    static Chip8 refs[3];
+    chip8_arena_worker_init(&worker);
+    chip8_arena_worker_init(&check);
+    assert(chip8_arena_init(&arena, 4, 0));
+    arena_reset(&worker.cpu, rom, sizeof(rom));
+    assert(chip8_arena_share(&arena, &worker));
+    uint32_t shared = arena.shared_count;
+    for (uint32_t i = 0; i < 3; i++) {
+        assert(chip8_arena_new(&arena) == i);
+        chip8_seed(&worker.cpu, i + 1);
+        assert(chip8_arena_store(&arena, i, &worker));
+        arena_reset(&refs[i], rom, sizeof(rom));
+        chip8_seed(&refs[i], i + 1);
+    }
+    assert(arena.private_count == 0);
+
+    for (int round = 0; round < 20; round++) {
+        for (uint32_t i = 0; i < 3; i++) {
+            chip8_arena_load(&arena, i, &worker);
+            chip8_run_cycles(&worker.cpu, 37);
+            assert(chip8_arena_store(&arena, i, &worker));
+            chip8_run_cycles(&refs[i], 37);
+            chip8_arena_load(&arena, i, &check);
+            assert(chip8_state_hash(&check.cpu) == chip8_state_hash(&refs[i]));
+        }
+    }
+    assert(arena.private_count == 3);
+
+    // Freed slots and pages are reused, the fresh instance shares every page again
+    chip8_arena_free(&arena, 1);
+    assert(arena.count == 2 && arena.private_count == 2);
+    arena_reset(&worker.cpu, rom, sizeof(rom));
+    assert(chip8_arena_share(&arena, &worker));
+    assert(arena.shared_count == shared);
+    assert(chip8_arena_new(&arena) == 1);
+    assert(chip8_arena_store(&arena, 1, &worker));
+    assert(arena.private_count == 2 && arena.private_used == 3);
+
+    // A write that leaves the page as it was keeps it shared
+    chip8_exec(&worker.cpu, 0x6000); // LD V0, 0x00
+    chip8_exec(&worker.cpu, 0xa300); // LD I, 0x300
+    chip8_exec(&worker.cpu, 0xf055); // LD [I], V0
+    assert(worker.cpu.written_pages == 1u << 3);
+    assert(chip8_arena_store(&arena, 1, &worker));
+    assert(arena.private_count == 2);
+    chip8_arena_free_all(&arena);
+
+    // Out of budget the instance is left as it was
+    assert(chip8_arena_init(&arena, 1, sizeof(arena) + sizeof(Chip8_Arena_Slot) + 64*(sizeof(Chip8_Arena_Page) + sizeof(uint64_t))));
+    arena_reset(&worker.cpu, rom, sizeof(rom));
+    assert(chip8_arena_share(&arena, &worker));
+    assert(chip8_arena_new(&arena) == 0);
+    assert(chip8_arena_store(&arena, 0, &worker));
+    uint64_t before = chip8_state_hash(&worker.cpu);
+    chip8_arena_load(&arena, 0, &worker);
+    chip8_run_cycles(&worker.cpu, 3);
+    assert(!chip8_arena_store(&arena, 0, &worker));
+    chip8_arena_load(&arena, 0, &check);
+    assert(chip8_state_hash(&check.cpu) == before);
+    assert(arena.private_count == 0 && arena.chunk_count == 0);
+    chip8_arena_free_all(&arena);
+}
+
+static void test_lockstep(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0x0f, // 0x200: RND V0, 0x0f
+        0x80, 0x14, // 0x202: ADD V0, V1
+        0x81, 0x06, // 0x204: SHR V1
+        0x71, 0x03, // 0x206: ADD V1, 0x03
+        0xa3, 0x00, // 0x208: LD I, 0x300
+        0xf0, 0x33, // 0x20a: LD B, V0
+        0xd2, 0x35, // 0x20c: DRW V2, V3, 5
+        0xe0, 0x9e, // 0x20e: SKP V0
+        0x12, 0x00, // 0x210: JP 0x200
+        0x72, 0x01, // 0x212: ADD V2, 0x01
+        0x12, 0x00, // 0x214: JP 0x200
+    };
+    static Chip8_Lockstep group;
+    static Chip8 scalar[LOCKSTEP_LANES];
+    chip8_lockstep_load_rom(&group, (char*)rom, sizeof(rom));
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        Chip8 *cpu = &scalar[lane];
+        memset(cpu, 0, sizeof(*cpu));
+        chip8_load_sprites(cpu);
+        chip8_load_rom(cpu, (char*)rom, sizeof(rom));
+        chip8_seed(cpu, (uint32_t)(lane + 1) * 0x9e3779b9u);
+    }
+
+    // The last runs execute the lanes separately, which must not change anything either
+    for (int run = 0; run < 8; run++) {
+        if (run == 6) group.separate_runs = 2;
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_set_keys(&scalar[lane], 1u << ((run + lane) % 16));
+            chip8_set_keys(&group.lanes[lane], 1u << ((run + lane) % 16));
+        }
+        assert(chip8_lockstep_run_cycles(&group, 500) == 500);
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_run_cycles(&scalar[lane], 500);
+            Chip8 cpu;
+            chip8_lockstep_get(&group, lane, &cpu);
+            assert(memcmp(cpu.V, scalar[lane].V, sizeof(cpu.V)) == 0);
+            assert(cpu.I == scalar[lane].I && cpu.PC == scalar[lane].PC);
+            assert(cpu.delay_timer == scalar[lane].delay_timer && cpu.rng_state == scalar[lane].rng_state);
+            assert(cpu.cycles == scalar[lane].cycles);
+            assert(memcmp(cpu.memory, scalar[lane].memory, sizeof(cpu.memory)) == 0);
+            assert(memcmp(cpu.display, scalar[lane].display, sizeof(cpu.display)) == 0);
+        }
+    }
+    // Lanes pressed different keys, so they can't all have taken the same path
+    assert(memcmp(scalar[0].display, scalar[1].display, sizeof(scalar[0].display)) != 0 ||
+           scalar[0].V[2] != scalar[1].V[2]);
+
+    // Every lane polls its own delay timer, the lanes skip together up to the first that is done
+    uint8_t poll[] = {
+        0xc0, 0x0f, // 0x200: RND V0, 0x0f
+        0x70, 0x10, // 0x202: ADD V0, 0x10
+        0xf0, 0x15, // 0x204: LD DT, V0
+        0xf1, 0x07, // 0x206: LD V1, DT
+        0x31, 0x00, // 0x208: SE V1, 0x00
+        0x12, 0x06, // 0x20a: JP 0x206
+        0x72, 0x01, // 0x20c: ADD V2, 0x01
+        0x12, 0x00, // 0x20e: JP 0x200
+    };
+    chip8_lockstep_load_rom(&group, (char*)poll, sizeof(poll));
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        Chip8 *cpu = &scalar[lane];
+        memset(cpu, 0, sizeof(*cpu));
+        chip8_load_sprites(cpu);
+        chip8_load_rom(cpu, (char*)poll, sizeof(poll));
+        chip8_seed(cpu, (uint32_t)(lane + 1) * 0x9e3779b9u);
+    }
+    uint64_t skipped = 0;
+    for (int run = 0; run < 20; run++) {
+        assert(chip8_lockstep_run_cycles(&group, 1000) == 1000);
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_run_cycles(&scalar[lane], 1000);
+            Chip8 cpu;
+            chip8_lockstep_get(&group, lane, &cpu);
+            assert(memcmp(cpu.V, scalar[lane].V, sizeof(cpu.V)) == 0);
+            assert(cpu.PC == scalar[lane].PC && cpu.delay_timer == scalar[lane].delay_timer);
+            assert(cpu.cycles == scalar[lane].cycles && cpu.timer_phase == scalar[lane].timer_phase);
+        }
+    }
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        skipped += group.lanes[lane].skipped_cycles;
+    }
+    assert(skipped > 0);
+}
+
+static void test_trace(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0x0f, // 0x200: RND V0, 0x0f
+        0xe0, 0x9e, // 0x202: SKP V0
+        0x12, 0x00, // 0x204: JP 0x200
+        0x71, 0x01, // 0x206: ADD V1, 0x01
+        0xd1, 0x05, // 0x208: DRW V1, V0, 5
+        0x12, 0x00, // 0x20a: JP 0x200
+    };
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    chip8_seed(&cpu, 1234);
+
+    // Mash every key in turn the way a frontend would between chip8_run_for calls
+    Chip8_Trace trace;
+    chip8_trace_begin(&trace, &cpu, (char*)rom, sizeof(rom));
+    for (int frame = 0; frame < 200; frame++) {
+        chip8_run_for(&cpu, 16);
+        uint8_t key = frame % 16;
+        bool pressed = frame % 3 != 0;
+        chip8_set_key(&cpu, key, pressed);
+        chip8_trace_key(&trace, &cpu, key, pressed);
+    }
+    chip8_run_for(&cpu, 16);
+    chip8_trace_end(&trace, &cpu);
+    assert(cpu.V[1] != 0);
+
+    Chip8 replay;
+    uint64_t keys = 0;
+    assert(chip8_trace_replay(trace.data, trace.size, &replay, (char*)rom, sizeof(rom), &keys) == NULL);
+    assert(keys == 200);
+    assert(replay.cycles == cpu.cycles);
+    assert(chip8_state_hash(&replay) == chip8_state_hash(&cpu));
+    assert(memcmp(replay.display, cpu.display, sizeof(cpu.display)) == 0);
+
+    // Turning the first release into a press gives the ROM one more key to count
+    trace.data[TRACE_HEADER_SIZE] ^= 1 << 4;
+    assert(chip8_trace_replay(trace.data, trace.size, &replay, (char*)rom, sizeof(rom), NULL) != NULL);
+    trace.data[TRACE_HEADER_SIZE] ^= 1 << 4;
+
+    rom[1] = 0x07;
+    assert(chip8_trace_replay(trace.data, trace.size, &replay, (char*)rom, sizeof(rom), NULL) != NULL);
+    chip8_trace_free(&trace);
+}
+
+static void test_snapshot(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0x0f, // 0x200: RND V0, 0x0f
+        0xe0, 0x9e, // 0x202: SKP V0
+        0x12, 0x00, // 0x204: JP 0x200
+        0x71, 0x01, // 0x206: ADD V1, 0x01
+        0xa6, 0x00, // 0x208: LD I, 0x600
+        0xf1, 0x55, // 0x20a: LD [I], V0..V1
+        0xd1, 0x05, // 0x20c: DRW V1, V0, 5
+        0x12, 0x00, // 0x20e: JP 0x200
+    };
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    chip8_seed(&cpu, 99);
+    chip8_run_cycles(&cpu, 100);
+
+    Chip8_Snapshot root, child[16];
+    assert(chip8_snapshot(&cpu, NULL, &root));
+    uint64_t root_hash = chip8_state_hash(&cpu);
+
+    // Try every key from the root, each branch only writes the page holding 0x600
+    uint64_t hashes[16];
+    for (int key = 0; key < 16; key++) {
+        chip8_restore(&cpu, &root, key == 0 ? &root : &child[key - 1]);
+        assert(chip8_state_hash(&cpu) == root_hash);
+        chip8_set_key(&cpu, key, true);
+        chip8_run_cycles(&cpu, 200);
+        hashes[key] = chip8_state_hash(&cpu);
+        assert(chip8_snapshot(&cpu, &root, &child[key]));
+        for (int p = 0; p < CHIP8_PAGES; p++) {
+            if (p != 0x600/CHIP8_PAGE_SIZE) assert(child[key].pages[p] == root.pages[p]);
+        }
+    }
+    assert(child[0].pages[0x600/CHIP8_PAGE_SIZE] != root.pages[0x600/CHIP8_PAGE_SIZE]);
+    assert(hashes[0] != hashes[1]);
+
+    // A fork is as good as the original, also after the original is gone
+    Chip8_Snapshot fork;
+    chip8_fork(&child[3], &fork);
+    chip8_snapshot_free(&child[3]);
+    chip8_restore(&cpu, &fork, &child[15]);
+    assert(chip8_state_hash(&cpu) == hashes[3]);
+
+    // Same answer from a fresh instance, restoring without a current snapshot
+    static Chip8 fresh;
+    chip8_restore(&fresh, &child[7], NULL);
+    assert(chip8_state_hash(&fresh) == hashes[7]);
+    chip8_run_cycles(&fresh, 50);
+    chip8_restore(&cpu, &child[7], &fork);
+    chip8_run_cycles(&cpu, 50);
+    assert(chip8_state_hash(&cpu) == chip8_state_hash(&fresh));
+
+    static uint8_t buffer[SNAPSHOT_MAX_SIZE];
+    size_t size = chip8_snapshot_serialize(&fork, buffer);
+    assert(size < SNAPSHOT_MAX_SIZE);
+    Chip8_Snapshot loaded;
+    assert(chip8_snapshot_deserialize(buffer, size, &loaded) == NULL);
+    chip8_restore(&fresh, &loaded, NULL);
+    assert(chip8_state_hash(&fresh) == hashes[3]);
+    chip8_snapshot_free(&loaded);
+    assert(chip8_snapshot_deserialize(buffer, size - 1, &loaded) != NULL);
+    buffer[4] += 1;
+    assert(chip8_snapshot_deserialize(buffer, size, &loaded) != NULL);
+
+    // The quirk profile travels with the snapshot
+    cpu.profile = CHIP8_PROFILE_XOCHIP;
+    Chip8_Snapshot quirky;
+    assert(chip8_snapshot(&cpu, NULL, &quirky));
+    size = chip8_snapshot_serialize(&quirky, buffer);
+    chip8_snapshot_free(&quirky);
+    assert(chip8_snapshot_deserialize(buffer, size, &loaded) == NULL);
+    static Chip8 other;
+    chip8_restore(&other, &loaded, NULL);
+    assert(other.profile == CHIP8_PROFILE_XOCHIP);
+    chip8_snapshot_free(&loaded);
+
+    chip8_snapshot_free(&root);
+    chip8_snapshot_free(&fork);
+    for (int key = 0; key < 16; key++) {
+        chip8_snapshot_free(&child[key]);
+    }
+}
+
+static void test_rewind(void)
+{
+    uint8_t rom[] = {
+        0xc0, 0xff, // 0x200: RND V0, 0xff
+        0xa4, 0x00, // 0x202: LD I, 0x400
+        0xf1, 0x1e, // 0x204: ADD I, V1
+        0xf0, 0x33, // 0x206: LD B, V0
+        0x71, 0x03, // 0x208: ADD V1, 0x03
+        0xd0, 0x13, // 0x20a: DRW V0, V1, 3
+        0x12, 0x00, // 0x20c: JP 0x200
+    };
+    static Chip8 cpu;
+    chip8_load_sprites(&cpu);
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+
+    // Small enough that the oldest states get dropped
+    enum { FRAMES = 3000 };
+    static uint64_t hashes[FRAMES + 1];
+    static Chip8_Rewind rw;
+    assert(chip8_rewind_init(&rw, 64*1024));
+    cpu.stop_on = CHIP8_EVENT_FRAME;
+    for (int frame = 0; frame <= FRAMES; frame++) {
+        if (frame > 0) chip8_run_cycles(&cpu, 1000);
+        hashes[frame] = chip8_state_hash(&cpu);
+        chip8_rewind_push(&rw, &cpu);
+    }
+    assert(rw.count < FRAMES/2);
+    assert(chip8_rewind_entry(&rw, rw.first)->keyframe == rw.first);
+
+    // Halfway back, forward along a different path, then all the way back
+    size_t kept = rw.count;
+    for (size_t i = 1; i < kept/2; i++) {
+        assert(chip8_rewind_back(&rw, &cpu));
+        assert(chip8_state_hash(&cpu) == hashes[FRAMES - i]);
+    }
+    uint64_t resume = cpu.cycles / 5;
+    cpu.V[1] += 1;
+    for (int frame = 0; frame < 100; frame++) {
+        chip8_run_cycles(&cpu, 1000);
+        chip8_rewind_push(&rw, &cpu);
+    }
+    for (int frame = 0; frame < 100; frame++) {
+        assert(chip8_rewind_back(&rw, &cpu));
+    }
+    assert(chip8_state_hash(&cpu) == hashes[resume]);
+    while (chip8_rewind_back(&rw, &cpu)) {
+        resume -= 1;
+        assert(chip8_state_hash(&cpu) == hashes[resume]);
+    }
+    assert(resume == rw.first);
+    chip8_rewind_free(&rw);
+}
+
+static void test_idle_skip(void)
+{
+    uint8_t rom[] = {
+        0x60, 0x20, // 0x200: LD V0, 0x20
+        0xf0, 0x15, // 0x202: LD DT, V0
+        0xf1, 0x07, // 0x204: LD V1, DT
+        0x31, 0x00, // 0x206: SE V1, 0x00
+        0x12, 0x04, // 0x208: JP 0x204
+        0x72, 0x01, // 0x20a: ADD V2, 0x01
+        0xf3, 0x0a, // 0x20c: LD V3, K
+        0xe3, 0xa1, // 0x20e: SKNP V3
+        0x12, 0x0e, // 0x210: JP 0x20e
+        0x12, 0x00, // 0x212: JP 0x200
+    };
+
+    // Skipping must give exactly what executing one cycle at a time gives, at any clock rate.
+    // The JIT skips too, but overshoots frame events by the rest of a block.
+    static Chip8_Jit jit;
+    bool jit_ok = chip8_jit_init(&jit);
+    uint32_t rates[] = {300, 1000, 45};
+    for (int r = 0; r < 3; r++) {
+        for (int stop = 0; stop < 2; stop++) {
+            static Chip8 fast, slow, jitted;
+            memset(&fast, 0, sizeof(fast));
+            chip8_load_rom(&fast, (char*)rom, sizeof(rom));
+            fast.clock_rate = rates[r];
+            fast.stop_on = stop ? CHIP8_EVENT_FRAME : 0;
+            slow = fast;
+            jitted = fast;
+            if (jit_ok) chip8_jit_invalidate(&jit, 0, 0x1000);
+
+            bool idled = false, jit_idled = false;
+            for (int run = 0; run < 200; run++) {
+                if (run % 50 == 49 || (run % 50 == 9 && run > 50)) {
+                    // Held for 10 runs, the SKNP loop idles until it's released
+                    bool down = run % 50 == 49;
+                    int key = (down ? run : run - 10) % 16;
+                    chip8_set_key(&fast, key, down);
+                    chip8_set_key(&slow, key, down);
+                    chip8_set_key(&jitted, key, down);
+                }
+                uint32_t executed = chip8_run_cycles(&fast, 777);
+                idled |= (fast.events & CHIP8_EVENT_IDLE) != 0;
+                uint32_t stepped = 0;
+                while (stepped < 777) {
+                    stepped += chip8_run_cycles(&slow, 1);
+                    if (slow.events & slow.stop_on) break;
+                }
+                assert(executed == stepped);
+                assert(chip8_state_hash(&fast) == chip8_state_hash(&slow));
+                if (jit_ok && !stop) {
+                    assert(chip8_jit_run_cycles(&jit, &jitted, 777) == 777);
+                    jit_idled |= (jitted.events & CHIP8_EVENT_IDLE) != 0;
+                    assert(chip8_state_hash(&jitted) == chip8_state_hash(&slow));
+                }
+            }
+            assert(jit_idled || !jit_ok || stop);
+            // Below 60 Hz every cycle ticks, so runs stopping on frames have nothing to skip
+            assert(idled || (stop && rates[r] < TIMER_RATE));
+            assert(fast.V[2] >= 3); // One per key press, plus the first pass
+        }
+    }
+
+    // Blocked on Fx0A right after a tick: the next one is 5 cycles, 16.7 ms away at 300 Hz
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    cpu.stop_on = CHIP8_EVENT_WAIT_KEY;
+    chip8_run_cycles(&cpu, 1000000);
+    assert(cpu.PC == 0x20c && cpu.timer_phase == 0);
+    assert(chip8_ms_until_tick(&cpu) == 17);
+    if (jit_ok) chip8_jit_free(&jit);
+}
+
+// Build with -fsanitize=thread (see build.sh) to have these check the memory ordering as well
+#define SPSC_COUNT 200000
+
+static void *input_producer(void *data)
+{
+    Chip8_Input_Queue *q = data;
+    for (uint32_t i = 0; i < SPSC_COUNT; i++) {
+        Chip8_Input input = {(uint8_t)i, (uint8_t)(i >> 8), (i >> 16) & 1, i, 0};
+        while (!chip8_input_push(q, input)) sched_yield();
+    }
+    return NULL;
+}
+
+static void test_input_queue(void)
+{
+    static Chip8_Input_Queue q;
+    chip8_input_init(&q);
+    Chip8_Input input = {0};
+    assert(!chip8_input_pop(&q, &input));
+    for (int i = 0; i < INPUT_QUEUE_SIZE; i++) {
+        assert(chip8_input_push(&q, input));
+    }
+    assert(!chip8_input_push(&q, input));
+    for (int i = 0; i < INPUT_QUEUE_SIZE; i++) {
+        assert(chip8_input_pop(&q, &input));
+    }
+    assert(!chip8_input_pop(&q, &input));
+
+    // Every event arrives once and in order, however the two threads interleave
+    pthread_t producer;
+    assert(pthread_create(&producer, NULL, input_producer, &q) == 0);
+    for (uint32_t i = 0; i < SPSC_COUNT; i++) {
+        while (!chip8_input_pop(&q, &input)) sched_yield();
+        assert(input.kind == (uint8_t)i && input.key == (uint8_t)(i >> 8) && input.pressed == ((i >> 16) & 1) && input.time == i);
+    }
+    pthread_join(producer, NULL);
+    assert(!chip8_input_pop(&q, &input));
+}
+
+static void *frame_producer(void *data)
+{
+    Chip8_Frame_Buffer *fb = data;
+    static Chip8 cpu;
+    for (uint32_t i = 1; i <= SPSC_COUNT; i++) {
+        cpu.cycles = i;
+        for (int row = 0; row < 32; row++) {
+            cpu.display[row] = (uint64_t)i*0x9e3779b97f4a7c15ull + row;
+        }
+        chip8_frames_publish(fb, &cpu);
+    }
+    return NULL;
+}
+
+static void test_frame_buffer(void)
+{
+    static Chip8_Frame_Buffer fb;
+    chip8_frames_init(&fb);
+    assert(chip8_frames_acquire(&fb) == NULL);
+
+    // Frames are never torn, never go back in time and the last one is never lost
+    pthread_t producer;
+    assert(pthread_create(&producer, NULL, frame_producer, &fb) == 0);
+    uint32_t last = 0, acquired = 0;
+    while (last < SPSC_COUNT) {
+        const Chip8_Frame *frame = chip8_frames_acquire(&fb);
+        if (!frame) {
+            sched_yield();
+            continue;
+        }
+        assert(frame->generation > last && frame->cycles == frame->generation);
+        for (int row = 0; row < 32; row++) {
+            assert(frame->display[row] == (uint64_t)frame->generation*0x9e3779b97f4a7c15ull + row);
+        }
+        last = frame->generation;
+        acquired += 1;
+    }
+    pthread_join(producer, NULL);
+    assert(acquired > 0 && chip8_frames_acquire(&fb) == NULL);
+}
+
+static void test_quirks(void)
+{
+    static uint8_t rom[0x38] = {
+        0x60, 0x81, // 0x200: LD V0, 0x81
+        0x61, 0x0c, // 0x202: LD V1, 0x0c
+        0x89, 0x16, // 0x204: SHR V9, V1
+        0x83, 0x0e, // 0x206: SHL V3, V0
+        0x6f, 0x07, // 0x208: LD VF, 0x07
+        0x84, 0x01, // 0x20a: OR V4, V0
+        0x85, 0xf0, // 0x20c: LD V5, VF
+        0xa3, 0x00, // 0x20e: LD I, 0x300
+        0xf1, 0x55, // 0x210: LD [I], V1
+        0xf1, 0x65, // 0x212: LD V1, [I]
+        0x66, 0x3e, // 0x214: LD V6, 62
+        0x67, 0x1e, // 0x216: LD V7, 30
+        0xa0, 0x00, // 0x218: LD I, 0x000
+        0xd6, 0x75, // 0x21a: DRW V6, V7, 5
+        0x60, 0x00, // 0x21c: LD V0, 0x00
+        0x62, 0x04, // 0x21e: LD V2, 0x04
+        0xb2, 0x30, // 0x220: JP V0, 0x230
+    };
+    rom[0x30] = 0x12; rom[0x31] = 0x30; // 0x230: JP 0x230, where BNNN lands with V0
+    rom[0x34] = 0x12; rom[0x35] = 0x34; // 0x234: JP 0x234, where BXNN lands with V2
+
+    assert(chip8_rom_profile((char*)rom, sizeof(rom)) == CHIP8_PROFILE_DEFAULT);
+    assert(chip8_profile_by_name("schip") == CHIP8_PROFILE_SCHIP);
+    assert(chip8_profile_by_name("schip8") == -1 && chip8_profile_by_name("") == -1);
+
+    // 8XY5/8XY7 set VF when nothing is borrowed, equal operands included
+    Chip8 sub = {0};
+    sub.V[1] = sub.V[2] = 7;
+    chip8_exec(&sub, 0x8125); // V1 -= V2
+    assert(sub.V[1] == 0 && sub.V[0xf] == 1);
+    sub.V[3] = sub.V[4] = 5;
+    chip8_exec(&sub, 0x8347); // V3 = V4 - V3
+    assert(sub.V[3] == 0 && sub.V[0xf] == 1);
+    chip8_exec(&sub, 0x8125); // V1 -= V2 with V1 < V2
+    assert(sub.V[1] == 0xf9 && sub.V[0xf] == 0);
+
+    for (int profile = 0; profile < CHIP8_PROFILE_COUNT; profile++) {
+        uint32_t quirks = chip8_profile_quirks[profile];
+        static Chip8 cpu;
+        memset(&cpu, 0, sizeof(cpu));
+        chip8_load_sprites(&cpu);
+        chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+        cpu.profile = profile;
+        chip8_run_cycles(&cpu, 40);
+
+        assert(cpu.V[9] == ((quirks & CHIP8_QUIRK_SHIFT_VY) ? 0x06 : 0x00));
+        assert(cpu.V[3] == ((quirks & CHIP8_QUIRK_SHIFT_VY) ? 0x02 : 0x00));
+        assert(cpu.V[5] == ((quirks & CHIP8_QUIRK_VF_RESET) ? 0x00 : 0x07));
+        assert(cpu.V[1] == ((quirks & CHIP8_QUIRK_LOAD_STORE_I) ? 0x00 : 0x0c)); // Read back from 0x302 or 0x300
+        assert(chip8_pixel(&cpu, 62, 30) && chip8_pixel(&cpu, 62, 31));
+        assert(chip8_pixel(&cpu, 1, 0) == !(quirks & CHIP8_QUIRK_CLIP));  // Wrapped around both edges
+        assert(cpu.PC == ((quirks & CHIP8_QUIRK_JUMP_VX) ? 0x234 : 0x230));
+
+        // Backends that translate instructions themselves must leave the quirks to the interpreter
+        static Chip8_Jit jit;
+        if (chip8_jit_init(&jit)) {
+            static Chip8 jitted;
+            memset(&jitted, 0, sizeof(jitted));
+            chip8_load_sprites(&jitted);
+            chip8_load_rom(&jitted, (char*)rom, sizeof(rom));
+            jitted.profile = profile;
+            chip8_jit_run_cycles(&jit, &jitted, 40);
+            assert(chip8_state_hash(&jitted) == chip8_state_hash(&cpu));
+            chip8_jit_free(&jit);
+        }
+        static Chip8_Lockstep group;
+        chip8_lockstep_load_rom(&group, (char*)rom, sizeof(rom));
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            group.lanes[lane].profile = profile;
+        }
+        chip8_lockstep_run_cycles(&group, 40);
+        static Chip8 lane;
+        chip8_lockstep_get(&group, 5, &lane);
+        assert(memcmp(lane.V, cpu.V, sizeof(cpu.V)) == 0 && lane.I == cpu.I && lane.PC == cpu.PC);
+        assert(memcmp(lane.display, cpu.display, sizeof(cpu.display)) == 0);
+    }
+
+    // Traces carry the profile, replaying one recorded with another profile than the ROM's own
+    static Chip8 cpu;
+    memset(&cpu, 0, sizeof(cpu));
+    chip8_load_sprites(&cpu);
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    chip8_seed(&cpu, 0);
+    cpu.profile = CHIP8_PROFILE_SCHIP;
+    Chip8_Trace trace;
+    chip8_trace_begin(&trace, &cpu, (char*)rom, sizeof(rom));
+    chip8_run_cycles(&cpu, 40);
+    chip8_trace_end(&trace, &cpu);
+    static Chip8 replayed;
+    assert(chip8_trace_replay(trace.data, trace.size, &replayed, (char*)rom, sizeof(rom), NULL) == NULL);
+    assert(replayed.profile == CHIP8_PROFILE_SCHIP && replayed.PC == 0x234);
+    chip8_trace_free(&trace);
+}
+
+#ifdef CHIP8_PROFILING
+static void test_profiling(void)
+{
+    uint8_t rom[] = {
+        0x60, 0x05, // 0x200: LD V0, 0x05
+        0xf0, 0x29, // 0x202: LD F, V0
+        0x22, 0x08, // 0x204: CALL 0x208
+        0xf1, 0x0a, // 0x206: LD V1, K
+        0xd0, 0x05, // 0x208: DRW V0, V0, 5
+        0xd0, 0x05, // 0x20a: DRW V0, V0, 5
+        0x00, 0xee, // 0x20c: RET
+    };
+    static Chip8_Profiling prof;
+    Chip8 cpu = {0};
+    chip8_load_sprites(&cpu);
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    cpu.profiling = &prof;
+    assert(chip8_run_cycles(&cpu, 100) == 100);
+
+    assert(prof.ops[CHIP8_OP_LD_IMM] == 1 && prof.ops[CHIP8_OP_CALL] == 1 && prof.ops[CHIP8_OP_RET] == 1);
+    assert(prof.ops[CHIP8_OP_DRW] == 2 && prof.pcs[0x208] == 1 && prof.pcs[0x20a] == 1);
+    assert(prof.routines[0x20a] == 0x208 && prof.routines[0x20c] == 0x208 && prof.routines[0x206] == 0);
+    // The "5" sprite has 14 pixels, the second draw erases them all again
+    assert(prof.draws == 2 && prof.pixels == 28 && prof.collisions == 1);
+    // Every cycle after the RET waits on Fx0A, whether it was executed or fast-forwarded
+    assert(prof.wait_key_cycles == 94 && prof.idle_cycles > 0);
+    assert(prof.pcs[0x206] + prof.idle_cycles == 94);
+
+    const char *json_path = "/tmp/chip8_test_profile.json";
+    const char *folded_path = "/tmp/chip8_test_profile.folded";
+    assert(chip8_profile_dump(&prof, &cpu, json_path, folded_path));
+    char text[4096];
+    FILE *f = fopen(folded_path, "r");
+    assert(f);
+    size_t len = fread(text, 1, sizeof(text) - 1, f);
+    text[len] = 0;
+    fclose(f);
+    assert(strstr(text, "main;0x204 CALL 0x208 1\n"));
+    assert(strstr(text, "sub_0x208;0x20a "));
+    assert(strstr(text, "\nidle "));
+    f = fopen(json_path, "r");
+    assert(f);
+    len = fread(text, 1, sizeof(text) - 1, f);
+    text[len] = 0;
+    fclose(f);
+    assert(strstr(text, "\"DRW\": 2") && strstr(text, "\"collisions\": 1"));
+    remove(json_path);
+    remove(folded_path);
+}
+#endif
+
+static void test_exec_trace(void)
+{
+    uint8_t rom[] = {
+        0x60, 0xfe, // 0x200: LD V0, 0xfe
+        0x70, 0x01, // 0x202: ADD V0, 0x01
+        0xa2, 0x00, // 0x204: LD I, 0x200
+        0x80, 0x04, // 0x206: ADD V0, V0
+        0x12, 0x02, // 0x208: JP 0x202
+    };
+    static Chip8 traced, plain;
+    memset(&traced, 0, sizeof(traced));
+    chip8_load_rom(&traced, (char*)rom, sizeof(rom));
+    plain = traced;
+
+    const char *path = "/tmp/chip8_test.c8x";
+    traced.exec_trace = chip8_exec_trace_open(path, 6, &traced); // Rounded up to 8
+    assert(traced.exec_trace && traced.exec_trace->mask == 7);
+    assert(chip8_run_cycles(&traced, 20) == 20);
+    assert(chip8_run_cycles(&plain, 20) == 20);
+    assert(chip8_state_hash(&traced) == chip8_state_hash(&plain));
+    chip8_exec_trace_close(traced.exec_trace);
+
+    uint8_t profile = 0xff;
+    const char *error = NULL;
+    const Chip8_Exec_Trace *trace = chip8_exec_trace_map(path, &profile, &error);
+    assert(trace && profile == CHIP8_PROFILE_DEFAULT);
+    assert(trace->count == 20 && trace->mask == 7);
+    // Cycles 12..19 are kept, from 0x208 on through the loop twice
+    const Chip8_Exec_Record *r = &trace->records[12 & 7];
+    assert(r->cycle == 12 && r->pc == 0x208 && r->inst == 0x1202 && r->reg == CHIP8_EXEC_NO_REG);
+    r = &trace->records[13 & 7];
+    assert(r->cycle == 13 && r->pc == 0x202 && r->reg == 0);
+    uint8_t v0 = r->value;
+    r = &trace->records[14 & 7];
+    assert(r->pc == 0x204 && r->inst == 0xa200 && r->I == 0x200 && r->reg == CHIP8_EXEC_NO_REG);
+    r = &trace->records[15 & 7];
+    assert(r->pc == 0x206 && r->inst == 0x8004);
+    assert(r->reg == 0 ? r->value == (uint8_t)(2*v0) : r->reg == 0xf); // Only VF when V0 doubles to itself
+    r = &trace->records[19 & 7];
+    assert(r->cycle == 19 && r->pc == 0x206);
+    chip8_exec_trace_unmap(trace);
+
+    FILE *f = fopen(path, "r+b");
+    assert(f && fputc('X', f) == 'X');
+    fclose(f);
+    assert(chip8_exec_trace_map(path, NULL, &error) == NULL && error != NULL);
+    remove(path);
+}
+
+static void test_call_stack(void)
+{
+    uint8_t rom[] = {
+        0x22, 0x04, // 0x200: CALL 0x204
+        0x00, 0x00,
+        0x22, 0x04, // 0x204: CALL 0x204, recursing for ever
+    };
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    uint8_t profile = cpu.profile;
+    chip8_run_cycles(&cpu, MAX_SUBROUTINES + 8);
+
+    // Frames past MAX_SUBROUTINES wrap around the ring instead of running over the fields after it
+    assert(cpu.stack_pointer == MAX_SUBROUTINES + 8 && cpu.PC == 0x204);
+    assert(cpu.clock_rate == 0 && cpu.profile == profile);
+    assert(cpu.call_stack[0] == 0x204 && cpu.call_stack[MAX_SUBROUTINES - 1] == 0x204);
+    chip8_exec(&cpu, 0x00ee);
+    assert(cpu.stack_pointer == MAX_SUBROUTINES + 7 && cpu.PC == 0x206);
+}
+
+// Executes `cpu` one instruction at a time with chip8_exec up to cycle `until`, which never fuses.
+// Stops early, like a run with stop_on, after the first cycle raising one of `stop_on`.
+static void reference_run(Chip8 *cpu, uint64_t until, uint32_t stop_on)
+{
+    cpu->events = 0;
+    while (cpu->cycles < until && !(cpu->events & stop_on)) {
+        chip8_exec(cpu, chip8_fetch(cpu, cpu->PC));
+        chip8_tick(cpu, chip8_clock_rate(cpu));
+    }
+}
+
+static void test_fusion(void)
+{
+    uint8_t rom[] = {
+        0x60, 0x00, // 0x200: LD V0, 0
+        0x61, 0x05, // 0x202: LD V1, 5          LD_IMM2
+        0x70, 0x01, // 0x204: ADD V0, 1
+        0x30, 0x0a, // 0x206: SE V0, 10
+        0x12, 0x04, // 0x208: JP 0x204          ADD_SE_JP
+        0xa2, 0x1c, // 0x20a: LD I, 0x21c
+        0xd1, 0x11, // 0x20c: DRW V1, V1, 1     LD_I_DRW
+        0x63, 0x05, // 0x20e: LD V3, 5
+        0xf3, 0x15, // 0x210: LD DT, V3
+        0xf4, 0x07, // 0x212: LD V4, DT
+        0x34, 0x00, // 0x214: SE V4, 0
+        0x12, 0x12, // 0x216: JP 0x212          DT_SE_JP
+        0x34, 0x01, // 0x218: SE V4, 1
+        0x12, 0x1a, // 0x21a: JP 0x21a          SKIP_JP
+        0x80, 0x00, // 0x21c: sprite
+    };
+
+    // Every chunk size and stopping on frames ends each run in the state unfused execution reaches
+    for (uint32_t chunk = 1; chunk <= 8; chunk++) {
+        for (int stop = 0; stop < 2; stop++) {
+            Chip8 cpu = {0}, ref = {0};
+            chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+            chip8_load_rom(&ref, (char*)rom, sizeof(rom));
+            cpu.stop_on = stop ? CHIP8_EVENT_FRAME : 0;
+            while (cpu.cycles < 200) {
+                uint32_t executed = chip8_run_cycles(&cpu, chunk);
+                reference_run(&ref, ref.cycles + chunk, cpu.stop_on);
+                assert(executed <= chunk && cpu.cycles == ref.cycles);
+                assert(chip8_state_hash(&cpu) == chip8_state_hash(&ref));
+                assert((cpu.events & ~CHIP8_EVENT_IDLE) == ref.events);
+            }
+            assert(cpu.V[0] == 10 && cpu.V[4] == 0 && cpu.PC == 0x21a && chip8_pixel(&cpu, 5, 5));
+            if (chunk == 8 && !stop) assert(cpu.dispatches < cpu.cycles);
+        }
+    }
+
+    // Rewriting the SE in the middle of the ADD_SE_JP at 0x204 drops it from the cache
+    Chip8 cpu = {0};
+    chip8_load_rom(&cpu, (char*)rom, sizeof(rom));
+    chip8_run_cycles(&cpu, 200);
+    cpu.memory[0x207] = 0x14;
+    chip8_invalidate(&cpu, 0x207, 1);
+    cpu.PC = 0x204;
+    chip8_run_cycles(&cpu, 3*10 - 1 + 2);
+    assert(cpu.V[0] == 20 && cpu.PC == 0x20e);
+}
+
+static void test_rom_cache(void)
+{
+    // Larger than memory from 0x200 on: rejected, nothing written
+    static char big[MAX_ROM_SIZE + 1];
+    memset(big, 0x12, sizeof(big));
+    static Chip8 cpu;
+    memset(&cpu, 0, sizeof(cpu));
+    assert(!chip8_load_rom(&cpu, big, sizeof(big)));
+    assert(cpu.PC == 0 && cpu.memory[0x200] == 0 && cpu.memory[0xfff] == 0);
+    assert(chip8_load_rom(&cpu, big, MAX_ROM_SIZE) && cpu.memory[0xfff] == 0x12);
+
+    uint8_t rom[] = {
+        0x60, 0x00, // 0x200: LD V0, 0
+        0x61, 0x05, // 0x202: LD V1, 5
+        0x22, 0x0a, // 0x204: CALL 0x20a
+        0x12, 0x04, // 0x206: JP 0x204
+        0x12, 0x34, // 0x208: data, never reached
+        0x70, 0x01, // 0x20a: ADD V0, 1
+        0x00, 0xee, // 0x20c: RET
+    };
+    const char *dir = "/tmp/chip8_test_cache";
+    const char *path = "/tmp/chip8_test_cache/rom.ch8";
+    mkdir(dir, 0755);
+    FILE *f = fopen(path, "wb");
+    assert(f && fwrite(rom, 1, sizeof(rom), f) == sizeof(rom) && fclose(f) == 0);
+    setenv("CHIP8_CACHE_DIR", dir, 1);
+
+    static Chip8 cold, warm, plain;
+    static Chip8_Rom cold_rom, warm_rom;
+    memset(&cold, 0, sizeof(cold));
+    memset(&warm, 0, sizeof(warm));
+    memset(&plain, 0, sizeof(plain));
+    chip8_rom_load(&cold, path, &cold_rom);
+    chip8_rom_load(&warm, path, &warm_rom);
+    chip8_load_rom(&plain, (char*)rom, sizeof(rom));
+    assert(!cold_rom.cached && warm_rom.cached);
+
+    const uint8_t *reachable = warm_rom.analysis.reachable;
+    assert(reachable[0x200 >> 3] == 0x55 && reachable[0x208 >> 3] == 0x14); // 0x200-0x206, 0x20a, 0x20c
+    assert(warm.profile == plain.profile);
+    assert(memcmp(warm.decoded, cold.decoded, sizeof(warm.decoded)) == 0);
+    assert(warm.decoded[0x200 >> 1].op == CHIP8_OP_LD_IMM2 && warm.decoded[0x208 >> 1].op == CHIP8_OP_UNDECODED);
+    assert(chip8_run_cycles(&warm, 1000) == 1000 && chip8_run_cycles(&plain, 1000) == 1000);
+    assert(chip8_state_hash(&warm) == chip8_state_hash(&plain));
+
+    // An entry that doesn't hold this ROM is a miss, and gets replaced
+    char entry[4096];
+    chip8_rom_cache_path(entry, sizeof(entry), dir, warm_rom.hash);
+    assert(truncate(entry, 64) == 0);
+    chip8_rom_load(&warm, path, &warm_rom);
+    assert(!warm_rom.cached);
+    chip8_rom_load(&warm, path, &warm_rom);
+    assert(warm_rom.cached);
+
+    // So is one whose decoded entries would index outside the handler table or V, or that
+    // another build wrote
+    size_t offsets[] = {
+        ROM_CACHE_HEADER_SIZE + 0x1000/8 + offsetof(Chip8_Decoded, op),
+        ROM_CACHE_HEADER_SIZE + 0x1000/8 + sizeof(Chip8_Decoded) + offsetof(Chip8_Decoded, x),
+        24,
+    };
+    for (size_t i = 0; i < sizeof(offsets)/sizeof(offsets[0]); i++) {
+        FILE *corrupt = fopen(entry, "r+b");
+        assert(corrupt && fseek(corrupt, (long)offsets[i], SEEK_SET) == 0 && fputc(0xff, corrupt) == 0xff && fclose(corrupt) == 0);
+        chip8_rom_load(&warm, path, &warm_rom);
+        assert(!warm_rom.cached);
+        assert(memcmp(warm.decoded, cold.decoded, sizeof(warm.decoded)) == 0);
+    }
+
+    // The fingerprint probe makes every superinstruction, a ROM chip8_load_rom_as won't take isn't analyzed
+    static Chip8_Rom_Analysis probe;
+    assert(!chip8_rom_analyze(big, sizeof(big), &probe));
+    assert(chip8_rom_analyze((const char*)chip8_rom_probe, sizeof(chip8_rom_probe), &probe));
+    for (int op = CHIP8_OP_INVALID + 1; op < CHIP8_OP_COUNT; op++) {
+        bool made = false;
+        for (size_t pc = 0x200; pc < 0x200 + sizeof(chip8_rom_probe); pc += 2) made |= probe.decoded[pc >> 1].op == op;
+        assert(made);
+    }
+
+    unlink(entry);
+    unlink(path);
+    rmdir(dir);
+    unsetenv("CHIP8_CACHE_DIR");
+}
 
 int main(void)
 {
@@ -47,5 +1166,28 @@ int main(void)
 
     chip8_dump(&cpu);
 
+    test_run_cycles();
+    test_keys();
+    test_self_modifying_code();
+    test_draw_wraps_and_collides();
+    test_dirty_rows();
+    test_pool();
+    test_arena();
+    test_lockstep();
+    test_trace();
+    test_snapshot();
+    test_rewind();
+    test_idle_skip();
+    test_input_queue();
+    test_frame_buffer();
+    test_quirks();
+#ifdef CHIP8_PROFILING
+    test_profiling();
+#endif
+    test_exec_trace();
+    test_call_stack();
+    test_fusion();
+    test_rom_cache();
+
     return 0;
 }
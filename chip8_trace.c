@@ -0,0 +1,181 @@
+// Input traces: record the keyboard of a session and replay it bit-exactly, include after chip8.c.
+//
+// Since CXNN draws from the per-instance seed, a run is fully determined by the ROM, the seed, the
+// clock rate and the cycles at which keys went down and up. A trace stores exactly that, plus the
+// cycle count and chip8_state_hash at the end of the session, so a replay can run headless as fast
+// as the interpreter goes and then check that it ended up in the very same state.
+//
+// Layout, integers little-endian:
+//   0   4  "C8TR"
+//   4   4  TRACE_VERSION
+//   8   4  rng_state when recording began
+//   12  4  clock_rate (0 means CLOCK_RATE)
+//   16  8  FNV-1a hash of the ROM
+//   24  4  Chip8.profile
+//   28  .. one unsigned LEB128 per key transition: cycles since the previous one << 5 | pressed << 4 | key
+//   -16 8  cycles at the end of the session
+//   -8  8  chip8_state_hash at the end of the session
+// A key transition usually takes one or two bytes.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 28
+#define TRACE_FOOTER_SIZE 16
+
+typedef struct Chip8_Trace {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint64_t last_cycle; // Cycle of the previous key transition
+} Chip8_Trace;
+
+static void chip8_trace_reserve(Chip8_Trace *trace, size_t extra)
+{
+    if (trace->size + extra <= trace->capacity) return;
+    size_t capacity = trace->capacity != 0 ? trace->capacity*2 : 4096;
+    while (capacity < trace->size + extra) capacity *= 2;
+    trace->data = realloc(trace->data, capacity);
+    if (!trace->data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    trace->capacity = capacity;
+}
+
+static void chip8_trace_put(Chip8_Trace *trace, uint64_t value, int bytes)
+{
+    chip8_trace_reserve(trace, bytes);
+    for (int i = 0; i < bytes; i++) {
+        trace->data[trace->size++] = (uint8_t)(value >> (8*i));
+    }
+}
+
+static uint64_t chip8_trace_get(const uint8_t *data, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)data[i] << (8*i);
+    }
+    return value;
+}
+
+// Starts recording `cpu`, which must have just been loaded with `rom_bytes` and seeded
+void chip8_trace_begin(Chip8_Trace *trace, const Chip8 *cpu, const char *rom_bytes, size_t rom_size)
+{
+    memset(trace, 0, sizeof(*trace));
+    chip8_trace_reserve(trace, TRACE_HEADER_SIZE);
+    memcpy(trace->data, "C8TR", 4);
+    trace->size = 4;
+    chip8_trace_put(trace, TRACE_VERSION, 4);
+    chip8_trace_put(trace, cpu->rng_state, 4);
+    chip8_trace_put(trace, cpu->clock_rate, 4);
+    chip8_trace_put(trace, chip8_rom_hash(rom_bytes, rom_size), 8);
+    chip8_trace_put(trace, cpu->profile, 4);
+    trace->last_cycle = cpu->cycles;
+}
+
+// Records that `key` went down or up, call it along with every chip8_set_key
+void chip8_trace_key(Chip8_Trace *trace, const Chip8 *cpu, uint8_t key, bool pressed)
+{
+    uint64_t record = (cpu->cycles - trace->last_cycle) << 5 | (uint64_t)pressed << 4 | (key & 0xf);
+    trace->last_cycle = cpu->cycles;
+
+    chip8_trace_reserve(trace, 10);
+    do {
+        uint8_t byte = record & 0x7f;
+        record >>= 7;
+        trace->data[trace->size++] = byte | (record != 0 ? 0x80 : 0);
+    } while (record != 0);
+}
+
+// Closes the trace with the final state of `cpu`, no transitions can be recorded afterwards
+void chip8_trace_end(Chip8_Trace *trace, const Chip8 *cpu)
+{
+    chip8_trace_put(trace, cpu->cycles, 8);
+    chip8_trace_put(trace, chip8_state_hash(cpu), 8);
+}
+
+bool chip8_trace_save(const Chip8_Trace *trace, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(trace->data, 1, trace->size, f) == trace->size;
+    return fclose(f) == 0 && ok;
+}
+
+void chip8_trace_free(Chip8_Trace *trace)
+{
+    free(trace->data);
+    memset(trace, 0, sizeof(*trace));
+}
+
+// Runs until cpu->cycles reaches `cycle`, nothing but the cycle count ends the run early
+static void chip8_trace_run_until(Chip8 *cpu, uint64_t cycle)
+{
+    cpu->stop_on = 0;
+    while (cpu->cycles < cycle) {
+        uint64_t left = cycle - cpu->cycles;
+        chip8_run_cycles(cpu, left < UINT32_MAX ? (uint32_t)left : UINT32_MAX);
+    }
+}
+
+// Resets `cpu` to `rom_bytes` and replays the trace on it. Returns NULL when the replay ended in
+// the recorded state, otherwise why it didn't. `keys` (may be NULL) gets the number of transitions.
+const char *chip8_trace_replay(const uint8_t *data, size_t size, Chip8 *cpu, const char *rom_bytes, size_t rom_size, uint64_t *keys)
+{
+    if (size < TRACE_HEADER_SIZE + TRACE_FOOTER_SIZE || memcmp(data, "C8TR", 4) != 0) {
+        return "not a trace";
+    }
+    if (chip8_trace_get(data + 4, 4) != TRACE_VERSION) {
+        return "unsupported trace version";
+    }
+    uint64_t profile = chip8_trace_get(data + 24, 4);
+    if (profile >= CHIP8_PROFILE_COUNT) {
+        return "unknown quirk profile";
+    }
+    if (chip8_trace_get(data + 16, 8) != chip8_rom_hash(rom_bytes, rom_size)) {
+        return "trace was recorded with a different ROM";
+    }
+
+    memset(cpu, 0, sizeof(*cpu));
+    chip8_load_sprites(cpu);
+    if (!chip8_load_rom(cpu, rom_bytes, rom_size)) {
+        return "ROM does not fit in memory";
+    }
+    chip8_seed(cpu, (uint32_t)chip8_trace_get(data + 8, 4));
+    cpu->clock_rate = (uint32_t)chip8_trace_get(data + 12, 4);
+    cpu->profile = (uint8_t)profile;
+
+    const uint8_t *p = data + TRACE_HEADER_SIZE;
+    const uint8_t *end = data + size - TRACE_FOOTER_SIZE;
+    uint64_t count = 0;
+    while (p < end) {
+        uint64_t record = 0;
+        int shift = 0;
+        do {
+            if (p == end || shift > 63) return "truncated key transition";
+            record |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+
+        chip8_trace_run_until(cpu, cpu->cycles + (record >> 5));
+        chip8_set_key(cpu, record & 0xf, (record >> 4) & 1);
+        count += 1;
+    }
+    if (keys) *keys = count;
+
+    uint64_t final_cycles = chip8_trace_get(end, 8);
+    if (cpu->cycles > final_cycles) {
+        return "key transition after the end of the trace";
+    }
+    chip8_trace_run_until(cpu, final_cycles);
+    if (chip8_state_hash(cpu) != chip8_trace_get(end + 8, 8)) {
+        return "final state differs from the recording";
+    }
+    return NULL;
+}
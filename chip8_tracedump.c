@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./chip8.c"
+#include "./chip8_exec_trace.c"
+
+// Decoder for execution traces written by chip8.sdl -x (see chip8_exec_trace.c): prints the
+// records left in the ring, oldest first, one instruction per line with chip8_decode's
+// disassembly, I and the register it changed.
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s <trace> [-n records]\n", program);
+    fprintf(stderr, "  Prints the instructions kept in an execution trace, -n only the last that many\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+
+    uint64_t limit = UINT64_MAX;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            limit = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    uint8_t profile = 0;
+    const char *error = NULL;
+    const Chip8_Exec_Trace *trace = chip8_exec_trace_map(argv[1], &profile, &error);
+    if (!trace) {
+        fprintf(stderr, "Failed to read trace %s: %s\n", argv[1], error);
+        exit(1);
+    }
+
+    uint64_t capacity = (uint64_t)trace->mask + 1;
+    uint64_t kept = trace->count < capacity ? trace->count : capacity;
+    uint64_t shown = kept < limit ? kept : limit;
+    printf("; %llu instructions executed, last %llu kept, quirk profile %s\n",
+           (unsigned long long)trace->count, (unsigned long long)kept,
+           profile < CHIP8_PROFILE_COUNT ? chip8_profile_names[profile] : "unknown");
+
+    for (uint64_t n = trace->count - shown; n < trace->count; n++) {
+        const Chip8_Exec_Record *r = &trace->records[n & trace->mask];
+        printf("%12llu  0x%03x: %04x  %-40s I=0x%03x",
+               (unsigned long long)r->cycle, r->pc, r->inst, chip8_decode(NULL, r->inst), r->I);
+        if (r->reg != CHIP8_EXEC_NO_REG) printf("  V%X=0x%02x", r->reg, r->value);
+        printf("\n");
+    }
+
+    chip8_exec_trace_unmap(trace);
+    return 0;
+}
@@ -1,7 +1,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-extern int rand(void);
 #include "./chip8.c"
 
 #define SCALE 10
@@ -11,7 +10,19 @@ extern int rand(void);
 #define BG_COLOR 0x111111ff // RRGGBBAA
 #define FG_COLOR 0x117821ff // RRGGBBAA
 
+// ImageData wants R, G, B, A bytes in memory, which is 0xAABBGGRR as a little endian word
+#define TO_IMAGE_DATA(c) __builtin_bswap32(c)
+
 static Chip8 cpu;
+static uint32_t repaint_rows; // Rows to repaint on top of the ones the core reports
+static float elapsed_ms;      // Fraction of a millisecond chip8_run_for hasn't been given yet
+
+// 64x32 RGBA pixels that JS wraps in a single ImageData
+static uint32_t framebuffer[64*32];
+uint32_t *get_framebuffer(void)
+{
+    return framebuffer;
+}
 
 uint8_t rom_bytes[0x1000];
 uint8_t *get_rom(void)
@@ -21,7 +32,6 @@ uint8_t *get_rom(void)
 
 extern void print(const char *str, int len);
 extern void print_num(float);
-extern void fill_rect(float x, float y, float w, float h, int r, int g, int b);
 extern void set_dimensions(size_t width, size_t height);
 
 size_t strlen(const char *s)
@@ -34,12 +44,27 @@ size_t strlen(const char *s)
     return size;
 }
 
-void game_init(float rom_size)
+// Built with -mbulk-memory, so these lower to memory.copy/memory.fill instead of calling back into JS
+void *memcpy(void *dst, const void *src, size_t size)
+{
+    return __builtin_memcpy(dst, src, size);
+}
+
+void *memset(void *dst, int value, size_t size)
+{
+    return __builtin_memset(dst, value, size);
+}
+
+// `seed` seeds CXNN, the page passes a random one so every load plays differently
+void game_init(float rom_size, uint32_t seed)
 {
     set_dimensions(WIDTH, HEIGHT);
     cpu = (Chip8){0};
     chip8_load_sprites(&cpu);
     chip8_load_rom(&cpu, (char*)rom_bytes, rom_size);
+    chip8_seed(&cpu, seed);
+    repaint_rows = 0xffffffff;
+    elapsed_ms = 0;
 
     const char *msg = "Game Initialized! Rom size:";
     print(msg, strlen(msg));
@@ -49,20 +74,27 @@ void game_init(float rom_size)
 void game_input(char key, bool press_or_release)
 {
     if (key >= '0' && key <= '9') {
-        cpu.keyboard[key - '0'] = press_or_release ? 1 : 0;
+        chip8_set_key(&cpu, key - '0', press_or_release);
     } else if (key >= 'a' && key <= 'f') {
-        cpu.keyboard[key - 'a' + 10] = press_or_release ? 1 : 0;
+        chip8_set_key(&cpu, key - 'a' + 10, press_or_release);
     }
 }
 
-void game_update(float dt)
+// Returns true when the framebuffer changed and should be blitted
+bool game_update(float dt)
 {
-    chip8_step(&cpu, dt);
+    // requestAnimationFrame deltas aren't whole milliseconds (16.67 at 60 Hz), the fraction
+    // carries over so the clock doesn't run slow
+    elapsed_ms += dt;
+    uint32_t ms = (uint32_t)elapsed_ms;
+    elapsed_ms -= ms;
+    chip8_run_for(&cpu, ms);
 
+    uint32_t dirty = repaint_rows | chip8_take_dirty_rows(&cpu);
+    repaint_rows = 0;
     for (int row = 0; row < 32; row++) {
-        for (int col = 0; col < 64; col++) {
-            uint8_t color = cpu.display[row*64 + col] > 0 ? 0xff : 0x00;
-            fill_rect(col*SCALE, row*SCALE, SCALE, SCALE, color, color, color);
-        }
+        if ((dirty & (1u << row)) == 0) continue;
+        chip8_unpack_row(cpu.display[row], &framebuffer[row*64], TO_IMAGE_DATA(FG_COLOR), TO_IMAGE_DATA(BG_COLOR));
     }
+    return dirty != 0;
 }
@@ -3,14 +3,17 @@ const ctx = canvas.getContext("2d");
 
 const wasm = await WebAssembly.instantiateStreaming(
     fetch("chip8.wasm"),
-    {env: {rand, print, print_num, fill_rect, memcpy, memset, set_dimensions}}
+    {env: {print, print_num, set_dimensions}}
 );
-const { memory, game_init, game_input, game_update, get_rom } = wasm.instance.exports;
+const { memory, game_init, game_input, game_update, get_rom, get_framebuffer } = wasm.instance.exports;
 //console.log(wasm);
 
 const game_memory = new Uint8Array(memory.buffer);
 const rom_start = get_rom();
 
+// The module fills this in place; one putImageData per changed frame, the canvas CSS size does the scaling
+const framebuffer = new ImageData(new Uint8ClampedArray(memory.buffer, get_framebuffer(), 64*32*4), 64, 32);
+
 const roms = [
     "15PUZZLE", "BLINKY", "BLITZ", "BRIX", "CONNECT4", "GUESS", "HIDDEN", "INVADERS",
     "KALEID", "MAZE", "MERLIN", "MISSILE", "PONG", "PONG2", "PUZZLE", "SYZYGY",
@@ -27,25 +30,23 @@ selectRoms.onchange = (e) => {
     (async () => {
         const rom_name = selectRoms.options[selectRoms.selectedIndex].value;
         const rom_bytes = new Uint8Array(await (await fetch(`./ROMS/${rom_name}`)).arrayBuffer());
-        for (let i = 0; i < rom_bytes.length; i++) {
-            game_memory[rom_start + i] = rom_bytes[i];
-        }
-        game_init(rom_bytes.length);
+        game_memory.set(rom_bytes, rom_start);
+        game_init(rom_bytes.length, random_seed());
     })();
 };
 
 const rom_bytes = new Uint8Array(await (await fetch(`./ROMS/${selectRoms.options[selectRoms.selectedIndex].value}`)).arrayBuffer());
-for (let i = 0; i < rom_bytes.length; i++) {
-    game_memory[rom_start + i] = rom_bytes[i];
-}
-game_init(rom_bytes.length);
+game_memory.set(rom_bytes, rom_start);
+game_init(rom_bytes.length, random_seed());
 
 let prevTime = 0;
 function step(currTime) {
     const dt = currTime - prevTime;
     prevTime = currTime;
 
-    game_update(dt);
+    if (game_update(dt)) {
+        ctx.putImageData(framebuffer, 0, 0);
+    }
 
     window.requestAnimationFrame(step);
 }
@@ -59,36 +60,25 @@ document.addEventListener("keyup", e => {
     game_input(e.key.charCodeAt(0), false);
 });
 
-function fill_rect(x, y, w, h, r, g, b) {
-    ctx.fillStyle = `rgb(${r}, ${g}, ${b})`;
-    ctx.fillRect(x, y, w, h);
-}
-
 function print(ptr, len) {
     const buf = new Uint8Array(memory.buffer, ptr, len);
     const str = new TextDecoder().decode(buf);
     console.log(str);
 }
 
+// CXNN draws from a generator seeded by game_init, without this every page load would roll the same
+function random_seed() {
+    return Math.random()*2**32 >>> 0;
+}
+
 function print_num(x) {
     console.log(x);
 }
 
 function set_dimensions(w, h) {
-    canvas.width = w;
-    canvas.height = h;
-}
-
-function rand() {
-    return Math.floor(Math.random() * 0x7FFF/*RAND_MAX*/);
-}
-function memcpy(dst, src, size) {
-    for (let i = 0; i < size; i++) {
-        game_memory[dst + i] = game_memory[src + i];
-    }
-}
-function memset(dst, value, size) {
-    for (let i = 0; i < size; i++) {
-        game_memory[dst + i] = value;
-    }
+    canvas.width = 64;
+    canvas.height = 32;
+    canvas.style.width = `${w}px`;
+    canvas.style.height = `${h}px`;
+    canvas.style.imageRendering = "pixelated";
 }
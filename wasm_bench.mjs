@@ -0,0 +1,30 @@
+// Headless timing of the WASM frontend: node wasm_bench.mjs [frames] [ROM name...]
+import { readFile, readdir } from "node:fs/promises";
+
+const FRAME_MS = 1000/60;
+
+const args = process.argv.slice(2);
+const frames = args.length > 0 && /^\d+$/.test(args[0]) ? Number(args.shift()) : 10000;
+const roms = args.length > 0 ? args : (await readdir("ROMS")).sort();
+
+const wasm = await WebAssembly.instantiate(await readFile("chip8.wasm"), {env: {
+    print: () => {},
+    print_num: () => {},
+    set_dimensions: () => {},
+}});
+const { memory, game_init, game_update, get_rom } = wasm.instance.exports;
+
+console.log("rom,frames,changed_frames,us_per_update");
+for (const rom of roms) {
+    const rom_bytes = new Uint8Array(await readFile(`ROMS/${rom}`));
+    new Uint8Array(memory.buffer).set(rom_bytes, get_rom());
+    game_init(rom_bytes.length, 1); // Fixed seed, every run times the same frames
+
+    let changed = 0;
+    const start = process.hrtime.bigint();
+    for (let i = 0; i < frames; i++) {
+        if (game_update(FRAME_MS)) changed += 1;
+    }
+    const elapsed = Number(process.hrtime.bigint() - start);
+    console.log(`${rom},${frames},${changed},${(elapsed/1e3/frames).toFixed(3)}`);
+}